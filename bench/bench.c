@@ -0,0 +1,698 @@
+#include <util/except.h>
+#include <mem/pmm.h>
+#include <mem/slab.h>
+#include <mem/tlsf.h>
+
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "replay.h"
+#include "vmm.h"
+#include "host.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Pick a random size in [min, max], biased towards small sizes like
+ * real allocation patterns are
+ */
+static size_t bench_rand_size(uint64_t* state, size_t min, size_t max) {
+    int min_log = LOG2(min);
+    int max_log = LOG2(max);
+    int log = min_log + (int)(bench_rand(state) % (max_log - min_log + 1));
+    size_t size = (1ull << log) + bench_rand(state) % (1ull << log);
+    return MIN(MAX(size, min), max);
+}
+
+/**
+ * How much of the free physical memory can't be used for 2MB pages, 0 means
+ * all the free memory is in huge pages, pages cached in the magazines and the
+ * zero pool count as free
+ */
+static double pmm_fragmentation(size_t used_pages) {
+    size_t free_pages = g_bench_total_pages - used_pages;
+    size_t huge_pages = pmm_count_free_huge(SIZE_2MB) * (SIZE_2MB / PAGE_SIZE);
+    if (free_pages == 0) {
+        return 0;
+    }
+    return 1.0 - (double)huge_pages / (double)free_pages;
+}
+
+static size_t pages_of(size_t size) {
+    size_t pages = SIZE_TO_PAGES(size);
+    return pages <= 1 ? 1 : 1ull << (LOG2(pages - 1) + 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Single producer single consumer ring, for the cross cpu benchmarks
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define RING_SIZE 1024
+
+//
+// The waits yield instead of spinning so the benchmark still makes
+// progress on hosts with less cores than benchmark threads
+//
+
+typedef struct ring {
+    _Atomic(size_t) head __attribute__((aligned(64)));
+    _Atomic(size_t) tail __attribute__((aligned(64)));
+    void* items[RING_SIZE];
+} ring_t;
+
+static void ring_push(ring_t* ring, void* item) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SIZE) {
+        sched_yield();
+    }
+    ring->items[head % RING_SIZE] = item;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void* ring_pop(ring_t* ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+        sched_yield();
+    }
+    void* item = ring->items[tail % RING_SIZE];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return item;
+}
+
+typedef struct producer_consumer {
+    ring_t ring;
+    size_t count;
+    size_t size;
+    bool use_tlsf;
+    kmem_cache_t* cache;
+} producer_consumer_t;
+
+static void* bench_alloc(producer_consumer_t* pc) {
+    if (pc->cache != NULL) {
+        return kmem_cache_alloc(pc->cache);
+    } else if (pc->use_tlsf) {
+        acquire_lock(&g_bench_tlsf_lock);
+        void* ptr = tlsf_malloc(&g_bench_tlsf, pc->size);
+        release_lock(&g_bench_tlsf_lock);
+        return ptr;
+    } else {
+        return palloc(pc->size);
+    }
+}
+
+static void bench_free(producer_consumer_t* pc, void* ptr) {
+    if (pc->cache != NULL) {
+        kmem_cache_free(pc->cache, ptr);
+    } else if (pc->use_tlsf) {
+        acquire_lock(&g_bench_tlsf_lock);
+        tlsf_free(&g_bench_tlsf, ptr);
+        release_lock(&g_bench_tlsf_lock);
+    } else {
+        pfree(ptr, pc->size);
+    }
+}
+
+static void* consumer_thread(void* arg) {
+    producer_consumer_t* pc = arg;
+    bench_set_cpu(1);
+    for (size_t i = 0; i < pc->count; i++) {
+        bench_free(pc, ring_pop(&pc->ring));
+    }
+    return NULL;
+}
+
+/**
+ * Allocate on cpu 0 and free everything on cpu 1
+ */
+static uint64_t run_producer_consumer(producer_consumer_t* pc) {
+    pthread_t consumer;
+    uint64_t start = bench_now_ns();
+    ASSERT(pthread_create(&consumer, NULL, consumer_thread, pc) == 0);
+
+    for (size_t i = 0; i < pc->count; i++) {
+        void* ptr = bench_alloc(pc);
+        ASSERT(ptr != NULL);
+        ring_push(&pc->ring, ptr);
+    }
+
+    pthread_join(consumer, NULL);
+    return bench_now_ns() - start;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// PMM benchmarks
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Allocate and free single pages in small bursts, this is the path
+ * page faults and page tables take
+ */
+static void bench_pmm_single_page() {
+    enum { BURST = 64, ROUNDS = 32768 };
+    static directptr_t pages[BURST];
+
+    uint64_t start = bench_now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < BURST; i++) {
+            pages[i] = palloc(PAGE_SIZE);
+        }
+        for (int i = 0; i < BURST; i++) {
+            pfree(pages[i], PAGE_SIZE);
+        }
+    }
+    uint64_t ns = bench_now_ns() - start;
+
+    bench_report("pmm single page burst", BURST * ROUNDS * 2, ns, "");
+}
+
+/**
+ * Allocate and free 2MB worth of single pages at a time, like
+ * populating a big mapping would
+ */
+static void bench_pmm_bulk() {
+    enum { COUNT = 512, ROUNDS = 4096 };
+    static directptr_t pages[COUNT];
+
+    uint64_t start = bench_now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        ASSERT(palloc_bulk(COUNT, pages) == COUNT);
+        pfree_bulk(COUNT, pages);
+    }
+    uint64_t ns = bench_now_ns() - start;
+
+    bench_report("pmm bulk 512 pages", COUNT * ROUNDS * 2, ns, "");
+}
+
+/**
+ * Allocate pages spread over all the cache colors
+ */
+static void bench_pmm_spread() {
+    enum { COUNT = 64, ROUNDS = 16384 };
+    static directptr_t pages[COUNT];
+    size_t colors = pmm_color_count();
+
+    uint64_t start = bench_now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        ASSERT(palloc_spread(COUNT, pages) == COUNT);
+        for (int i = 1; i < MIN(COUNT, colors); i++) {
+            ASSERT(pmm_page_color(pages[i]) != pmm_page_color(pages[0]));
+        }
+        pfree_bulk(COUNT, pages);
+    }
+    uint64_t ns = bench_now_ns() - start;
+
+    char extra[64];
+    snprintf(extra, sizeof(extra), "%lu colors", colors);
+    bench_report("pmm spread 64 pages", COUNT * ROUNDS * 2, ns, extra);
+}
+
+/**
+ * Random alloc/free of mostly small blocks with a few big ones
+ */
+static void bench_pmm_random_sizes() {
+    enum { SLOTS = 4096, OPS = 2000000 };
+    static directptr_t ptrs[SLOTS];
+    static size_t sizes[SLOTS];
+    uint64_t state = 0x5eed;
+    size_t used_pages = 0;
+    size_t failed = 0;
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < OPS; i++) {
+        size_t slot = bench_rand(&state) % SLOTS;
+        if (ptrs[slot] != NULL) {
+            pfree(ptrs[slot], sizes[slot]);
+            used_pages -= pages_of(sizes[slot]);
+            ptrs[slot] = NULL;
+        } else {
+            // 3/4 of the allocations are single pages, the rest up to 4MB
+            sizes[slot] = (bench_rand(&state) % 4) ? PAGE_SIZE : bench_rand_size(&state, PAGE_SIZE * 2, SIZE_4MB);
+            ptrs[slot] = palloc(sizes[slot]);
+            if (ptrs[slot] != NULL) {
+                used_pages += pages_of(sizes[slot]);
+            } else {
+                failed++;
+            }
+        }
+    }
+    uint64_t ns = bench_now_ns() - start;
+
+    char extra[128];
+    snprintf(extra, sizeof(extra), "used %lu MB, fragmentation %.1f%%, %lu failed",
+             used_pages * PAGE_SIZE / SIZE_1MB, pmm_fragmentation(used_pages) * 100, failed);
+    bench_report("pmm random sizes", OPS, ns, extra);
+
+    for (int i = 0; i < SLOTS; i++) {
+        if (ptrs[i] != NULL) {
+            pfree(ptrs[i], sizes[i]);
+            ptrs[i] = NULL;
+        }
+    }
+}
+
+static void bench_pmm_producer_consumer() {
+    static producer_consumer_t pc = { .count = 2000000, .size = PAGE_SIZE, .use_tlsf = false };
+    uint64_t ns = run_producer_consumer(&pc);
+    bench_report("pmm producer/consumer (2 cpus)", pc.count * 2, ns, "");
+}
+
+/**
+ * Fill the whole memory with single pages, mixing movable and unmovable
+ * allocations, then free all the movable ones and see how many huge
+ * pages we get back
+ */
+static void bench_pmm_fragmentation_stress() {
+    size_t capacity = g_bench_total_pages;
+    directptr_t* ptrs = calloc(capacity, sizeof(directptr_t));
+    bool* movable = calloc(capacity, sizeof(bool));
+    uint64_t state = 0xf4a9;
+    size_t huge_before = pmm_count_free_huge(SIZE_2MB);
+    size_t count = 0;
+    char extra[128];
+
+    // fill everything, a quarter of the pages are unmovable
+    uint64_t start = bench_now_ns();
+    while (count < capacity) {
+        movable[count] = bench_rand(&state) % 4 != 0;
+        ptrs[count] = movable[count] ? palloc_movable(PAGE_SIZE) : palloc(PAGE_SIZE);
+        if (ptrs[count] == NULL) {
+            break;
+        }
+        count++;
+    }
+    uint64_t ns = bench_now_ns() - start;
+    snprintf(extra, sizeof(extra), "filled %lu MB", count * PAGE_SIZE / SIZE_1MB);
+    bench_report("pmm fill memory (mixed groups)", count, ns, extra);
+
+    // free all the movable pages
+    size_t used_pages = count;
+    start = bench_now_ns();
+    for (size_t i = 0; i < count; i++) {
+        if (movable[i]) {
+            pfree(ptrs[i], PAGE_SIZE);
+            ptrs[i] = NULL;
+            used_pages--;
+        }
+    }
+    ns = bench_now_ns() - start;
+    snprintf(extra, sizeof(extra), "unmovable %lu MB, %lu free 2MB pages, fragmentation %.1f%%",
+             used_pages * PAGE_SIZE / SIZE_1MB, pmm_count_free_huge(SIZE_2MB),
+             pmm_fragmentation(used_pages) * 100);
+    bench_report("pmm free movable", count - used_pages, ns, extra);
+
+    // free the rest and make sure everything merged back
+    for (size_t i = 0; i < count; i++) {
+        if (ptrs[i] != NULL) {
+            pfree(ptrs[i], PAGE_SIZE);
+        }
+    }
+    size_t huge_after = pmm_count_free_huge(SIZE_2MB);
+    if (huge_after + BENCH_MAX_CPUS * 2 < huge_before) {
+        WARN("only %lu of %lu 2MB pages are available after freeing everything", huge_after, huge_before);
+    }
+
+    free(ptrs);
+    free(movable);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// TLSF benchmarks
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * How much of the arena is not used by live allocations
+ */
+static double tlsf_fragmentation(size_t live_bytes) {
+    if (g_bench_tlsf.size == 0) {
+        return 0;
+    }
+    return 1.0 - (double)live_bytes / (double)g_bench_tlsf.size;
+}
+
+static void bench_tlsf_random_sizes() {
+    enum { SLOTS = 8192, OPS = 4000000 };
+    static void* ptrs[SLOTS];
+    static size_t sizes[SLOTS];
+    uint64_t state = 0x71f5;
+    size_t live_bytes = 0;
+    size_t peak_arena = 0;
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < OPS; i++) {
+        size_t slot = bench_rand(&state) % SLOTS;
+        acquire_lock(&g_bench_tlsf_lock);
+        if (ptrs[slot] != NULL) {
+            tlsf_free(&g_bench_tlsf, ptrs[slot]);
+            live_bytes -= sizes[slot];
+            ptrs[slot] = NULL;
+        } else {
+            sizes[slot] = bench_rand_size(&state, 16, 4096);
+            ptrs[slot] = tlsf_malloc(&g_bench_tlsf, sizes[slot]);
+            ASSERT(ptrs[slot] != NULL);
+            live_bytes += sizes[slot];
+        }
+        release_lock(&g_bench_tlsf_lock);
+        peak_arena = MAX(peak_arena, g_bench_tlsf.size);
+    }
+    uint64_t ns = bench_now_ns() - start;
+
+    char extra[128];
+    snprintf(extra, sizeof(extra), "live %lu KB, arena %lu KB (peak %lu KB), fragmentation %.1f%%",
+             live_bytes / SIZE_1KB, g_bench_tlsf.size / SIZE_1KB, peak_arena / SIZE_1KB,
+             tlsf_fragmentation(live_bytes) * 100);
+    bench_report("tlsf random sizes", OPS, ns, extra);
+
+    for (int i = 0; i < SLOTS; i++) {
+        if (ptrs[i] != NULL) {
+            tlsf_free(&g_bench_tlsf, ptrs[i]);
+            ptrs[i] = NULL;
+        }
+    }
+}
+
+static void bench_tlsf_producer_consumer() {
+    static producer_consumer_t pc = { .count = 2000000, .size = 64, .use_tlsf = true };
+    uint64_t ns = run_producer_consumer(&pc);
+    bench_report("tlsf producer/consumer (2 cpus)", pc.count * 2, ns, "");
+}
+
+/**
+ * Free every other small block and then ask for slightly bigger blocks,
+ * none of the holes can be reused so the arena has to grow
+ */
+static void bench_tlsf_fragmentation_stress() {
+    enum { COUNT = 65536 };
+    static void* small[COUNT];
+    static void* big[COUNT / 2];
+    size_t live_bytes = 0;
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < COUNT; i++) {
+        small[i] = tlsf_malloc(&g_bench_tlsf, 64);
+        live_bytes += 64;
+    }
+    for (int i = 0; i < COUNT; i += 2) {
+        tlsf_free(&g_bench_tlsf, small[i]);
+        live_bytes -= 64;
+    }
+    for (int i = 0; i < COUNT / 2; i++) {
+        big[i] = tlsf_malloc(&g_bench_tlsf, 128);
+        live_bytes += 128;
+    }
+    uint64_t ns = bench_now_ns() - start;
+
+    char extra[128];
+    snprintf(extra, sizeof(extra), "live %lu KB, arena %lu KB, fragmentation %.1f%%",
+             live_bytes / SIZE_1KB, g_bench_tlsf.size / SIZE_1KB, tlsf_fragmentation(live_bytes) * 100);
+    bench_report("tlsf interleaved free", COUNT * 2, ns, extra);
+
+    for (int i = 1; i < COUNT; i += 2) {
+        tlsf_free(&g_bench_tlsf, small[i]);
+    }
+    for (int i = 0; i < COUNT / 2; i++) {
+        tlsf_free(&g_bench_tlsf, big[i]);
+    }
+}
+
+/**
+ * Allocate zeroed 64KB blocks, the first round mostly gets memory the arena never
+ * handed out and skips the memset, the second round reuses the freed blocks
+ */
+static void bench_tlsf_zeroed() {
+    enum { COUNT = 2048, SIZE = 64 * SIZE_1KB, ROUNDS = 2 };
+    static void* ptrs[COUNT];
+    static bool zero[COUNT];
+    uint64_t state = 0x2e40;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        size_t skipped = 0;
+
+        uint64_t start = bench_now_ns();
+        for (int i = 0; i < COUNT; i++) {
+            ptrs[i] = tlsf_malloc_zero(&g_bench_tlsf, SIZE, &zero[i]);
+            ASSERT(ptrs[i] != NULL);
+            if (zero[i]) {
+                skipped++;
+            } else {
+                memset(ptrs[i], 0, SIZE);
+            }
+        }
+        uint64_t ns = bench_now_ns() - start;
+
+        // make sure the blocks we did not zero are really zero, and then
+        // dirty them like a real user would
+        for (int i = 0; i < COUNT; i++) {
+            uint8_t* bytes = ptrs[i];
+            for (size_t j = 0; zero[i] && j < SIZE; j++) {
+                ASSERT(bytes[j] == 0);
+            }
+            memset(bytes, 0xAA, SIZE);
+        }
+
+        char name[64];
+        char extra[128];
+        snprintf(name, sizeof(name), "tlsf zeroed 64KB (round %d)", round + 1);
+        snprintf(extra, sizeof(extra), "%lu%% known zero", skipped * 100 / COUNT);
+        bench_report(name, COUNT, ns, extra);
+
+        // free in a random order so the blocks merge in different ways
+        for (int i = COUNT - 1; i > 0; i--) {
+            size_t j = bench_rand(&state) % (i + 1);
+            void* tmp = ptrs[i];
+            ptrs[i] = ptrs[j];
+            ptrs[j] = tmp;
+        }
+        for (int i = 0; i < COUNT; i++) {
+            tlsf_free(&g_bench_tlsf, ptrs[i]);
+        }
+    }
+}
+
+/**
+ * Free most of a big heap and release the pages behind the free blocks,
+ * the released blocks must come back as known zero memory
+ */
+static void bench_tlsf_trim() {
+    enum { COUNT = 4096, SIZE = 64 * SIZE_1KB };
+    static void* ptrs[COUNT];
+
+    for (int i = 0; i < COUNT; i++) {
+        ptrs[i] = tlsf_malloc(&g_bench_tlsf, SIZE);
+        ASSERT(ptrs[i] != NULL);
+        memset(ptrs[i], 0xAA, SIZE);
+    }
+
+    // keep every fourth block, so the free blocks are ~192KB
+    size_t freed = 0;
+    for (int i = 0; i < COUNT; i++) {
+        if (i % 4 != 0) {
+            tlsf_free(&g_bench_tlsf, ptrs[i]);
+            freed++;
+        }
+    }
+
+    uint64_t start = bench_now_ns();
+    size_t released = tlsf_trim(&g_bench_tlsf, SIZE, PAGE_SIZE);
+    uint64_t ns = bench_now_ns() - start;
+
+    size_t known_zero = 0;
+    for (int i = 0; i < COUNT; i++) {
+        if (i % 4 == 0) {
+            continue;
+        }
+
+        bool zero;
+        ptrs[i] = tlsf_malloc_zero(&g_bench_tlsf, SIZE, &zero);
+        ASSERT(ptrs[i] != NULL);
+        if (zero) {
+            uint8_t* bytes = ptrs[i];
+            for (size_t j = 0; j < SIZE; j++) {
+                ASSERT(bytes[j] == 0);
+            }
+            known_zero++;
+        }
+    }
+
+    char extra[128];
+    snprintf(extra, sizeof(extra), "released %lu MB of %lu MB free, %lu%% known zero after",
+             released / SIZE_1MB, freed * SIZE / SIZE_1MB, known_zero * 100 / freed);
+    bench_report("tlsf trim", freed, ns, extra);
+
+    for (int i = 0; i < COUNT; i++) {
+        tlsf_free(&g_bench_tlsf, ptrs[i]);
+    }
+}
+
+static size_t bench_minor_faults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+/**
+ * Grow a fresh heap with 1MB allocations that are written right away, first
+ * faulting every page in on demand and then mapping the arena as it grows
+ */
+static void bench_tlsf_grow() {
+    enum { COUNT = 64, SIZE = SIZE_1MB };
+    static void* ptrs[COUNT];
+
+    for (int populate = 0; populate < 2; populate++) {
+        bench_reset_heap(populate);
+
+        // only count the faults taken while touching the memory, on the
+        // host populating the range is accounted as faults as well
+        size_t faults = 0;
+        uint64_t start = bench_now_ns();
+        for (int i = 0; i < COUNT; i++) {
+            bool zero;
+            ptrs[i] = tlsf_malloc_zero(&g_bench_tlsf, SIZE, &zero);
+            ASSERT(ptrs[i] != NULL);
+
+            size_t before = bench_minor_faults();
+            if (!zero) {
+                memset(ptrs[i], 0, SIZE);
+            }
+            memset(ptrs[i], 0x55, SIZE);
+            faults += bench_minor_faults() - before;
+        }
+        uint64_t ns = bench_now_ns() - start;
+
+        char extra[128];
+        snprintf(extra, sizeof(extra), "%.1f faults/MB", (double)faults / (double)(COUNT * SIZE / SIZE_1MB));
+        bench_report(populate ? "tlsf grow 1MB (eager)" : "tlsf grow 1MB (demand)", COUNT, ns, extra);
+
+        for (int i = 0; i < COUNT; i++) {
+            tlsf_free(&g_bench_tlsf, ptrs[i]);
+        }
+    }
+
+    bench_reset_heap(false);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Slab benchmarks
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Allocate and free small objects in bursts from a named
+ * cache, like task frames are
+ */
+static void bench_slab_burst() {
+    enum { BURST = 64, ROUNDS = 65536 };
+    static void* objects[BURST];
+    kmem_cache_t* cache = kmem_cache_create("bench-burst", 64);
+    ASSERT(cache != NULL);
+
+    uint64_t start = bench_now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < BURST; i++) {
+            objects[i] = kmem_cache_alloc(cache);
+        }
+        for (int i = 0; i < BURST; i++) {
+            kmem_cache_free(cache, objects[i]);
+        }
+    }
+    uint64_t ns = bench_now_ns() - start;
+
+    bench_report("slab 64b burst", BURST * ROUNDS * 2, ns, "");
+}
+
+/**
+ * The same pattern as the tlsf random sizes benchmark, limited
+ * to the sizes served by the size classes
+ */
+static void bench_slab_random_sizes() {
+    enum { SLOTS = 8192, OPS = 4000000 };
+    static void* ptrs[SLOTS];
+    uint64_t state = 0x71f5;
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < OPS; i++) {
+        size_t slot = bench_rand(&state) % SLOTS;
+        if (ptrs[slot] != NULL) {
+            slab_free(ptrs[slot]);
+            ptrs[slot] = NULL;
+        } else {
+            size_t size = bench_rand_size(&state, 16, SLAB_MAX_SIZE);
+            ptrs[slot] = slab_alloc(size);
+            ASSERT(ptrs[slot] != NULL);
+            ASSERT(slab_object_size(ptrs[slot]) >= size);
+        }
+    }
+    uint64_t ns = bench_now_ns() - start;
+
+    bench_report("slab random sizes", OPS, ns, "");
+
+    for (int i = 0; i < SLOTS; i++) {
+        if (ptrs[i] != NULL) {
+            slab_free(ptrs[i]);
+            ptrs[i] = NULL;
+        }
+    }
+}
+
+/**
+ * Every object is freed by a different cpu than the one that allocated
+ * it, so everything goes through the depot
+ */
+static void bench_slab_producer_consumer() {
+    static producer_consumer_t pc = { .count = 2000000, .size = 64 };
+    pc.cache = kmem_cache_create("bench-pc", pc.size);
+    ASSERT(pc.cache != NULL);
+
+    uint64_t ns = run_producer_consumer(&pc);
+    bench_report("slab producer/consumer (2 cpus)", pc.count * 2, ns, "");
+
+    kmem_cache_reap(pc.cache);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Entry
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv) {
+    init_bench_host();
+
+    // replay a trace instead of running the benchmarks
+    if (argc >= 3 && strcmp(argv[1], "--replay") == 0) {
+        return bench_replay(argv[2], argc >= 4 ? argv[3] : "tlsf");
+    }
+
+    printf("%lu MB of memory, %lu free 2MB pages\n",
+           g_bench_total_pages * PAGE_SIZE / SIZE_1MB, pmm_count_free_huge(SIZE_2MB));
+
+    bench_pmm_single_page();
+    bench_pmm_bulk();
+    bench_pmm_spread();
+    bench_pmm_random_sizes();
+    bench_pmm_producer_consumer();
+    bench_pmm_fragmentation_stress();
+
+    bench_tlsf_random_sizes();
+    bench_tlsf_producer_consumer();
+    bench_tlsf_fragmentation_stress();
+    bench_tlsf_zeroed();
+    bench_tlsf_trim();
+    bench_tlsf_grow();
+
+    bench_slab_burst();
+    bench_slab_random_sizes();
+    bench_slab_producer_consumer();
+
+    bench_vmm();
+
+    if (g_bench_verbose) {
+        pmm_dump_stats();
+        slab_dump_stats();
+    }
+
+    return 0;
+}
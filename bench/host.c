@@ -0,0 +1,201 @@
+#include <util/except.h>
+#include <mem/pmm.h>
+#include <mem/slab.h>
+#include <mem/numa.h>
+#include <mem/vmm.h>
+#include <acpi/acpi.h>
+
+#include <sys/mman.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "host.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The fake machine
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * How much "physical memory" we reserve, the physical address space is mapped
+ * at DIRECT_BASE so the pmm can use the direct map as usual. The memory is only
+ * backed once it is touched, and the allocators never touch the pages they
+ * hand out (other than pallocz)
+ */
+#define BENCH_PHYS_SPAN (BASE_4GB + SIZE_1GB)
+
+/**
+ * The heap arena of the tlsf benchmarks
+ */
+#define BENCH_HEAP_SIZE (SIZE_4GB * 4)
+
+/**
+ * A machine with 1GB of low memory and 1GB of high memory, with a few holes
+ * so not everything is naturally aligned
+ */
+static struct {
+    stivale2_struct_tag_memmap_t tag;
+    stivale2_mmap_entry_t entries[5];
+} g_bench_memmap = {
+    .tag = {
+        .tag = { .identifier = STIVALE2_STRUCT_TAG_MEMMAP_ID },
+        .entries = 5,
+    },
+    .entries = {
+        { .base = 0x00001000, .length = 0x0009e000, .type = STIVALE2_MMAP_USABLE },
+        { .base = 0x000f0000, .length = 0x00010000, .type = STIVALE2_MMAP_RESERVED },
+        { .base = 0x00100000, .length = 0x3fe00000, .type = STIVALE2_MMAP_USABLE },
+        { .base = 0x3ff00000, .length = 0x00100000, .type = STIVALE2_MMAP_ACPI_NVS },
+        { .base = 0x100000000, .length = SIZE_1GB, .type = STIVALE2_MMAP_USABLE },
+    },
+};
+
+size_t g_bench_total_pages = 0;
+
+tlsf g_bench_tlsf = TLSF_INIT;
+lock_t g_bench_tlsf_lock = INIT_LOCK(TPL_HIGH_LEVEL);
+
+static void* g_bench_heap = NULL;
+
+/**
+ * Like the kernel heap, map new ranges of the tlsf arena right away instead
+ * of faulting every page in, the populated size is tracked the same way
+ */
+static bool g_bench_heap_populate = false;
+static size_t g_bench_heap_populated = 0;
+
+bool g_bench_verbose = false;
+
+uintptr_t g_cpu_locals[256];
+size_t g_cpu_count = BENCH_MAX_CPUS;
+__thread size_t g_cpu_id = 0;
+__thread size_t g_lapic_id = 0;
+
+// only used for the period of the pmm stats, a rough value is fine
+uint64_t g_tsc_frequency = 3000000000ull;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Kernel functions the allocators depend on
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void* get_stivale2_tag(uint64_t id) {
+    if (id == STIVALE2_STRUCT_TAG_MEMMAP_ID) {
+        return &g_bench_memmap;
+    }
+    return NULL;
+}
+
+void* acpi_get_table(const char* signature) {
+    // no SRAT, so everything is on a single node
+    return NULL;
+}
+
+directptr_t early_alloc(size_t page_count) {
+    return aligned_alloc(PAGE_SIZE, PAGES_TO_SIZE(page_count));
+}
+
+void* tlsf_resize(tlsf* t, size_t size) {
+    if (size > BENCH_HEAP_SIZE) {
+        return NULL;
+    }
+
+    size_t end = ALIGN_UP(size, PAGE_SIZE);
+    if (g_bench_heap_populate && end > g_bench_heap_populated) {
+        ASSERT(madvise(g_bench_heap + g_bench_heap_populated, end - g_bench_heap_populated, MADV_POPULATE_WRITE) == 0);
+        g_bench_heap_populated = end;
+    }
+
+    return g_bench_heap;
+}
+
+void tlsf_release(tlsf* t, void* addr, size_t size) {
+    // just like unmapping the heap, the next access gets a zeroed page
+    ASSERT(madvise(addr, size, MADV_DONTNEED) == 0);
+}
+
+// the kernel image, only init_vmm maps it and the benchmarks don't call it
+char __kernel_start_text[1];
+char __kernel_end_text[1];
+char __kernel_end_rodata[1];
+char __kernel_end_data[1];
+
+int kheap_node_of(uintptr_t addr) {
+    // there is a single node
+    return 0;
+}
+
+void lapic_send_fixed_ipi(uint32_t apic_id, uint8_t vector) {
+    // there are no interrupts, the other cpus handle
+    // the shootdown once they spin or poll for it
+}
+
+void cpu_spin() {
+    vmm_handle_shootdown();
+
+    // there might be more benchmark threads than host cores, so
+    // let the thread we are waiting for run instead of spinning
+    sched_yield();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Host setup
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void init_bench_host() {
+    g_bench_verbose = getenv("BENCH_VERBOSE") != NULL;
+
+    void* phys = mmap((void*)DIRECT_BASE, BENCH_PHYS_SPAN, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    ASSERT(phys == (void*)DIRECT_BASE);
+
+    g_bench_heap = mmap(NULL, BENCH_HEAP_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ASSERT(g_bench_heap != MAP_FAILED);
+
+    for (int i = 0; i < g_bench_memmap.tag.entries; i++) {
+        stivale2_mmap_entry_t* entry = &g_bench_memmap.entries[i];
+        if (entry->type == STIVALE2_MMAP_USABLE) {
+            g_bench_total_pages += entry->length / PAGE_SIZE;
+        }
+    }
+
+    bench_set_cpu(0);
+    ASSERT(!IS_ERROR(init_numa()));
+    ASSERT(!IS_ERROR(init_pmm()));
+    ASSERT(!IS_ERROR(init_slab()));
+}
+
+void bench_reset_heap(bool populate) {
+    ASSERT(g_bench_tlsf.size == 0);
+    ASSERT(madvise(g_bench_heap, BENCH_HEAP_SIZE, MADV_DONTNEED) == 0);
+    g_bench_tlsf.high_water = 0;
+    g_bench_heap_populate = populate;
+    g_bench_heap_populated = 0;
+}
+
+void bench_set_cpu(size_t cpu) {
+    ASSERT(cpu < BENCH_MAX_CPUS);
+    g_cpu_id = cpu;
+    g_lapic_id = cpu;
+}
+
+uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t bench_rand(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+void bench_report(const char* name, size_t ops, uint64_t ns, const char* extra) {
+    printf("%-36s %10lu ops %9.1f ns/op  %s\n", name, ops, (double)ns / (double)ops, extra);
+}
@@ -0,0 +1,58 @@
+#ifndef TOMATOS_BENCH_HOST_H
+#define TOMATOS_BENCH_HOST_H
+
+#include <util/defs.h>
+#include <mem/tlsf.h>
+#include <sync/lock.h>
+
+/**
+ * The max amount of cpus (threads) a benchmark can use
+ */
+#define BENCH_MAX_CPUS 4
+
+/**
+ * The amount of pages the fake memory map gives the pmm
+ */
+extern size_t g_bench_total_pages;
+
+/**
+ * The heap used by the tlsf benchmarks, protected by a lock just
+ * like the kernel heap
+ */
+extern tlsf g_bench_tlsf;
+extern lock_t g_bench_tlsf_lock;
+
+/**
+ * Setup the fake physical memory, the memory map and the heap, and
+ * initialize the pmm on top of them
+ */
+void init_bench_host();
+
+/**
+ * Release all the memory of the (empty) tlsf heap, and choose if growing
+ * it should map the new memory right away or fault it in on demand
+ */
+void bench_reset_heap(bool populate);
+
+/**
+ * Make the current thread act as the given cpu
+ */
+void bench_set_cpu(size_t cpu);
+
+/**
+ * Get a monotonic timestamp in nanoseconds
+ */
+uint64_t bench_now_ns();
+
+/**
+ * xorshift64*, we want the same sequence on every run and every host
+ */
+uint64_t bench_rand(uint64_t* state);
+
+/**
+ * Print the results of a benchmark, the time per operation and
+ * whatever else the benchmark wants to show
+ */
+void bench_report(const char* name, size_t ops, uint64_t ns, const char* extra);
+
+#endif //TOMATOS_BENCH_HOST_H
@@ -0,0 +1,508 @@
+#include <util/except.h>
+#include <arch/intrin.h>
+#include <mem/alloc_trace.h>
+#include <mem/pmm.h>
+#include <mem/slab.h>
+#include <mem/tlsf.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "replay.h"
+#include "host.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Live allocations of the trace
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Maps the pointers of the trace to the allocations we made for them, heap
+ * and page allocations have their own maps since slab objects are carved
+ * out of pages, so the same pointer can be live in both
+ */
+typedef struct replay_entry {
+    /**
+     * The pointer in the trace, 0 if the entry is free
+     */
+    uint64_t id;
+
+    void* ptr;
+    size_t size;
+} replay_entry_t;
+
+typedef struct replay_map {
+    replay_entry_t* entries;
+    size_t capacity;
+    size_t count;
+} replay_map_t;
+
+static size_t map_slot(replay_map_t* map, uint64_t id) {
+    return (id * 0x9E3779B97F4A7C15ull) >> (64 - LOG2(map->capacity));
+}
+
+static replay_entry_t* map_find(replay_map_t* map, uint64_t id) {
+    if (map->count == 0) {
+        return NULL;
+    }
+
+    for (size_t i = map_slot(map, id);; i = (i + 1) & (map->capacity - 1)) {
+        replay_entry_t* entry = &map->entries[i];
+        if (entry->id == id) {
+            return entry;
+        }
+        if (entry->id == 0) {
+            return NULL;
+        }
+    }
+}
+
+static replay_entry_t* map_insert(replay_map_t* map, uint64_t id);
+
+/**
+ * Double the capacity, keeps the load factor under a half
+ */
+static void map_grow(replay_map_t* map) {
+    replay_map_t old = *map;
+    map->capacity = old.capacity == 0 ? 4096 : old.capacity * 2;
+    map->count = 0;
+    map->entries = calloc(map->capacity, sizeof(replay_entry_t));
+    ASSERT(map->entries != NULL);
+
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.entries[i].id != 0) {
+            *map_insert(map, old.entries[i].id) = old.entries[i];
+        }
+    }
+    free(old.entries);
+}
+
+/**
+ * Get a free entry for the id, the id must not be in the map
+ */
+static replay_entry_t* map_insert(replay_map_t* map, uint64_t id) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        map_grow(map);
+    }
+
+    size_t i = map_slot(map, id);
+    while (map->entries[i].id != 0) {
+        i = (i + 1) & (map->capacity - 1);
+    }
+
+    map->count++;
+    map->entries[i].id = id;
+    return &map->entries[i];
+}
+
+/**
+ * Linear probing, so instead of leaving a tombstone we move back
+ * the entries that probed past the removed one
+ */
+static void map_remove(replay_map_t* map, replay_entry_t* entry) {
+    size_t mask = map->capacity - 1;
+    size_t hole = entry - map->entries;
+
+    for (size_t i = (hole + 1) & mask; map->entries[i].id != 0; i = (i + 1) & mask) {
+        size_t home = map_slot(map, map->entries[i].id);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            map->entries[hole] = map->entries[i];
+            hole = i;
+        }
+    }
+
+    map->entries[hole].id = 0;
+    map->count--;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The replayed heaps
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct replay_heap {
+    const char* name;
+    void* (*alloc)(size_t size);
+    void* (*realloc)(void* ptr, size_t old_size, size_t size);
+    void (*free)(void* ptr);
+
+    /**
+     * Does the heap use the bench tlsf and the slab, we can't
+     * tell the footprint of the libc heap
+     */
+    bool has_footprint;
+} replay_heap_t;
+
+static void* tlsf_heap_alloc(size_t size) {
+    acquire_lock(&g_bench_tlsf_lock);
+    void* ptr = tlsf_malloc(&g_bench_tlsf, size);
+    release_lock(&g_bench_tlsf_lock);
+    return ptr;
+}
+
+static void* tlsf_heap_realloc(void* ptr, size_t old_size, size_t size) {
+    acquire_lock(&g_bench_tlsf_lock);
+    ptr = tlsf_realloc(&g_bench_tlsf, ptr, size);
+    release_lock(&g_bench_tlsf_lock);
+    return ptr;
+}
+
+static void tlsf_heap_free(void* ptr) {
+    acquire_lock(&g_bench_tlsf_lock);
+    tlsf_free(&g_bench_tlsf, ptr);
+    release_lock(&g_bench_tlsf_lock);
+}
+
+/**
+ * Small sizes from the slab and the rest from the tlsf, this is not mm.c, so
+ * it leaves out the arenas, the large allocations, the known zero tracking
+ * and the in place reallocs of krealloc
+ */
+static void* slab_tlsf_heap_alloc(size_t size) {
+    if (size <= SLAB_MAX_SIZE) {
+        return slab_alloc(size);
+    }
+    return tlsf_heap_alloc(size);
+}
+
+static void slab_tlsf_heap_free(void* ptr) {
+    if (is_slab_object(ptr)) {
+        slab_free(ptr);
+    } else {
+        tlsf_heap_free(ptr);
+    }
+}
+
+static void* slab_tlsf_heap_realloc(void* ptr, size_t old_size, size_t size) {
+    if (!is_slab_object(ptr)) {
+        if (size > SLAB_MAX_SIZE) {
+            return tlsf_heap_realloc(ptr, old_size, size);
+        }
+    } else if (size <= slab_object_size(ptr)) {
+        return ptr;
+    }
+
+    void* new_ptr = slab_tlsf_heap_alloc(size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, MIN(old_size, size));
+    slab_tlsf_heap_free(ptr);
+    return new_ptr;
+}
+
+static void* libc_heap_realloc(void* ptr, size_t old_size, size_t size) {
+    return realloc(ptr, size);
+}
+
+static replay_heap_t g_replay_heaps[] = {
+    { "tlsf", tlsf_heap_alloc, tlsf_heap_realloc, tlsf_heap_free, true },
+    { "slab+tlsf", slab_tlsf_heap_alloc, slab_tlsf_heap_realloc, slab_tlsf_heap_free, true },
+    { "libc", malloc, libc_heap_realloc, free, false },
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Replay
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * How often the footprint of the heap is sampled
+ */
+#define REPLAY_SAMPLE_INTERVAL 4096
+
+typedef struct replay_state {
+    replay_heap_t* heap;
+    replay_map_t heap_map;
+    replay_map_t page_map;
+
+    size_t live_bytes;
+    size_t peak_live_bytes;
+    size_t live_pages;
+
+    /**
+     * The pages the pmm had in use before the replay, the rest minus
+     * the live pages of the trace are used by the slab
+     */
+    size_t base_used_pages;
+    size_t peak_footprint;
+
+    /**
+     * The cycles and count of every event type
+     */
+    uint64_t cycles[ALLOC_TRACE_DROPPED];
+    size_t counts[ALLOC_TRACE_DROPPED];
+
+    size_t failed;
+    size_t unknown_frees;
+    size_t stale;
+    size_t dropped;
+} replay_state_t;
+
+static const char* g_replay_type_names[] = {
+    [ALLOC_TRACE_KALLOC] = "kalloc",
+    [ALLOC_TRACE_KREALLOC] = "krealloc",
+    [ALLOC_TRACE_KFREE] = "kfree",
+    [ALLOC_TRACE_PALLOC] = "palloc",
+    [ALLOC_TRACE_PFREE] = "pfree",
+};
+
+static size_t used_pages() {
+    return g_bench_total_pages - pmm_free_pages();
+}
+
+/**
+ * The memory the heap takes, the tlsf arena and the slab pages
+ */
+static size_t heap_footprint(replay_state_t* state) {
+    size_t slab_pages = used_pages() - state->base_used_pages - state->live_pages;
+    return g_bench_tlsf.size + PAGES_TO_SIZE(slab_pages);
+}
+
+/**
+ * Insert the allocation, if the id is still live we missed its free (the
+ * events were dropped) so the old allocation is freed first
+ */
+static replay_entry_t* track(replay_state_t* state, replay_map_t* map, uint64_t id) {
+    replay_entry_t* entry = map_find(map, id);
+    if (entry == NULL) {
+        return map_insert(map, id);
+    }
+
+    state->stale++;
+    if (map == &state->heap_map) {
+        state->heap->free(entry->ptr);
+        state->live_bytes -= entry->size;
+    } else {
+        pfree(entry->ptr, entry->size);
+        state->live_pages -= SIZE_TO_PAGES(entry->size);
+    }
+    return entry;
+}
+
+static void replay_heap_event(replay_state_t* state, alloc_trace_event_t* event) {
+    replay_entry_t* entry;
+    void* ptr;
+
+    switch (event->type) {
+        case ALLOC_TRACE_KALLOC:
+            ptr = state->heap->alloc(event->size);
+            if (ptr == NULL) {
+                state->failed++;
+                return;
+            }
+            entry = track(state, &state->heap_map, event->ptr);
+            break;
+
+        case ALLOC_TRACE_KREALLOC:
+            // a realloc of NULL or of something we never saw
+            entry = event->old_ptr != 0 ? map_find(&state->heap_map, event->old_ptr) : NULL;
+            if (entry == NULL) {
+                ptr = state->heap->alloc(event->size);
+                if (ptr == NULL) {
+                    state->failed++;
+                    return;
+                }
+                entry = track(state, &state->heap_map, event->ptr);
+                break;
+            }
+
+            ptr = state->heap->realloc(entry->ptr, entry->size, event->size);
+            if (ptr == NULL) {
+                state->failed++;
+                return;
+            }
+            state->live_bytes -= entry->size;
+            map_remove(&state->heap_map, entry);
+            entry = track(state, &state->heap_map, event->ptr);
+            break;
+
+        case ALLOC_TRACE_KFREE:
+            entry = map_find(&state->heap_map, event->ptr);
+            if (entry == NULL) {
+                state->unknown_frees++;
+                return;
+            }
+            state->heap->free(entry->ptr);
+            state->live_bytes -= entry->size;
+            map_remove(&state->heap_map, entry);
+            return;
+
+        default:
+            return;
+    }
+
+    entry->ptr = ptr;
+    entry->size = event->size;
+    state->live_bytes += event->size;
+    state->peak_live_bytes = MAX(state->peak_live_bytes, state->live_bytes);
+}
+
+static void replay_page_event(replay_state_t* state, alloc_trace_event_t* event) {
+    replay_entry_t* entry;
+
+    if (event->type == ALLOC_TRACE_PALLOC) {
+        void* ptr = palloc(event->size);
+        if (ptr == NULL) {
+            state->failed++;
+            return;
+        }
+        entry = track(state, &state->page_map, event->ptr);
+        entry->ptr = ptr;
+        entry->size = event->size;
+        state->live_pages += SIZE_TO_PAGES(event->size);
+    } else {
+        entry = map_find(&state->page_map, event->ptr);
+        if (entry == NULL) {
+            state->unknown_frees++;
+            return;
+        }
+        pfree(entry->ptr, entry->size);
+        state->live_pages -= SIZE_TO_PAGES(entry->size);
+        map_remove(&state->page_map, entry);
+    }
+}
+
+static void replay_report(replay_state_t* state, size_t events, uint64_t ns) {
+    printf("replayed %lu events against %s in %lu ms\n", events, state->heap->name, ns / 1000000);
+
+    for (int type = 0; type < ALLOC_TRACE_DROPPED; type++) {
+        if (state->counts[type] != 0) {
+            printf("  %-10s %10lu ops %9.1f cycles/op\n", g_replay_type_names[type], state->counts[type],
+                   (double)state->cycles[type] / (double)state->counts[type]);
+        }
+    }
+
+    printf("  heap: live %lu KB (peak %lu KB)", state->live_bytes / SIZE_1KB, state->peak_live_bytes / SIZE_1KB);
+    if (state->heap->has_footprint) {
+        size_t footprint = heap_footprint(state);
+        printf(", footprint %lu KB (peak %lu KB), fragmentation %.1f%%",
+               footprint / SIZE_1KB, MAX(state->peak_footprint, footprint) / SIZE_1KB,
+               footprint == 0 ? 0 : (1.0 - (double)state->live_bytes / (double)footprint) * 100);
+    }
+    printf("\n");
+
+    size_t free_pages = pmm_free_pages();
+    size_t huge_pages = pmm_count_free_huge(SIZE_2MB) * (SIZE_2MB / PAGE_SIZE);
+    printf("  pmm: live %lu KB, free memory not in 2MB pages %.1f%%\n",
+           PAGES_TO_SIZE(state->live_pages) / SIZE_1KB,
+           free_pages == 0 ? 0 : (1.0 - (double)huge_pages / (double)free_pages) * 100);
+
+    if (state->failed != 0 || state->unknown_frees != 0 || state->stale != 0) {
+        printf("  %lu failed allocations, %lu frees of unknown pointers, %lu allocations never freed\n",
+               state->failed, state->unknown_frees, state->stale);
+    }
+}
+
+/**
+ * Give everything that is still live back
+ */
+static void replay_cleanup(replay_state_t* state) {
+    for (size_t i = 0; i < state->heap_map.capacity; i++) {
+        if (state->heap_map.entries[i].id != 0) {
+            state->heap->free(state->heap_map.entries[i].ptr);
+        }
+    }
+
+    for (size_t i = 0; i < state->page_map.capacity; i++) {
+        replay_entry_t* entry = &state->page_map.entries[i];
+        if (entry->id != 0) {
+            pfree(entry->ptr, entry->size);
+        }
+    }
+
+    free(state->heap_map.entries);
+    free(state->page_map.entries);
+}
+
+static alloc_trace_event_t* read_trace(const char* path, size_t* count) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("could not open %s\n", path);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    alloc_trace_event_t* events = NULL;
+    if (size % sizeof(alloc_trace_event_t) != 0) {
+        printf("%s is not an allocation trace\n", path);
+        goto cleanup;
+    }
+
+    events = malloc(MAX(size, 1));
+    ASSERT(events != NULL);
+    if (fread(events, 1, size, file) != size) {
+        printf("could not read %s\n", path);
+        free(events);
+        events = NULL;
+        goto cleanup;
+    }
+    *count = size / sizeof(alloc_trace_event_t);
+
+cleanup:
+    fclose(file);
+    return events;
+}
+
+int bench_replay(const char* path, const char* allocator) {
+    static replay_state_t state;
+
+    for (size_t i = 0; i < ARRAY_LEN(g_replay_heaps); i++) {
+        if (strcmp(g_replay_heaps[i].name, allocator) == 0) {
+            state.heap = &g_replay_heaps[i];
+        }
+    }
+    if (state.heap == NULL) {
+        printf("unknown allocator %s, expected tlsf, slab+tlsf or libc\n", allocator);
+        return 1;
+    }
+
+    size_t count = 0;
+    alloc_trace_event_t* events = read_trace(path, &count);
+    if (events == NULL) {
+        return 1;
+    }
+
+    state.base_used_pages = used_pages();
+
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < count; i++) {
+        alloc_trace_event_t* event = &events[i];
+        if (event->type >= ALLOC_TRACE_DROPPED) {
+            if (event->type == ALLOC_TRACE_DROPPED) {
+                state.dropped += event->size;
+            }
+            continue;
+        }
+
+        // act as the cpu that did it, so the per-cpu caches
+        // are used like they were in the kernel
+        bench_set_cpu(event->cpu % BENCH_MAX_CPUS);
+
+        uint64_t cycles = __rdtsc();
+        if (event->type >= ALLOC_TRACE_PALLOC) {
+            replay_page_event(&state, event);
+        } else {
+            replay_heap_event(&state, event);
+        }
+        state.cycles[event->type] += __rdtsc() - cycles;
+        state.counts[event->type]++;
+
+        if (state.heap->has_footprint && i % REPLAY_SAMPLE_INTERVAL == 0) {
+            state.peak_footprint = MAX(state.peak_footprint, heap_footprint(&state));
+        }
+    }
+    uint64_t ns = bench_now_ns() - start;
+
+    if (state.dropped != 0) {
+        printf("warning: the trace is missing %lu events that were dropped by the kernel\n", state.dropped);
+    }
+
+    bench_set_cpu(0);
+    replay_report(&state, count, ns);
+    replay_cleanup(&state);
+    free(events);
+
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef TOMATOS_BENCH_REPLAY_H
+#define TOMATOS_BENCH_REPLAY_H
+
+#include <util/defs.h>
+
+/**
+ * Replay an allocation trace (see mem/alloc_trace.h) against one of the
+ * heap allocators, the page events always go to the pmm:
+ *
+ *      tlsf        - every heap event goes to the tlsf heap
+ *      slab+tlsf   - small sizes from the slab and the rest from tlsf, roughly
+ *                    how kalloc splits them, but without the arenas, the large
+ *                    allocations, the known zero tracking or krealloc in place
+ *      libc        - the host malloc, for comparison
+ *
+ * The events are replayed in order on a single thread, each one as the cpu
+ * that recorded it, and the time per event type and the fragmentation of the
+ * heap and the pmm are reported.
+ *
+ * @returns 0 on success, 1 if the trace could not be replayed
+ */
+int bench_replay(const char* path, const char* allocator);
+
+#endif //TOMATOS_BENCH_REPLAY_H
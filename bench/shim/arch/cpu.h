@@ -0,0 +1,54 @@
+#ifndef TOMATOS_BENCH_CPU_H
+#define TOMATOS_BENCH_CPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Every benchmark thread acts as its own cpu, the cpu locals
+// are simply thread locals
+//
+
+#define CPU_LOCAL __thread
+
+extern uintptr_t g_cpu_locals[256];
+extern size_t g_cpu_count;
+extern __thread size_t g_cpu_id;
+extern __thread size_t g_lapic_id;
+
+static inline void cpu_pause() {
+    __builtin_ia32_pause();
+}
+
+/**
+ * Handles the shootdowns other cpus wait on us for, see host.c
+ */
+void cpu_spin();
+
+//
+// The vmm benchmarks call the page fault handler directly, and the
+// shootdown ipis are never sent, the other cpus poll for them instead
+//
+
+typedef union page_fault_params {
+    struct {
+        uint32_t present : 1;
+        uint32_t write : 1;
+        uint32_t user : 1;
+        uint32_t reserved_write : 1;
+        uint32_t instruction_fetch : 1;
+    };
+    uint32_t raw;
+} page_fault_params_t;
+
+typedef enum ipi {
+    IPI_TLB_SHOOTDOWN = 0xf1,
+} ipi_t;
+
+void lapic_send_fixed_ipi(uint32_t apic_id, uint8_t vector);
+
+static inline void memory_barrier() {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#endif //TOMATOS_BENCH_CPU_H
@@ -0,0 +1,71 @@
+#ifndef TOMATOS_BENCH_INTRIN_H
+#define TOMATOS_BENCH_INTRIN_H
+
+#include <stdint.h>
+#include <cpuid.h>
+
+#define CPUID_SIGNATURE (0x00)
+
+static inline uint64_t __rdtsc(void) {
+    return __builtin_ia32_rdtsc();
+}
+
+static inline void cpuidex(uint32_t val, uint64_t leaf, uint32_t* rax, uint32_t* rbx, uint32_t* rcx, uint32_t* rdx) {
+    uint32_t a, b, c, d;
+    __cpuid_count(val, leaf, a, b, c, d);
+    if (rax) *rax = a;
+    if (rbx) *rbx = b;
+    if (rcx) *rcx = c;
+    if (rdx) *rdx = d;
+}
+
+static inline void cpuid(uint32_t val, uint32_t* rax, uint32_t* rbx, uint32_t* rcx, uint32_t* rdx) {
+    cpuidex(val, 0, rax, rbx, rcx, rdx);
+}
+
+//
+// The vmm benchmarks build page tables that the host never walks, so
+// loading them and flushing the tlb does nothing
+//
+
+#define MSR_IA32_PAT        0x00000277
+#define PAT_WC              0x01ul
+
+#define INVPCID_ALL_GLOBAL  2
+
+typedef union {
+    struct {
+        uint32_t _reserved0:7;
+        uint32_t PGE:1;
+    };
+    uint64_t raw;
+} IA32_CR4;
+
+static inline IA32_CR4 __readcr4(void) {
+    return (IA32_CR4){ .raw = 0 };
+}
+
+static inline void __writecr4(IA32_CR4 value) {
+}
+
+static inline uint64_t __readcr3(void) {
+    return 0;
+}
+
+static inline void __writecr3(uint64_t value) {
+}
+
+static inline uint64_t __rdmsr(uint32_t msr) {
+    return 0;
+}
+
+static inline void __wrmsr(uint32_t msr, uint64_t value) {
+}
+
+static inline void __invlpg(uintptr_t a) {
+}
+
+static inline void __invpcid(uint64_t type, uint64_t pcid, uintptr_t a) {
+}
+
+#endif //TOMATOS_BENCH_INTRIN_H
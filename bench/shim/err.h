@@ -0,0 +1,4 @@
+//
+// The kernel error strings are generated by the kernel build,
+// nothing in the host build needs them
+//
@@ -0,0 +1,13 @@
+//
+// Included before everything else in the host build, provides the
+// clang builtins the kernel uses when building with other compilers
+//
+
+#include <stdint.h>
+
+#ifndef __clang__
+#define __builtin_align_up(value, alignment) \
+    ((__typeof__(value))(((uintptr_t)(value) + ((alignment) - 1)) & ~((uintptr_t)(alignment) - 1)))
+#define __builtin_align_down(value, alignment) \
+    ((__typeof__(value))((uintptr_t)(value) & ~((uintptr_t)(alignment) - 1)))
+#endif
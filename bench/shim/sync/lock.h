@@ -0,0 +1,48 @@
+#ifndef TOMATOS_BENCH_LOCK_H
+#define TOMATOS_BENCH_LOCK_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <arch/cpu.h>
+
+//
+// Same ticket lock as the kernel, but without the tpl handling
+// since there are no interrupts to disable in user space, it
+// spins the same way so shootdowns are handled while waiting
+//
+
+typedef enum tpl {
+    TPL_APPLICATION = 4,
+    TPL_CALLBACK = 8,
+    TPL_NOTIFY = 16,
+    TPL_HIGH_LEVEL = 31,
+} tpl_t;
+
+typedef struct lock {
+    tpl_t tpl;
+    atomic_size_t now_serving;
+    atomic_size_t next_ticket;
+} lock_t;
+
+#define INIT_LOCK(t) ((lock_t){ .tpl = t })
+
+static inline void acquire_lock(lock_t* lock) {
+    size_t ticket = atomic_fetch_add_explicit(&lock->next_ticket, 1, memory_order_relaxed);
+    while (atomic_load_explicit(&lock->now_serving, memory_order_acquire) != ticket) {
+        cpu_spin();
+    }
+}
+
+static inline bool acquire_lock_or_fail(lock_t* lock) {
+    size_t ticket = atomic_load_explicit(&lock->now_serving, memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&lock->next_ticket, &ticket, ticket + 1,
+                                                   memory_order_acquire, memory_order_relaxed);
+}
+
+static inline void release_lock(lock_t* lock) {
+    size_t current = atomic_load_explicit(&lock->now_serving, memory_order_relaxed);
+    atomic_store_explicit(&lock->now_serving, current + 1, memory_order_release);
+}
+
+#endif //TOMATOS_BENCH_LOCK_H
@@ -0,0 +1,58 @@
+#ifndef TOMATOS_BENCH_EXCEPT_H
+#define TOMATOS_BENCH_EXCEPT_H
+
+#include <stdlib.h>
+#include <arch/cpu.h>
+#include "trace.h"
+
+typedef enum err {
+    NO_ERROR,
+    ERROR_CHECK_FAILED,
+    ERROR_NOT_FOUND,
+    ERROR_OUT_OF_RESOURCES,
+} err_t;
+
+#define IS_ERROR(err) (err != NO_ERROR)
+
+#define CHECK_ERROR_LABEL(check, error, label, ...) \
+    do { \
+        if (!(check)) { \
+            err = error; \
+            ERROR("Check failed with error %d in function %s (%s:%d)", err, __FUNCTION__, __FILE__, __LINE__); \
+            goto label; \
+        } \
+    } while(0)
+
+#define CHECK_ERROR(check, error, ...)              CHECK_ERROR_LABEL(check, error, cleanup)
+#define CHECK_LABEL(check, label, ...)              CHECK_ERROR_LABEL(check, ERROR_CHECK_FAILED, label)
+#define CHECK(check, ...)                           CHECK_ERROR_LABEL(check, ERROR_CHECK_FAILED, cleanup)
+#define CHECK_FAIL(...)                             CHECK_ERROR_LABEL(0, ERROR_CHECK_FAILED, cleanup)
+#define CHECK_FAIL_ERROR(error, ...)                CHECK_ERROR_LABEL(0, error, cleanup)
+
+#define CHECK_AND_RETHROW(error) \
+    do { \
+        err = error; \
+        if (IS_ERROR(err)) { \
+            ERROR("\trethrown at %s (%s:%d)", __FUNCTION__, __FILE__, __LINE__); \
+            goto cleanup; \
+        } \
+    } while(0)
+
+#define ASSERT(check, ...) \
+    do { \
+        if (!(check)) { \
+            ERROR("Assert `%s` failed in function %s (%s:%d)", #check, __FUNCTION__, __FILE__, __LINE__); \
+            abort(); \
+        } \
+    } while(0);
+
+#define DEBUG_ASSERT(check, ...) ASSERT(check)
+
+#define WARN_ON(check, ...) \
+    do { \
+        if (check) { \
+            WARN(__VA_ARGS__); \
+        } \
+    } while(0)
+
+#endif //TOMATOS_BENCH_EXCEPT_H
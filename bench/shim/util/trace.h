@@ -0,0 +1,26 @@
+#ifndef TOMATOS_BENCH_TRACE_H
+#define TOMATOS_BENCH_TRACE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sync/lock.h>
+
+//
+// The kernel printf is mostly compatible with the libc one, the only
+// format we use that libc lacks is %R for errors which is only used
+// on failed checks
+//
+
+extern bool g_bench_verbose;
+
+#define TRACE(fmt, ...) do { if (g_bench_verbose) printf("[*] " fmt "\n", ## __VA_ARGS__); } while (0)
+#define DEBUG(fmt, ...) do { if (g_bench_verbose) printf("[?] " fmt "\n", ## __VA_ARGS__); } while (0)
+#define WARN(fmt, ...) printf("[!] " fmt "\n", ## __VA_ARGS__)
+#define ERROR(fmt, ...) printf("[-] " fmt "\n", ## __VA_ARGS__)
+
+#define UNLOCKED_TRACE TRACE
+#define UNLOCKED_DEBUG DEBUG
+#define UNLOCKED_WARN WARN
+#define UNLOCKED_ERROR ERROR
+
+#endif //TOMATOS_BENCH_TRACE_H
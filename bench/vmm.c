@@ -0,0 +1,424 @@
+#include <util/except.h>
+#include <mem/pmm.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "vmm.h"
+#include "host.h"
+
+//
+// The vmm is built right into the benchmark so the checks can walk its page
+// tables, it runs on a top level table that nothing ever loads so any physical
+// address can be mapped, the tables themselves come from the pmm
+//
+
+/**
+ * The pages allocated and freed by the fault threads of the heap fault check,
+ * the heap pages and the page tables of the heap, so the check can tell if a
+ * fault that lost a race leaked its page or freed one that is mapped
+ */
+static __thread bool m_counting = false;
+static size_t m_counted_allocs = 0;
+static size_t m_counted_frees = 0;
+
+static directptr_t count_alloc(directptr_t ptr) {
+    if (m_counting && ptr != NULL) {
+        __atomic_fetch_add(&m_counted_allocs, 1, __ATOMIC_RELAXED);
+    }
+    return ptr;
+}
+
+static void count_free() {
+    if (m_counting) {
+        __atomic_fetch_add(&m_counted_frees, 1, __ATOMIC_RELAXED);
+    }
+}
+
+#define pallocz(size) count_alloc(pallocz(size))
+#define pallocz_movable_node(node, size) count_alloc(pallocz_movable_node(node, size))
+#define pfree(ptr, size) (count_free(), pfree(ptr, size))
+
+#include <mem/vmm.c>
+
+#undef pallocz
+#undef pallocz_movable_node
+#undef pfree
+
+/**
+ * The ranges the checks and the benchmarks use, each one in a top level
+ * entry of its own and far away from the heap
+ */
+#define VMM_CHECK_BASE  0xffff900000000000ull
+#define VMM_BENCH_BASE  0xffffa00000000000ull
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Check the physical address an address translates to and the level of
+ * the page that maps it, a level of 0 means it must not be mapped
+ */
+static void expect_mapping(uintptr_t virt, physptr_t phys, int level) {
+    int found;
+    uint64_t* entry = get_leaf(virt, &found);
+    if (level == 0) {
+        ASSERT(entry == NULL);
+        return;
+    }
+
+    ASSERT(entry != NULL);
+    ASSERT(found == level);
+    ASSERT(PM_ADDR(*entry) + (virt & (LEVEL_SIZE(level) - 1)) == phys);
+}
+
+static bool is_writable(uintptr_t virt) {
+    int level;
+    uint64_t* entry = get_leaf(virt, &level);
+    ASSERT(entry != NULL);
+    return (*entry & PM_WRITE) != 0;
+}
+
+/**
+ * The amount of page tables in a table and everything under it
+ */
+static size_t count_tables(uint64_t* table, int level) {
+    size_t count = 1;
+    if (level > 1) {
+        for (size_t i = 0; i < 512; i++) {
+            if ((table[i] & PM_PRESENT) && !(table[i] & PM_SIZE)) {
+                count += count_tables(PHYS_TO_DIRECT(PM_ADDR(table[i])), level - 1);
+            }
+        }
+    }
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Checks
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Map ranges with a mix of page sizes, then change and unmap parts of them
+ */
+static void check_vmm_map_unmap() {
+    uintptr_t virt = VMM_CHECK_BASE;
+    size_t splits = m_huge_splits;
+
+    // three 2MB pages and a tail of 4KB pages
+    ASSERT(!IS_ERROR(vmm_map(virt, 0, 512 * 3 + 3, MAP_READ | MAP_WRITE)));
+    expect_mapping(virt + 5, 5, 2);
+    expect_mapping(virt + SIZE_2MB * 2 + 77, SIZE_2MB * 2 + 77, 2);
+    expect_mapping(virt + SIZE_2MB * 3 + PAGE_SIZE * 2 + 1, SIZE_2MB * 3 + PAGE_SIZE * 2 + 1, 1);
+    expect_mapping(virt + SIZE_2MB * 3 + PAGE_SIZE * 3, 0, 0);
+
+    // 1GB pages if the cpu has them, the rest in 2MB pages
+    m_gbpages = true;
+    uintptr_t gb = VMM_CHECK_BASE + SIZE_4GB;
+    ASSERT(!IS_ERROR(vmm_map(gb, SIZE_1GB, SIZE_TO_PAGES(SIZE_1GB + SIZE_2MB), MAP_READ | MAP_WRITE)));
+    m_gbpages = false;
+    expect_mapping(gb + SIZE_1GB - 1, SIZE_2GB - 1, 3);
+    expect_mapping(gb + SIZE_1GB + 3, SIZE_2GB + 3, 2);
+
+    // unmapping part of a 1GB page leaves it in 2MB pages
+    ASSERT(!IS_ERROR(vmm_unmap(gb + SIZE_2MB, 512)));
+    expect_mapping(gb, SIZE_1GB, 2);
+    expect_mapping(gb + SIZE_2MB, 0, 0);
+    expect_mapping(gb + SIZE_2MB * 2, SIZE_1GB + SIZE_2MB * 2, 2);
+    ASSERT(m_huge_splits == ++splits);
+
+    // virt and phys line up after the first few pages, so the
+    // middle of the range is a 2MB page
+    uintptr_t misaligned = VMM_CHECK_BASE + SIZE_1GB + PAGE_SIZE * 5;
+    ASSERT(!IS_ERROR(vmm_map(misaligned, PAGE_SIZE * 5, 1024, MAP_READ)));
+    expect_mapping(misaligned, PAGE_SIZE * 5, 1);
+    expect_mapping(misaligned + PAGE_SIZE * 507, SIZE_2MB, 2);
+    expect_mapping(misaligned + PAGE_SIZE * 1023, PAGE_SIZE * 1028, 1);
+    expect_mapping(misaligned + PAGE_SIZE * 1024, 0, 0);
+    ASSERT(!is_writable(misaligned + PAGE_SIZE * 1023));
+
+    // a page with other permissions in a 2MB page splits it,
+    // the rest of it stays the same
+    uintptr_t split = virt + SIZE_2MB;
+    ASSERT(!IS_ERROR(vmm_map(split + PAGE_SIZE * 7, 0x1234000, 1, MAP_READ)));
+    expect_mapping(split + PAGE_SIZE * 7, 0x1234000, 1);
+    expect_mapping(split + PAGE_SIZE * 6, SIZE_2MB + PAGE_SIZE * 6, 1);
+    expect_mapping(split + PAGE_SIZE * 8, SIZE_2MB + PAGE_SIZE * 8, 1);
+    ASSERT(!is_writable(split + PAGE_SIZE * 7));
+    ASSERT(is_writable(split + PAGE_SIZE * 8));
+    ASSERT(m_huge_splits == ++splits);
+
+    // unmapping a few pages out of a 2MB page splits it
+    ASSERT(!IS_ERROR(vmm_unmap(virt + PAGE_SIZE, 2)));
+    expect_mapping(virt, 0, 1);
+    expect_mapping(virt + PAGE_SIZE, 0, 0);
+    expect_mapping(virt + PAGE_SIZE * 2, 0, 0);
+    expect_mapping(virt + PAGE_SIZE * 3, PAGE_SIZE * 3, 1);
+    ASSERT(m_huge_splits == ++splits);
+
+    // a whole 2MB page goes at once
+    ASSERT(!IS_ERROR(vmm_unmap(virt + SIZE_2MB * 2, 512)));
+    expect_mapping(virt + SIZE_2MB * 2 + 9, 0, 0);
+    expect_mapping(virt + SIZE_2MB * 3, SIZE_2MB * 3, 1);
+    ASSERT(m_huge_splits == splits);
+
+    // once the split page table is empty a 2MB page can replace it
+    ASSERT(!IS_ERROR(vmm_unmap(split, 512)));
+    ASSERT(!IS_ERROR(vmm_map(split, SIZE_1GB, 512, MAP_READ | MAP_WRITE)));
+    expect_mapping(split + 123, SIZE_1GB + 123, 2);
+
+    // but not while it still has pages in it, those are
+    // replaced and the holes are filled with 4KB pages
+    ASSERT(!IS_ERROR(vmm_map(virt, SIZE_2GB, 512, MAP_READ | MAP_WRITE)));
+    expect_mapping(virt, SIZE_2GB, 1);
+    expect_mapping(virt + PAGE_SIZE, SIZE_2GB + PAGE_SIZE, 1);
+    expect_mapping(virt + SIZE_2MB - 1, SIZE_2GB + SIZE_2MB - 1, 1);
+    ASSERT(m_huge_splits == splits);
+}
+
+/**
+ * Run out of page tables in the middle of a map, everything it
+ * already mapped must be unmapped again
+ */
+static void check_vmm_map_out_of_memory() {
+    uintptr_t virt = VMM_CHECK_BASE + SIZE_2GB;
+
+    // leave an empty page table in the second 2MB of the range,
+    // so only the tail of the map needs a new one
+    ASSERT(!IS_ERROR(vmm_map(virt + SIZE_2MB, 0, 1, MAP_READ)));
+    ASSERT(!IS_ERROR(vmm_unmap(virt + SIZE_2MB, 1)));
+
+    // take all the memory
+    directptr_t* pages = calloc(g_bench_total_pages, sizeof(directptr_t));
+    ASSERT(pages != NULL);
+    size_t count = 0;
+    while (count < g_bench_total_pages && (pages[count] = palloc(PAGE_SIZE)) != NULL) {
+        count++;
+    }
+    while (count < g_bench_total_pages && (pages[count] = pallocz(PAGE_SIZE)) != NULL) {
+        count++;
+    }
+
+    // the 2MB pages fit, the page table of the last page does not
+    printf("vmm map out of memory, expecting a failed check:\n");
+    err_t err = vmm_map(virt, SIZE_1GB, 1024 + 1, MAP_READ | MAP_WRITE);
+    ASSERT(err == ERROR_OUT_OF_RESOURCES);
+    expect_mapping(virt, 0, 0);
+    expect_mapping(virt + SIZE_2MB, 0, 0);
+    expect_mapping(virt + SIZE_4MB, 0, 0);
+
+    pfree_bulk(count, pages);
+    free(pages);
+
+    // and it maps fine once there is memory again
+    ASSERT(!IS_ERROR(vmm_map(virt, SIZE_1GB, 1024 + 1, MAP_READ | MAP_WRITE)));
+    expect_mapping(virt + SIZE_2MB, SIZE_1GB + SIZE_2MB, 2);
+    expect_mapping(virt + SIZE_4MB, SIZE_1GB + SIZE_4MB, 1);
+}
+
+/**
+ * Release a range of real pages, huge pages are freed as a whole and
+ * the zero page is left alone
+ */
+static void check_vmm_release() {
+    uintptr_t virt = VMM_CHECK_BASE + SIZE_2GB + SIZE_1GB;
+
+    directptr_t huge = palloc(SIZE_2MB);
+    directptr_t page = palloc(PAGE_SIZE);
+    ASSERT(huge != NULL && page != NULL);
+
+    ASSERT(!IS_ERROR(vmm_map(virt, DIRECT_TO_PHYS(huge), 512, MAP_READ | MAP_WRITE)));
+    ASSERT(!IS_ERROR(vmm_map(virt + SIZE_2MB + PAGE_SIZE, DIRECT_TO_PHYS(page), 1, MAP_READ | MAP_WRITE)));
+    ASSERT(!IS_ERROR(vmm_map(virt + SIZE_2MB + PAGE_SIZE * 2, m_zero_page, 1, MAP_READ)));
+    expect_mapping(virt, DIRECT_TO_PHYS(huge), 2);
+
+    ASSERT(vmm_release(virt, 1024) == 512 + 1);
+    expect_mapping(virt, 0, 0);
+    expect_mapping(virt + SIZE_2MB + PAGE_SIZE, 0, 0);
+    expect_mapping(virt + SIZE_2MB + PAGE_SIZE * 2, 0, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Concurrent heap faults
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The fault threads act as cpus 1 to 3 and the main thread as cpu 0, every
+ * one of them takes part in the shootdowns. There are no interrupts, so the
+ * threads poll for shootdowns after every fault, and the locks and the other
+ * waits handle them through cpu_spin just like in the kernel.
+ */
+#define FAULT_THREADS   (BENCH_MAX_CPUS - 1)
+#define FAULT_PAGES     4096
+#define FAULT_COUNT     (FAULT_PAGES * 2)
+#define MAP_ROUNDS      200
+
+static pthread_barrier_t m_fault_start;
+static size_t m_faulting = 0;
+static bool m_fault_done = false;
+
+static void* fault_thread(void* arg) {
+    size_t cpu = (uintptr_t)arg;
+    uint64_t state = 0xfa17 + cpu;
+
+    bench_set_cpu(cpu);
+    init_tlb_shootdown();
+    m_counting = true;
+    pthread_barrier_wait(&m_fault_start);
+
+    // read and write random pages of the heap, a read maps the zero page and
+    // a write a real page, the cpus race on the tables and on the pages
+    for (int i = 0; i < FAULT_COUNT; i++) {
+        uint64_t random = bench_rand(&state);
+        page_fault_params_t params = { .write = random & 1 };
+        uintptr_t addr = KERNEL_HEAP_START + PAGES_TO_SIZE((random >> 1) % FAULT_PAGES) + 8;
+        ASSERT(!IS_ERROR(vmm_handle_pagefault(addr, params)));
+        vmm_handle_shootdown();
+    }
+
+    // keep answering shootdowns until the main thread is done checking
+    __atomic_fetch_sub(&m_faulting, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&m_fault_done, __ATOMIC_ACQUIRE)) {
+        cpu_spin();
+    }
+
+    return NULL;
+}
+
+/**
+ * Fault the heap in from a few cpus at once while another cpu maps and unmaps
+ * a range that crosses into the next top level entry, then check that every
+ * heap page ended up mapped once and that no page got lost or freed twice
+ */
+static void check_vmm_heap_faults() {
+    pthread_t threads[FAULT_THREADS];
+    uintptr_t range = VMM_BENCH_BASE + SIZE_512GB - SIZE_2MB;
+    size_t shootdowns = m_shootdowns;
+    char extra[128];
+
+    // nothing else maps anything in the heap
+    uint64_t* heap_entry = &((uint64_t*)m_pml4)[LEVEL_INDEX(KERNEL_HEAP_START, 4)];
+    ASSERT(!(*heap_entry & PM_PRESENT));
+
+    bench_set_cpu(0);
+    init_tlb_shootdown();
+    m_faulting = FAULT_THREADS;
+    pthread_barrier_init(&m_fault_start, NULL, FAULT_THREADS + 1);
+    for (size_t i = 0; i < FAULT_THREADS; i++) {
+        ASSERT(pthread_create(&threads[i], NULL, fault_thread, (void*)(i + 1)) == 0);
+    }
+    pthread_barrier_wait(&m_fault_start);
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < MAP_ROUNDS; i++) {
+        physptr_t phys;
+        ASSERT(!IS_ERROR(vmm_map(range, PAGE_SIZE * 2, 1024, MAP_READ | MAP_WRITE)));
+        vmm_handle_shootdown();
+        ASSERT(!IS_ERROR(vmm_virt_to_phys(range + PAGE_SIZE * 700, &phys)));
+        ASSERT(phys == PAGE_SIZE * 702);
+        ASSERT(!IS_ERROR(vmm_unmap(range, 1024)));
+        vmm_handle_shootdown();
+    }
+
+    while (__atomic_load_n(&m_faulting, __ATOMIC_ACQUIRE) != 0) {
+        cpu_spin();
+    }
+    uint64_t ns = bench_now_ns() - start;
+
+    // every page that was written is a real writable page
+    // and every other page that was read is the zero page
+    size_t real = 0;
+    size_t zero = 0;
+    for (size_t i = 0; i < FAULT_PAGES; i++) {
+        int level;
+        uint64_t* entry = get_leaf(KERNEL_HEAP_START + PAGES_TO_SIZE(i), &level);
+        if (entry == NULL) {
+            continue;
+        }
+
+        ASSERT(level == 1);
+        if (PM_ADDR(*entry) == m_zero_page) {
+            ASSERT(!(*entry & PM_WRITE));
+            zero++;
+        } else {
+            ASSERT(*entry & PM_WRITE);
+            real++;
+        }
+    }
+
+    // what the faults kept is the mapped pages and the tables
+    size_t tables = count_tables(PHYS_TO_DIRECT(PM_ADDR(*heap_entry)), 3);
+    ASSERT(m_counted_allocs - m_counted_frees == real + tables);
+
+    // while the other cpus still answer the shootdowns
+    ASSERT(vmm_release(KERNEL_HEAP_START, FAULT_PAGES) == real);
+    ASSERT(m_shootdowns > shootdowns);
+
+    __atomic_store_n(&m_fault_done, true, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < FAULT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&m_fault_start);
+
+    // the threads are gone, nothing would answer the shootdowns anymore
+    memset(m_shootdown_cpus, 0, sizeof(m_shootdown_cpus));
+    m_shootdown_cpu_count = 0;
+
+    snprintf(extra, sizeof(extra), "%lu real, %lu zero pages, %lu shootdowns",
+             real, zero, m_shootdowns - shootdowns);
+    bench_report("vmm heap faults (3 cpus + mapper)", FAULT_COUNT * FAULT_THREADS, ns, extra);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Map and unmap a range of 4KB pages, the virtual and physical addresses
+ * are a page apart from each other so none of it can use 2MB pages
+ */
+static void bench_vmm_map_unmap() {
+    enum { PAGES = 65536, ROUNDS = 64 };
+    uintptr_t virt = VMM_BENCH_BASE + PAGE_SIZE;
+    uint64_t map_ns = 0;
+    uint64_t unmap_ns = 0;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        uint64_t start = bench_now_ns();
+        ASSERT(!IS_ERROR(vmm_map(virt, PAGE_SIZE * 2, PAGES, MAP_READ | MAP_WRITE)));
+        uint64_t mapped = bench_now_ns();
+        ASSERT(!IS_ERROR(vmm_unmap(virt, PAGES)));
+        unmap_ns += bench_now_ns() - mapped;
+        map_ns += mapped - start;
+    }
+
+    bench_report("vmm map 4KB pages", PAGES * ROUNDS, map_ns, "");
+    bench_report("vmm unmap 4KB pages", PAGES * ROUNDS, unmap_ns, "");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Entry
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void bench_vmm() {
+    m_pml4 = pallocz(PAGE_SIZE);
+    ASSERT(m_pml4 != NULL);
+    directptr_t zero_page = pallocz(PAGE_SIZE);
+    ASSERT(zero_page != NULL);
+    m_zero_page = DIRECT_TO_PHYS(zero_page);
+
+    check_vmm_map_unmap();
+    check_vmm_map_out_of_memory();
+    check_vmm_release();
+
+    bench_vmm_map_unmap();
+
+    check_vmm_heap_faults();
+
+    if (g_bench_verbose) {
+        vmm_dump_stats();
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef TOMATOS_BENCH_VMM_H
+#define TOMATOS_BENCH_VMM_H
+
+#include <util/defs.h>
+
+/**
+ * Check the page table primitives of the vmm (mapping ranges with huge pages,
+ * splitting them, undoing a map that ran out of memory and releasing), time
+ * mapping and unmapping ranges of 4KB pages, and fault the heap in from a few
+ * cpus at once while another one maps and unmaps a range next to it.
+ *
+ * The vmm runs on a top level table of its own that the host never loads, the
+ * checks only look at the page tables. Only the heap fault check runs on more
+ * than one cpu, every benchmark thread takes part in its shootdowns.
+ */
+void bench_vmm();
+
+#endif //TOMATOS_BENCH_VMM_H
@@ -0,0 +1,78 @@
+#include <arch/stivale2.h>
+#include <util/string.h>
+#include <mem/mm.h>
+#include "acpi.h"
+
+/**
+ * The root table, either the xsdt or the rsdt
+ */
+static acpi_description_header_t* g_root_table = NULL;
+
+/**
+ * Is the root table an xsdt (64bit entries) or an rsdt (32bit entries)
+ */
+static bool g_root_is_xsdt = false;
+
+/**
+ * Get a pointer to a table from its physical address
+ */
+static void* acpi_table_ptr(uint64_t address) {
+    // some bootloaders already give us direct map addresses
+    if (address >= DIRECT_BASE) {
+        return (void*)address;
+    }
+    return PHYS_TO_DIRECT(address);
+}
+
+err_t init_acpi() {
+    err_t err = NO_ERROR;
+
+    stivale2_struct_tag_rsdp_t* rsdp_tag = get_stivale2_tag(STIVALE2_STRUCT_TAG_RSDP_ID);
+    if (rsdp_tag == NULL) {
+        WARN("Missing RSDP, ACPI tables will not be available");
+        goto cleanup;
+    }
+
+    acpi_rsdp_t* rsdp = acpi_table_ptr(rsdp_tag->rsdp);
+    CHECK(strncmp(rsdp->signature, "RSD PTR ", sizeof(rsdp->signature)) == 0);
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address != 0) {
+        g_root_table = acpi_table_ptr(rsdp->xsdt_address);
+        g_root_is_xsdt = true;
+    } else {
+        g_root_table = acpi_table_ptr(rsdp->rsdt_address);
+        g_root_is_xsdt = false;
+    }
+
+    TRACE("ACPI revision %d (%s)", rsdp->revision, g_root_is_xsdt ? "XSDT" : "RSDT");
+
+cleanup:
+    return err;
+}
+
+void* acpi_get_table(const char* signature) {
+    if (g_root_table == NULL) {
+        return NULL;
+    }
+
+    size_t entry_size = g_root_is_xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+    size_t count = (g_root_table->length - sizeof(acpi_description_header_t)) / entry_size;
+    uint8_t* entries = (uint8_t*)(g_root_table + 1);
+
+    for (size_t i = 0; i < count; i++) {
+        // the entries are not naturally aligned
+        uint64_t address = 0;
+        memcpy(&address, entries + i * entry_size, entry_size);
+
+        acpi_description_header_t* table = acpi_table_ptr(address);
+        if (strncmp(table->signature, signature, sizeof(table->signature)) == 0) {
+            return table;
+        }
+    }
+
+    return NULL;
+}
+
+void release_acpi() {
+    g_root_table = NULL;
+}
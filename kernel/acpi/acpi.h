@@ -0,0 +1,132 @@
+#ifndef TOMATOS_ACPI_H
+#define TOMATOS_ACPI_H
+
+#include <util/except.h>
+#include <util/defs.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Common tables
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+
+    // only valid from revision 2
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t _reserved[3];
+} PACKED acpi_rsdp_t;
+
+typedef struct acpi_description_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    uint64_t oem_table_id;
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} PACKED acpi_description_header_t;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// System Resource Affinity Table
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define ACPI_SRAT_SIGNATURE "SRAT"
+
+typedef struct acpi_srat {
+    acpi_description_header_t header;
+    uint32_t _reserved0;
+    uint64_t _reserved1;
+    uint8_t entries[];
+} PACKED acpi_srat_t;
+
+typedef struct acpi_srat_entry {
+    uint8_t type;
+    uint8_t length;
+} PACKED acpi_srat_entry_t;
+
+#define ACPI_SRAT_PROCESSOR_LAPIC_AFFINITY 0
+#define ACPI_SRAT_MEMORY_AFFINITY 1
+#define ACPI_SRAT_PROCESSOR_X2APIC_AFFINITY 2
+
+#define ACPI_SRAT_ENABLED BIT0
+
+typedef struct acpi_srat_lapic_affinity {
+    acpi_srat_entry_t entry;
+    uint8_t proximity_domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t local_sapic_eid;
+    uint8_t proximity_domain_high[3];
+    uint32_t clock_domain;
+} PACKED acpi_srat_lapic_affinity_t;
+
+typedef struct acpi_srat_memory_affinity {
+    acpi_srat_entry_t entry;
+    uint32_t proximity_domain;
+    uint16_t _reserved0;
+    uint64_t base;
+    uint64_t length;
+    uint32_t _reserved1;
+    uint32_t flags;
+    uint64_t _reserved2;
+} PACKED acpi_srat_memory_affinity_t;
+
+typedef struct acpi_srat_x2apic_affinity {
+    acpi_srat_entry_t entry;
+    uint16_t _reserved0;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t _reserved1;
+} PACKED acpi_srat_x2apic_affinity_t;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// System Locality Information Table
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define ACPI_SLIT_SIGNATURE "SLIT"
+
+typedef struct acpi_slit {
+    acpi_description_header_t header;
+    uint64_t locality_count;
+    uint8_t entries[];
+} PACKED acpi_slit_t;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// ACPI api
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Find the ACPI root tables, this must be called while the stivale2
+ * struct is still available.
+ *
+ * @remark
+ * The tables are accessed through the direct map, we only parse the
+ * tables we need during early init and copy whatever we need out of them.
+ */
+err_t init_acpi();
+
+/**
+ * Get an ACPI table by its signature, returns NULL if not found
+ *
+ * @param signature [IN] The 4 character signature of the table
+ */
+void* acpi_get_table(const char* signature);
+
+/**
+ * Stop using the ACPI tables, this must be called before the
+ * ACPI reclaimable memory is given to the pmm. acpi_get_table
+ * will not find any tables after this.
+ */
+void release_acpi();
+
+#endif //TOMATOS_ACPI_H
@@ -32,6 +32,13 @@ void cpu_pause() {
     asm volatile ("pause");
 }
 
+void cpu_spin() {
+    // we might be spinning with interrupts disabled, so the
+    // shootdown ipi would wait for us forever
+    vmm_handle_shootdown();
+    cpu_pause();
+}
+
 void cpu_sleep() {
     __hlt();
 }
@@ -184,16 +191,22 @@ static void lapic_send_ipi(uint32_t icr_low, uint32_t apic_id) {
     bool state = are_interrupts_enabled();
     disable_interrupts();
 
+    // wait for the previous ipi to be delivered, waiting before
+    // and not after lets the delivery overlap with whatever we
+    // do until the next ipi
+    lapic_icr_low_t icr = { 0 };
+    while (true) {
+        icr.raw = read_lapic_reg(XAPIC_ICR_LOW_OFFSET);
+        if (icr.delivery_status == 0) {
+            break;
+        }
+        cpu_spin();
+    }
+
     // write the regs in the right order
     write_lapic_reg(XAPIC_ICR_HIGH_OFFSET, apic_id << 24);
     write_lapic_reg(XAPIC_ICR_LOW_OFFSET, icr_low);
 
-    // wait for delivery
-    lapic_icr_low_t icr = { 0 };
-    do {
-        icr.raw = read_lapic_reg(XAPIC_ICR_LOW_OFFSET);
-    } while (icr.delivery_status != 0);
-
     if (state) {
         enable_interrupts();
     }
@@ -208,3 +221,17 @@ void lapic_send_fixed_ipi_all_excluding_self(uint8_t vector) {
     };
     lapic_send_ipi(icrlow.raw, 0);
 }
+
+void lapic_send_fixed_ipi(uint32_t apic_id, uint8_t vector) {
+    lapic_icr_low_t icrlow = {
+        .vector = vector,
+        .delivery_mode = LAPIC_DELIVERY_MODE_FIXED,
+        .level = 1,
+        .destination_shorthand = LAPIC_DESTINATION_SHORTHAND_NO_SHORTHAND,
+    };
+    lapic_send_ipi(icrlow.raw, apic_id);
+}
+
+void lapic_eoi() {
+    write_lapic_reg(XAPIC_EOI_OFFSET, 0);
+}
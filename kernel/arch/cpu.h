@@ -102,6 +102,13 @@ void init_cpu_locals(size_t cpuid, size_t lapic_id);
  */
 void cpu_pause();
 
+/**
+ * Pause the cpu in a loop that waits for another cpu, loops that might
+ * run with interrupts disabled must use this instead of cpu_pause, since
+ * it also handles whatever other cpus are waiting on us for
+ */
+void cpu_spin();
+
 /**
  * Makes the cpu go to sleep until an interrupt
  * arrives
@@ -156,7 +163,8 @@ bool are_interrupts_enabled();
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 typedef enum ipi {
-    IPI_WAKEUP = 0xf0
+    IPI_WAKEUP = 0xf0,
+    IPI_TLB_SHOOTDOWN = 0xf1,
 } ipi_t;
 
 /**
@@ -172,4 +180,18 @@ void init_lapic();
  */
 void lapic_send_fixed_ipi_all_excluding_self(uint8_t vector);
 
+/**
+ * Send a fixed ipi to the given apic id at the given vector, this does not
+ * wait for the ipi to be delivered so a few can be sent back to back
+ *
+ * @param apic_id   [IN] The APIC id
+ * @param vector    [IN] The vector
+ */
+void lapic_send_fixed_ipi(uint32_t apic_id, uint8_t vector);
+
+/**
+ * Signal the end of the interrupt we are handling
+ */
+void lapic_eoi();
+
 #endif //TOMATOS_CPU_H
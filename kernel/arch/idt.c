@@ -522,7 +522,6 @@ INTERRUPT_HANDLER(0xed)
 INTERRUPT_HANDLER(0xee)
 INTERRUPT_HANDLER(0xef)
 INTERRUPT_HANDLER(0xf0)
-INTERRUPT_HANDLER(0xf1)
 INTERRUPT_HANDLER(0xf2)
 INTERRUPT_HANDLER(0xf3)
 INTERRUPT_HANDLER(0xf4)
@@ -538,6 +537,19 @@ INTERRUPT_HANDLER(0xfd)
 INTERRUPT_HANDLER(0xfe)
 INTERRUPT_HANDLER(0xff)
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// IPI handlers
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Another cpu changed the kernel mappings and waits for us to flush them
+ */
+__attribute__ ((interrupt))
+static void interrupt_handle_0xf1(void* frame) {
+    vmm_handle_shootdown();
+    lapic_eoi();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Define IDT structures and set the idt up
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -141,13 +141,27 @@ void cpuidex(uint32_t val, uint64_t leaf, uint32_t* rax, uint32_t* rbx, uint32_t
 }
 
 void __invlpg(uintptr_t a) {
-    __asm__ __volatile__("invlpg (%%eax)" : : "a" (a) );
+    __asm__ __volatile__("invlpg (%0)" : : "r" (a) : "memory");
+}
+
+void __invpcid(uint64_t type, uint64_t pcid, uintptr_t a) {
+    struct {
+        uint64_t pcid;
+        uint64_t address;
+    } descriptor = { pcid, a };
+    __asm__ __volatile__("invpcid %0, %1" : : "m" (descriptor), "r" (type) : "memory");
 }
 
 void __hlt(void) {
     __asm__ volatile ("hlt");
 }
 
+uint64_t __rdtsc(void) {
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32u) | low;
+}
+
 void __nop(void) {
     __asm__ volatile ("nop");
 }
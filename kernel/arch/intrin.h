@@ -181,9 +181,21 @@ void cpuidex(uint32_t val, uint64_t leaf, uint32_t* rax, uint32_t* rbx, uint32_t
 
 void __invlpg(uintptr_t a);
 
+/**
+ * The invalidation types of invpcid
+ */
+#define INVPCID_ADDRESS             0
+#define INVPCID_CONTEXT             1
+#define INVPCID_ALL_GLOBAL          2
+#define INVPCID_ALL_NON_GLOBAL      3
+
+void __invpcid(uint64_t type, uint64_t pcid, uintptr_t a);
+
 void __hlt(void);
 void __nop(void);
 
+uint64_t __rdtsc(void);
+
 void __stac(void);
 void __clac(void);
 
@@ -2,17 +2,29 @@
 #include <util/defs.h>
 #include <mem/mm.h>
 #include <util/trace.h>
+#include <util/except.h>
+#include <util/string.h>
 
 stivale2_struct_t* g_stivale2_struct = NULL;
 
+/**
+ * The tags that were copied out of the bootloader memory, linked
+ * just like the original tags
+ */
+static stivale2_tag_t* g_preserved_tags = NULL;
+
 void* get_stivale2_tag(uint64_t id) {
-    if (g_stivale2_struct == NULL) {
+    stivale2_tag_t* tag;
+
+    if (g_stivale2_struct != NULL) {
+        tag = (stivale2_tag_t*)g_stivale2_struct->tags;
+    } else if (g_preserved_tags != NULL) {
+        tag = g_preserved_tags;
+    } else {
         WARN("Tried to get a stivale2 tag after early init");
         return NULL;
     }
 
-    stivale2_tag_t* tag = (stivale2_tag_t*)g_stivale2_struct->tags;
-
     while (tag != NULL) {
         if (tag->identifier == id) {
             return tag;
@@ -22,3 +34,56 @@ void* get_stivale2_tag(uint64_t id) {
 
     return NULL;
 }
+
+/**
+ * Get the size of a tag we know how to copy, 0 if we don't need the tag
+ */
+static size_t stivale2_tag_size(stivale2_tag_t* tag) {
+    switch (tag->identifier) {
+        case STIVALE2_STRUCT_TAG_MEMMAP_ID: {
+            stivale2_struct_tag_memmap_t* memmap = (stivale2_struct_tag_memmap_t*)tag;
+            return sizeof(*memmap) + memmap->entries * sizeof(stivale2_mmap_entry_t);
+        }
+
+        case STIVALE2_STRUCT_TAG_FRAMEBUFFER_ID:
+            return sizeof(stivale2_struct_tag_framebuffer_t);
+
+        case STIVALE2_STRUCT_TAG_MODULES_ID: {
+            stivale2_struct_tag_modules_t* modules = (stivale2_struct_tag_modules_t*)tag;
+            return sizeof(*modules) + modules->module_count * sizeof(stivale2_module_t);
+        }
+
+        default:
+            return 0;
+    }
+}
+
+err_t preserve_stivale2_tags() {
+    err_t err = NO_ERROR;
+
+    CHECK(g_stivale2_struct != NULL);
+
+    stivale2_tag_t* prev = NULL;
+    for (stivale2_tag_t* tag = (stivale2_tag_t*)g_stivale2_struct->tags; tag != NULL; tag = (stivale2_tag_t*)tag->next) {
+        size_t size = stivale2_tag_size(tag);
+        if (size == 0) {
+            continue;
+        }
+
+        stivale2_tag_t* copy = kalloc_uninit(size);
+        CHECK_ERROR(copy != NULL, ERROR_OUT_OF_RESOURCES);
+        memcpy(copy, tag, size);
+
+        // link it at the end
+        copy->next = 0;
+        if (prev != NULL) {
+            prev->next = (uint64_t)copy;
+        } else {
+            g_preserved_tags = copy;
+        }
+        prev = copy;
+    }
+
+cleanup:
+    return err;
+}
@@ -1,6 +1,7 @@
 #ifndef __TOMATOS_STIVALE2_H__
 #define __TOMATOS_STIVALE2_H__
 
+#include <util/except.h>
 #include <stdint.h>
 
 typedef struct stivale2_tag {
@@ -176,4 +177,12 @@ extern struct stivale2_struct* g_stivale2_struct;
  */
 void* get_stivale2_tag(uint64_t id);
 
+/**
+ * Copy the tags we still need after early init (memmap, framebuffer and modules)
+ * into the kernel heap, once this is done get_stivale2_tag will keep returning
+ * the copies even after the stivale2 struct is gone, so the memory of the
+ * bootloader can be reclaimed.
+ */
+err_t preserve_stivale2_tags();
+
 #endif //__TOMATOS_STIVALE2_H__
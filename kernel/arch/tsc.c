@@ -0,0 +1,63 @@
+#include <util/trace.h>
+#include "intrin.h"
+#include "cpu.h"
+#include "tsc.h"
+#include "io.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Time stamp counter
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint64_t g_tsc_frequency = 0;
+
+/**
+ * The PIT runs at a fixed frequency, we count how many tsc ticks pass while
+ * it counts down, using channel 2 since its gate is controlled from port 0x61
+ */
+#define PIT_FREQUENCY 1193182
+#define PIT_CALIBRATION_HZ 100
+
+static uint64_t calibrate_tsc_with_pit() {
+    // gate on, speaker off
+    io_write_8(0x61, (io_read_8(0x61) & ~BIT1) | BIT0);
+
+    // channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+    uint16_t count = PIT_FREQUENCY / PIT_CALIBRATION_HZ;
+    io_write_8(0x43, 0xB0);
+    io_write_8(0x42, count & 0xFF);
+    io_write_8(0x42, count >> 8);
+
+    // the output goes up once it reaches zero
+    uint64_t start = __rdtsc();
+    while (!(io_read_8(0x61) & BIT5)) {
+        cpu_pause();
+    }
+    uint64_t end = __rdtsc();
+
+    return (end - start) * PIT_CALIBRATION_HZ;
+}
+
+void init_tsc() {
+    uint32_t max_leaf = 0;
+    cpuid(0x0, &max_leaf, NULL, NULL, NULL);
+
+    // the tsc to crystal ratio and the crystal frequency
+    if (max_leaf >= 0x15) {
+        uint32_t denominator = 0, numerator = 0, crystal = 0;
+        cpuid(0x15, &denominator, &numerator, &crystal, NULL);
+        if (denominator != 0 && numerator != 0 && crystal != 0) {
+            g_tsc_frequency = (uint64_t)crystal * numerator / denominator;
+            TRACE("TSC frequency is %lu MHz (from cpuid)", g_tsc_frequency / 1000000);
+            return;
+        }
+    }
+
+    // don't trust the base frequency from leaf 0x16, it is not always
+    // the tsc frequency, just measure it instead
+    g_tsc_frequency = calibrate_tsc_with_pit();
+    TRACE("TSC frequency is %lu MHz (from the pit)", g_tsc_frequency / 1000000);
+}
+
+uint64_t tsc_to_ms(uint64_t ticks) {
+    return ticks / (g_tsc_frequency / 1000);
+}
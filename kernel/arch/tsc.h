@@ -0,0 +1,27 @@
+#ifndef TOMATOS_TSC_H
+#define TOMATOS_TSC_H
+
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Time stamp counter
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The frequency of the tsc in hz, we assume it is invariant
+ * and the same on all the cpus
+ */
+extern uint64_t g_tsc_frequency;
+
+/**
+ * Find the tsc frequency, either from cpuid or by measuring it against
+ * the pit, must be called once on the bsp
+ */
+void init_tsc();
+
+/**
+ * Convert an amount of tsc ticks to milliseconds
+ */
+uint64_t tsc_to_ms(uint64_t ticks);
+
+#endif //TOMATOS_TSC_H
@@ -1,12 +1,18 @@
 #include <util/trace.h>
 #include <util/except.h>
 #include <util/string.h>
+#include <acpi/acpi.h>
+#include <mem/alloc_trace.h>
+#include <mem/large.h>
+#include <mem/numa.h>
 #include <mem/pmm.h>
+#include <mem/slab.h>
 #include <mem/vmm.h>
 #include <task/sched.h>
 
 #include "arch/gdt.h"
 #include "arch/idt.h"
+#include "arch/tsc.h"
 
 #include "arch/stivale2.h"
 #include "main.h"
@@ -78,6 +84,7 @@ static void smp_kentry(volatile stivale2_smp_info_t* smpinfo) {
     // init paging
     set_address_space();
     init_lapic();
+    init_tlb_shootdown();
 
     // we are ready
     g_cpu_start_count++;
@@ -161,18 +168,40 @@ void kentry(stivale2_struct_t* info) {
         WARN("Missing SMP info, will only have one core.");
     }
 
+    //
+    // anything that measures time needs the tsc frequency
+    //
+    init_tsc();
+
+    //
+    // get the memory topology before we setup the pmm
+    //
+    CHECK_AND_RETHROW(init_acpi());
+    CHECK_AND_RETHROW(init_numa());
+
     //
     // initialize the pmm and vmm
     //
     CHECK_AND_RETHROW(init_pmm());
+    CHECK_AND_RETHROW(init_alloc_trace());
+    CHECK_AND_RETHROW(init_slab());
     CHECK_AND_RETHROW(init_vmm());
+    CHECK_AND_RETHROW(init_large());
     init_lapic();
+    init_tlb_shootdown();
 
     //
     // Initialize the task dispatcher
     //
     init_task_dispatcher();
 
+    //
+    // copy whatever we still need from the bootloader, we are
+    // going to reclaim its memory once all the cpus are ready
+    //
+    CHECK_AND_RETHROW(preserve_stivale2_tags());
+    release_acpi();
+
     // we can't access these anymore at this point
     smp = NULL;
     g_stivale2_struct = NULL;
@@ -190,9 +219,15 @@ void kentry(stivale2_struct_t* info) {
     // signal we are ready and wait
     g_ready = true;
     while (g_cpu_start_count != g_cpu_count) {
-        cpu_pause();
+        cpu_spin();
     }
 
+    //
+    // all the cpus are using our page tables and no longer touch
+    // the bootloader structures, we can take the memory back
+    //
+    CHECK_AND_RETHROW(pmm_reclaim_boot_memory());
+
     TRACE("Done kernel early init");
 
     // queue the main task so we can continue setup in there
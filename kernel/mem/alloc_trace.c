@@ -0,0 +1,149 @@
+#include <util/except.h>
+#include <util/trace.h>
+#include <arch/intrin.h>
+#include <arch/cpu.h>
+#include <sync/lock.h>
+#include "alloc_trace.h"
+#include "pmm.h"
+
+#ifdef __TOMATOS_ALLOC_TRACE__
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocation trace
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The amount of events in the ring of each cpu, events that
+ * don't fit are dropped (and counted)
+ */
+#define ALLOC_TRACE_RING_SIZE 4096
+
+/**
+ * The max amount of events written by a single flush, writing
+ * to the debug port is slow
+ */
+#define ALLOC_TRACE_FLUSH_MAX 256
+
+/**
+ * A single producer single consumer ring, the cpu of the ring is the only
+ * producer, and the consumer is whoever holds the flush lock
+ */
+typedef struct alloc_trace_ring {
+    alloc_trace_event_t* events;
+
+    /**
+     * The next event to write, only written by the producer
+     */
+    size_t head;
+
+    /**
+     * The next event to flush, only written by the consumer
+     */
+    size_t tail;
+
+    /**
+     * Events that did not fit, and how many of those the
+     * consumer already reported
+     */
+    size_t dropped;
+    size_t dropped_reported;
+} __attribute__((aligned(64))) alloc_trace_ring_t;
+
+static alloc_trace_ring_t g_alloc_trace_rings[ARRAY_LEN(g_cpu_locals)];
+
+static lock_t g_alloc_trace_flush_lock = INIT_LOCK(TPL_HIGH_LEVEL);
+
+err_t init_alloc_trace() {
+    err_t err = NO_ERROR;
+
+    for (size_t i = 0; i < g_cpu_count; i++) {
+        alloc_trace_event_t* events = palloc(ALLOC_TRACE_RING_SIZE * sizeof(alloc_trace_event_t));
+        CHECK_ERROR(events != NULL, ERROR_OUT_OF_RESOURCES);
+        __atomic_store_n(&g_alloc_trace_rings[i].events, events, __ATOMIC_RELEASE);
+    }
+
+    TRACE("Allocation trace enabled, %lu events per cpu", ALLOC_TRACE_RING_SIZE);
+
+cleanup:
+    return err;
+}
+
+void alloc_trace_record(alloc_trace_type_t type, void* ptr, void* old_ptr, size_t size) {
+    alloc_trace_ring_t* ring = &g_alloc_trace_rings[g_cpu_id];
+
+    // not initialized yet, or a failed allocation
+    if (ring->events == NULL || ptr == NULL) {
+        return;
+    }
+
+    size_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ALLOC_TRACE_RING_SIZE) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    alloc_trace_event_t* event = &ring->events[head % ALLOC_TRACE_RING_SIZE];
+    event->time = __rdtsc();
+    event->ptr = (uintptr_t)ptr;
+    event->old_ptr = (uintptr_t)old_ptr;
+    event->size = size;
+    event->cpu = g_cpu_id;
+    event->type = type;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void write_event(alloc_trace_event_t* event) {
+    kprintf(ALLOC_TRACE_LINE_PREFIX " %x %x %lx %lx %lx %lx\n",
+            event->type, event->cpu, event->time, event->ptr, event->old_ptr, event->size);
+}
+
+bool alloc_trace_flush() {
+    size_t written = 0;
+
+    // someone else is flushing already
+    if (!acquire_lock_or_fail(&g_alloc_trace_flush_lock)) {
+        return false;
+    }
+
+    // take the trace lock once for the whole batch, so
+    // the lines are not mixed with other output
+    acquire_lock(&g_trace_lock);
+
+    for (size_t i = 0; i < g_cpu_count && written < ALLOC_TRACE_FLUSH_MAX; i++) {
+        alloc_trace_ring_t* ring = &g_alloc_trace_rings[i];
+        if (ring->events == NULL) {
+            continue;
+        }
+
+        size_t tail = ring->tail;
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head && written < ALLOC_TRACE_FLUSH_MAX) {
+            write_event(&ring->events[tail % ALLOC_TRACE_RING_SIZE]);
+            tail++;
+            written++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        // let the replay know it is missing events
+        size_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_reported) {
+            alloc_trace_event_t event = {
+                .time = __rdtsc(),
+                .size = dropped - ring->dropped_reported,
+                .cpu = i,
+                .type = ALLOC_TRACE_DROPPED,
+            };
+            write_event(&event);
+            ring->dropped_reported = dropped;
+            written++;
+        }
+    }
+
+    release_lock(&g_trace_lock);
+    release_lock(&g_alloc_trace_flush_lock);
+
+    return written != 0;
+}
+
+#endif
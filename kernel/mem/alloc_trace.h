@@ -0,0 +1,105 @@
+#ifndef TOMATOS_ALLOC_TRACE_H
+#define TOMATOS_ALLOC_TRACE_H
+
+#include <util/except.h>
+#include <util/defs.h>
+
+/**
+ * The allocation trace is only compiled in with ALLOC_TRACE=1, when enabled
+ * every heap and pmm operation is recorded into a per-cpu ring, and idle cpus
+ * stream the rings out through the debug output as lines of the form:
+ *
+ *      !AT <type> <cpu> <time> <ptr> <old ptr> <size>
+ *
+ * All the fields are in hex. scripts/alloc_trace.py turns the lines of a log
+ * into a binary file of alloc_trace_event_t, sorted by time, which the host
+ * benchmarks can replay against the allocators (see bench/replay.c).
+ */
+#define ALLOC_TRACE_LINE_PREFIX "!AT"
+
+typedef enum alloc_trace_type {
+    /**
+     * ptr was allocated with the given size
+     */
+    ALLOC_TRACE_KALLOC,
+
+    /**
+     * old ptr was resized to the given size and moved to ptr,
+     * old ptr is 0 for a krealloc of NULL
+     */
+    ALLOC_TRACE_KREALLOC,
+
+    /**
+     * ptr was freed
+     */
+    ALLOC_TRACE_KFREE,
+
+    /**
+     * ptr was allocated from the pmm with the given size
+     */
+    ALLOC_TRACE_PALLOC,
+
+    /**
+     * ptr was freed to the pmm with the given size
+     */
+    ALLOC_TRACE_PFREE,
+
+    /**
+     * The ring of the cpu was full, size events were lost
+     */
+    ALLOC_TRACE_DROPPED,
+} alloc_trace_type_t;
+
+/**
+ * A single event, this is also the format of the binary trace files
+ */
+typedef struct alloc_trace_event {
+    uint64_t time;
+    uint64_t ptr;
+    uint64_t old_ptr;
+    uint64_t size;
+    uint32_t cpu;
+    uint32_t type;
+} alloc_trace_event_t;
+
+#ifdef __TOMATOS_ALLOC_TRACE__
+
+/**
+ * Create the rings of all the cpus, nothing is recorded before this
+ *
+ * @remark
+ * Must be called after init_pmm
+ */
+err_t init_alloc_trace();
+
+/**
+ * Record an event on the current cpu, events with a NULL ptr
+ * (failed allocations) are not recorded
+ */
+void alloc_trace_record(alloc_trace_type_t type, void* ptr, void* old_ptr, size_t size);
+
+/**
+ * Write some of the recorded events to the debug output, should
+ * be called by cpus that have nothing better to do
+ *
+ * @returns true if anything was written
+ */
+bool alloc_trace_flush();
+
+#define ALLOC_TRACE(type, ptr, old_ptr, size) alloc_trace_record(type, ptr, old_ptr, size)
+
+#else
+
+static inline err_t init_alloc_trace() {
+    return NO_ERROR;
+}
+
+static inline bool alloc_trace_flush() {
+    return false;
+}
+
+#define ALLOC_TRACE(type, ptr, old_ptr, size) do {} while (0)
+
+#endif
+
+#endif //TOMATOS_ALLOC_TRACE_H
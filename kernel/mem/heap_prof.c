@@ -0,0 +1,347 @@
+#include <util/except.h>
+#include <util/string.h>
+#include <arch/intrin.h>
+#include <arch/cpu.h>
+#include <arch/tsc.h>
+#include <cont/list.h>
+#include <sync/lock.h>
+#include "heap_prof.h"
+#include "pmm.h"
+
+#ifdef __TOMATOS_HEAP_PROFILER__
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Heap profiler
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The amount of call sites each cpu can count, sites that don't fit are
+ * counted together, we give up after a few probes to keep it cheap
+ */
+#define HEAP_PROF_SITES_SHIFT 9
+#define HEAP_PROF_SITES (1ull << HEAP_PROF_SITES_SHIFT)
+#define HEAP_PROF_PROBES 16
+
+/**
+ * How many sites are traced by the dump, and how many
+ * allocations are traced by the leak report
+ */
+#define HEAP_PROF_DUMP_TOP 32
+#define HEAP_PROF_LEAK_MAX 64
+
+/**
+ * The stats of a single call site on a single cpu, allocations are counted
+ * on the cpu that did them, and frees are counted on the same entry even if
+ * they are done from another cpu, so the counters are atomic.
+ */
+typedef struct heap_prof_site {
+    /**
+     * The return address of the kalloc call, NULL if the entry is free
+     */
+    void* site;
+
+    size_t allocs;
+    size_t frees;
+    size_t total_bytes;
+    size_t live_bytes;
+
+    /**
+     * Only updated by the cpu of the entry
+     */
+    size_t peak_bytes;
+} heap_prof_site_t;
+
+typedef struct heap_prof_header {
+    /**
+     * Link in the live list of the cpu that did the allocation
+     */
+    list_entry_t link;
+
+    /**
+     * The site entry this is counted on, NULL if not tracked
+     */
+    heap_prof_site_t* site;
+
+    /**
+     * The size the caller asked for
+     */
+    size_t size;
+
+    /**
+     * The tsc at the time of the allocation
+     */
+    uint64_t time;
+
+    /**
+     * The cpu that did the allocation
+     */
+    uint32_t cpu;
+
+    /**
+     * Where the memory of the caller starts in the allocation,
+     * more than the header size for aligned allocations
+     */
+    uint32_t offset;
+} heap_prof_header_t;
+
+_Static_assert(sizeof(heap_prof_header_t) == HEAP_PROF_HEADER_SIZE, "Wrong heap profiler header size");
+
+typedef struct heap_prof_cpu {
+    /**
+     * Protects the live list, only taken by other cpus when
+     * they free memory of this cpu or when dumping
+     */
+    lock_t lock;
+
+    /**
+     * The live allocations of this cpu, oldest first
+     */
+    list_t live;
+
+    /**
+     * Sites that did not fit in the table
+     */
+    heap_prof_site_t overflow;
+
+    heap_prof_site_t sites[HEAP_PROF_SITES];
+} heap_prof_cpu_t;
+
+/**
+ * The tables of the cpus, each cpu creates its own table the
+ * first time it allocates
+ */
+static heap_prof_cpu_t* g_heap_prof_cpus[ARRAY_LEN(g_cpu_locals)] = { 0 };
+
+/**
+ * Used to merge the tables of all the cpus when dumping
+ */
+static heap_prof_site_t g_heap_prof_dump[HEAP_PROF_SITES * 4];
+static lock_t g_heap_prof_dump_lock = INIT_LOCK(TPL_HIGH_LEVEL);
+
+static size_t site_hash(void* site, size_t shift) {
+    return ((uintptr_t)site * 0x9E3779B97F4A7C15ull) >> (64 - shift);
+}
+
+static heap_prof_cpu_t* current_prof_cpu() {
+    heap_prof_cpu_t* cpu = g_heap_prof_cpus[g_cpu_id];
+    if (cpu != NULL) {
+        return cpu;
+    }
+
+    cpu = pallocz(sizeof(heap_prof_cpu_t));
+    if (cpu == NULL) {
+        return NULL;
+    }
+    cpu->lock = INIT_LOCK(TPL_HIGH_LEVEL);
+    list_init(&cpu->live);
+
+    __atomic_store_n(&g_heap_prof_cpus[g_cpu_id], cpu, __ATOMIC_RELEASE);
+    return cpu;
+}
+
+/**
+ * Get the entry of the site, only called by the cpu of the table
+ */
+static heap_prof_site_t* site_get(heap_prof_cpu_t* cpu, void* site) {
+    size_t hash = site_hash(site, HEAP_PROF_SITES_SHIFT);
+    for (size_t i = 0; i < HEAP_PROF_PROBES; i++) {
+        heap_prof_site_t* entry = &cpu->sites[(hash + i) & (HEAP_PROF_SITES - 1)];
+        if (entry->site == site) {
+            return entry;
+        }
+
+        if (entry->site == NULL) {
+            entry->site = site;
+            return entry;
+        }
+    }
+
+    return &cpu->overflow;
+}
+
+void* heap_prof_track(void* base, size_t offset, size_t size, void* site) {
+    heap_prof_header_t* header = (heap_prof_header_t*)((uint8_t*)base + offset) - 1;
+    header->size = size;
+    header->time = __rdtsc();
+    header->cpu = g_cpu_id;
+    header->offset = offset;
+    header->site = NULL;
+
+    heap_prof_cpu_t* cpu = current_prof_cpu();
+    if (cpu == NULL) {
+        return header + 1;
+    }
+
+    heap_prof_site_t* entry = site_get(cpu, site);
+    __atomic_fetch_add(&entry->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&entry->total_bytes, size, __ATOMIC_RELAXED);
+    size_t live = __atomic_add_fetch(&entry->live_bytes, size, __ATOMIC_RELAXED);
+    if (live > entry->peak_bytes) {
+        entry->peak_bytes = live;
+    }
+    header->site = entry;
+
+    acquire_lock(&cpu->lock);
+    list_push(&cpu->live, &header->link);
+    release_lock(&cpu->lock);
+
+    return header + 1;
+}
+
+void* heap_prof_untrack(void* ptr, size_t* size, void** site) {
+    heap_prof_header_t* header = (heap_prof_header_t*)ptr - 1;
+    heap_prof_site_t* entry = header->site;
+
+    if (entry != NULL) {
+        heap_prof_cpu_t* cpu = g_heap_prof_cpus[header->cpu];
+        acquire_lock(&cpu->lock);
+        list_remove(&header->link);
+        release_lock(&cpu->lock);
+
+        __atomic_fetch_add(&entry->frees, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&entry->live_bytes, header->size, __ATOMIC_RELAXED);
+    }
+
+    if (size != NULL) {
+        *size = header->size;
+    }
+    if (site != NULL) {
+        *site = entry != NULL ? entry->site : NULL;
+    }
+    return (uint8_t*)ptr - header->offset;
+}
+
+void heap_prof_restore(void* ptr) {
+    heap_prof_header_t* header = (heap_prof_header_t*)ptr - 1;
+    heap_prof_site_t* entry = header->site;
+
+    if (entry == NULL) {
+        return;
+    }
+
+    __atomic_fetch_sub(&entry->frees, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&entry->live_bytes, header->size, __ATOMIC_RELAXED);
+
+    // the list is sorted by age, the allocation is most likely
+    // a young one so look for its place from the end
+    heap_prof_cpu_t* cpu = g_heap_prof_cpus[header->cpu];
+    acquire_lock(&cpu->lock);
+    list_entry_t* next = &cpu->live;
+    while (next->prev != &cpu->live && CR(next->prev, heap_prof_header_t, link)->time > header->time) {
+        next = next->prev;
+    }
+    list_push(next, &header->link);
+    release_lock(&cpu->lock);
+}
+
+/**
+ * Add the stats of a site to the merged table
+ */
+static void dump_merge(heap_prof_site_t* entry) {
+    size_t hash = site_hash(entry->site, HEAP_PROF_SITES_SHIFT + 2);
+    for (size_t i = 0; i < ARRAY_LEN(g_heap_prof_dump); i++) {
+        heap_prof_site_t* merged = &g_heap_prof_dump[(hash + i) % ARRAY_LEN(g_heap_prof_dump)];
+        if (merged->allocs != 0 && merged->site != entry->site) {
+            continue;
+        }
+
+        merged->site = entry->site;
+        merged->allocs += entry->allocs;
+        merged->frees += entry->frees;
+        merged->total_bytes += entry->total_bytes;
+        merged->live_bytes += entry->live_bytes;
+        merged->peak_bytes += entry->peak_bytes;
+        return;
+    }
+}
+
+void heap_prof_dump() {
+    acquire_lock(&g_heap_prof_dump_lock);
+    memset(g_heap_prof_dump, 0, sizeof(g_heap_prof_dump));
+
+    // merge the sites of all the cpus, the counters are read without
+    // any locking so they might be slightly off
+    size_t live_bytes = 0;
+    for (size_t i = 0; i < ARRAY_LEN(g_heap_prof_cpus); i++) {
+        heap_prof_cpu_t* cpu = __atomic_load_n(&g_heap_prof_cpus[i], __ATOMIC_ACQUIRE);
+        if (cpu == NULL) {
+            continue;
+        }
+
+        for (size_t j = 0; j < HEAP_PROF_SITES; j++) {
+            if (cpu->sites[j].site != NULL) {
+                dump_merge(&cpu->sites[j]);
+                live_bytes += cpu->sites[j].live_bytes;
+            }
+        }
+
+        if (cpu->overflow.allocs != 0) {
+            dump_merge(&cpu->overflow);
+            live_bytes += cpu->overflow.live_bytes;
+        }
+    }
+
+    TRACE("Heap profile: %lu KB live", live_bytes / SIZE_1KB);
+
+    // trace the sites with the most live memory, the site
+    // of the overflow entry is NULL
+    for (size_t n = 0; n < HEAP_PROF_DUMP_TOP; n++) {
+        heap_prof_site_t* top = NULL;
+        for (size_t i = 0; i < ARRAY_LEN(g_heap_prof_dump); i++) {
+            heap_prof_site_t* merged = &g_heap_prof_dump[i];
+            if (merged->allocs != 0 && (top == NULL || merged->live_bytes > top->live_bytes)) {
+                top = merged;
+            }
+        }
+
+        if (top == NULL) {
+            break;
+        }
+
+        TRACE("\t[%016p] %lu KB live (peak %lu KB), %lu allocs, %lu frees, %lu KB allocated",
+              top->site, top->live_bytes / SIZE_1KB, top->peak_bytes / SIZE_1KB,
+              top->allocs, top->frees, top->total_bytes / SIZE_1KB);
+        top->allocs = 0;
+    }
+
+    release_lock(&g_heap_prof_dump_lock);
+}
+
+void heap_prof_leak_report(uint64_t seconds) {
+    uint64_t now = __rdtsc();
+    uint64_t max_age = seconds * g_tsc_frequency;
+    size_t count = 0;
+    size_t bytes = 0;
+
+    TRACE("Heap allocations older than %lu seconds:", seconds);
+
+    for (size_t i = 0; i < ARRAY_LEN(g_heap_prof_cpus); i++) {
+        heap_prof_cpu_t* cpu = __atomic_load_n(&g_heap_prof_cpus[i], __ATOMIC_ACQUIRE);
+        if (cpu == NULL) {
+            continue;
+        }
+
+        // the list is sorted by age, so we stop at the first
+        // allocation that is young enough
+        acquire_lock(&cpu->lock);
+        for (list_entry_t* link = cpu->live.next; link != &cpu->live; link = link->next) {
+            heap_prof_header_t* header = CR(link, heap_prof_header_t, link);
+            if (now - header->time < max_age) {
+                break;
+            }
+
+            if (count < HEAP_PROF_LEAK_MAX) {
+                TRACE("\t%p: %lu bytes from [%016p], %lu seconds old",
+                      header + 1, header->size, header->site->site,
+                      tsc_to_ms(now - header->time) / 1000);
+            }
+            count++;
+            bytes += header->size;
+        }
+        release_lock(&cpu->lock);
+    }
+
+    TRACE("%lu allocations (%lu KB) older than %lu seconds", count, bytes / SIZE_1KB, seconds);
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef TOMATOS_HEAP_PROF_H
+#define TOMATOS_HEAP_PROF_H
+
+#include <util/defs.h>
+
+/**
+ * The heap profiler is only compiled in with HEAP_PROFILER=1, when enabled
+ * every kalloc is prefixed with a header that records the call site, the size
+ * and the time of the allocation, and the call sites are counted in per-cpu
+ * hash tables so allocating and freeing on the same cpu never shares any
+ * cache lines with other cpus.
+ *
+ * The header keeps the 8 byte alignment of the allocations, but allocations
+ * are not page aligned anymore. kalloc_aligned pads the header so the memory
+ * after it is aligned.
+ *
+ * Use heap_prof_dump and heap_prof_leak_report (only available with
+ * the profiler) to see the results.
+ */
+#define HEAP_PROF_HEADER_SIZE 48
+
+/**
+ * Start tracking an allocation
+ *
+ * @param base      [IN] The allocation, including the header
+ * @param offset    [IN] Where the memory of the caller starts, at least HEAP_PROF_HEADER_SIZE
+ * @param size      [IN] The size the caller asked for
+ * @param site      [IN] The call site
+ *
+ * @returns The pointer to give to the caller, base + offset
+ */
+void* heap_prof_track(void* base, size_t offset, size_t size, void* site);
+
+/**
+ * Stop tracking an allocation
+ *
+ * @param ptr   [IN]  The pointer the caller got
+ * @param size  [OUT] The size of the allocation, can be NULL
+ * @param site  [OUT] The call site of the allocation, can be NULL
+ *
+ * @returns The allocation, including the header
+ */
+void* heap_prof_untrack(void* ptr, size_t* size, void** site);
+
+/**
+ * Undo heap_prof_untrack, for when the allocation turned out to stay alive
+ * (a failed krealloc), it goes back to its place in the live list with its
+ * original time and is not counted as a new allocation
+ *
+ * @param ptr   [IN] The pointer the caller got
+ */
+void heap_prof_restore(void* ptr);
+
+/**
+ * Trace the call sites with the most live memory
+ *
+ * @remark
+ * The peak of a site is the sum of its peak on every cpu, so
+ * it is an upper bound of the real peak
+ */
+void heap_prof_dump();
+
+/**
+ * Trace the allocations that are still alive after the given
+ * amount of seconds
+ */
+void heap_prof_leak_report(uint64_t seconds);
+
+#endif //TOMATOS_HEAP_PROF_H
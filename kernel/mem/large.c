@@ -0,0 +1,429 @@
+#include <util/except.h>
+#include <util/string.h>
+#include <sync/lock.h>
+#include "large.h"
+#include "numa.h"
+#include "pmm.h"
+#include "slab.h"
+#include "vmm.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Large allocations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The large range is split into a part for every power of two slot size, from
+ * LARGE_MIN_SIZE up to the biggest allocation, each part is big enough to hold
+ * a lot of slots and is aligned to it so slots are naturally aligned, meaning
+ * big enough allocations can be backed by huge pages.
+ *
+ * An allocation only maps the pages it needs, and can grow without moving
+ * until it fills its slot.
+ */
+#define LARGE_CLASS_RANGE SIZE_512GB
+#define LARGE_CLASS_COUNT 20
+#define LARGE_MAX_SIZE ((size_t)LARGE_MIN_SIZE << (LARGE_CLASS_COUNT - 1))
+
+_Static_assert(LARGE_MAX_SIZE == SIZE_64GB, "The biggest slot must be 64GB");
+_Static_assert(LARGE_CLASS_COUNT * LARGE_CLASS_RANGE <= KERNEL_LARGE_END - KERNEL_LARGE_START,
+               "The large slot classes don't fit in the large range");
+
+/**
+ * How many pages are allocated and mapped at once
+ */
+#define LARGE_MAP_BATCH 64
+
+/**
+ * A slot of the large range, the records are created the first time a slot is
+ * used and are reused with it, the record of an allocation is the owner of the
+ * first physical page of the allocation.
+ */
+typedef struct large {
+    /**
+     * Link in the free slot stack of the class
+     */
+    struct large* next;
+
+    /**
+     * The start of the slot
+     */
+    uintptr_t base;
+
+    /**
+     * The mapped size, the allocation is always mapped from the start of the
+     * slot, the first huge_count 2MB chunks of it are backed by huge pages
+     */
+    size_t size;
+    size_t huge_count;
+
+    /**
+     * The numa node the pages of the allocation are taken from
+     */
+    int node;
+
+    /**
+     * The slot class
+     */
+    size_t class;
+} large_t;
+
+typedef struct large_class {
+    /**
+     * Protects the free slots and the stats
+     */
+    lock_t lock;
+
+    /**
+     * Slots that were freed, the most recently freed first
+     */
+    large_t* free_slots;
+
+    /**
+     * The amount of slots ever used from the range of the class
+     */
+    size_t slot_count;
+
+    /**
+     * Stats
+     */
+    size_t allocs;
+    size_t frees;
+    size_t in_use;
+} large_class_t;
+
+static large_class_t g_large_classes[LARGE_CLASS_COUNT] = {
+    [0 ... LARGE_CLASS_COUNT - 1] = {
+        .lock = INIT_LOCK(TPL_HIGH_LEVEL),
+    }
+};
+
+/**
+ * The records of the slots
+ */
+static kmem_cache_t* g_large_cache = NULL;
+
+/**
+ * The amount of huge pages that back large allocations, the amount of resizes
+ * that didn't have to move the allocation and the amount that moved the pages
+ * to a bigger slot
+ */
+static size_t g_large_huge_pages = 0;
+static size_t g_large_resizes = 0;
+static size_t g_large_moves = 0;
+
+err_t init_large() {
+    err_t err = NO_ERROR;
+
+    g_large_cache = kmem_cache_create("large", sizeof(large_t));
+    CHECK_ERROR(g_large_cache != NULL, ERROR_OUT_OF_RESOURCES);
+
+cleanup:
+    return err;
+}
+
+static size_t class_slot_size(size_t class) {
+    return (size_t)LARGE_MIN_SIZE << class;
+}
+
+static uintptr_t class_base(size_t class) {
+    return KERNEL_LARGE_START + class * LARGE_CLASS_RANGE;
+}
+
+static size_t size_to_class(size_t size) {
+    return LOG2(NEXT_POW2(MAX(size, LARGE_MIN_SIZE))) - LOG2(LARGE_MIN_SIZE);
+}
+
+/**
+ * Make the record the owner of the first page of the allocation,
+ * so we can find the record from the pointer
+ */
+static void large_set_owner(large_t* large) {
+    physptr_t phys;
+    ASSERT(!IS_ERROR(vmm_virt_to_phys(large->base, &phys)));
+    pmm_set_owner(PHYS_TO_DIRECT(phys), PAGE_SIZE, large);
+}
+
+static large_t* large_of(void* ptr) {
+    physptr_t phys;
+    ASSERT(!IS_ERROR(vmm_virt_to_phys((uintptr_t)ptr, &phys)), "Tried to use unmapped large allocation %p", ptr);
+    large_t* large = pmm_get_owner(PHYS_TO_DIRECT(phys));
+    ASSERT(large != NULL && large->base == (uintptr_t)ptr, "Tried to use invalid large allocation %p", ptr);
+    return large;
+}
+
+/**
+ * Map pages to the allocation until it is at least the given size, huge pages
+ * are only used while everything before them is huge pages, so they are
+ * always a prefix of the allocation.
+ *
+ * @returns false if we ran out of memory, everything mapped up to then stays mapped
+ */
+static bool large_populate(large_t* large, size_t size, bool zero) {
+    directptr_t pages[LARGE_MAP_BATCH];
+
+    while (large->size < size) {
+        uintptr_t virt = large->base + large->size;
+
+        // try to use a huge page
+        if (
+            large->size == large->huge_count * SIZE_2MB &&
+            size - large->size >= SIZE_2MB &&
+            (virt & (SIZE_2MB - 1)) == 0
+        ) {
+            directptr_t huge = palloc_node(large->node, SIZE_2MB);
+            if (huge != NULL) {
+                if (zero) {
+                    memset(huge, 0, SIZE_2MB);
+                }
+
+                if (IS_ERROR(vmm_map(virt, DIRECT_TO_PHYS(huge), SIZE_TO_PAGES(SIZE_2MB), MAP_WRITE))) {
+                    pfree(huge, SIZE_2MB);
+                    return false;
+                }
+
+                __atomic_fetch_add(&g_large_huge_pages, 1, __ATOMIC_RELAXED);
+                large->huge_count++;
+                large->size += SIZE_2MB;
+                continue;
+            }
+        }
+
+        size_t want = MIN(SIZE_TO_PAGES(size - large->size), LARGE_MAP_BATCH);
+        size_t got = palloc_bulk_movable_node(large->node, want, pages);
+        if (zero) {
+            for (size_t i = 0; i < got; i++) {
+                memset(pages[i], 0, PAGE_SIZE);
+            }
+        }
+
+        if (got == 0 || IS_ERROR(vmm_map_pages(virt, pages, got, MAP_WRITE))) {
+            pfree_bulk(got, pages);
+            return false;
+        }
+
+        large->size += PAGES_TO_SIZE(got);
+    }
+
+    return true;
+}
+
+/**
+ * Unmap everything past the given size and give it back to the pmm, huge
+ * pages are only released if the whole huge page is past the size
+ */
+static void large_release(large_t* large, size_t size) {
+    // another cpu might still reach the pages through its tlb, so until every
+    // cpu gets shootdowns the allocation keeps them, a reused slot starts with them
+    if (!vmm_shootdowns_ready()) {
+        return;
+    }
+
+    size_t huge_end = large->huge_count * SIZE_2MB;
+
+    // the small pages after the huge pages
+    size_t start = MAX(size, huge_end);
+    if (large->size > start) {
+        vmm_release(large->base + start, SIZE_TO_PAGES(large->size - start));
+        large->size = start;
+    }
+
+    // and the huge pages
+    while (large->huge_count > 0 && (large->huge_count - 1) * SIZE_2MB >= size) {
+        uintptr_t virt = large->base + (large->huge_count - 1) * SIZE_2MB;
+        physptr_t phys;
+        ASSERT(!IS_ERROR(vmm_virt_to_phys(virt, &phys)));
+        ASSERT(!IS_ERROR(vmm_unmap(virt, SIZE_TO_PAGES(SIZE_2MB))));
+        pfree(PHYS_TO_DIRECT(phys), SIZE_2MB);
+
+        __atomic_fetch_sub(&g_large_huge_pages, 1, __ATOMIC_RELAXED);
+        large->huge_count--;
+        large->size = large->huge_count * SIZE_2MB;
+    }
+}
+
+/**
+ * Get a free slot of the class, either a freed one or a new one
+ */
+static large_t* class_get_slot(size_t class) {
+    large_class_t* lc = &g_large_classes[class];
+    large_t* large = NULL;
+
+    acquire_lock(&lc->lock);
+
+    if (lc->free_slots != NULL) {
+        large = lc->free_slots;
+        lc->free_slots = large->next;
+    } else if (lc->slot_count < LARGE_CLASS_RANGE / class_slot_size(class)) {
+        large = kmem_cache_alloc(g_large_cache);
+        if (large != NULL) {
+            large->base = class_base(class) + lc->slot_count * class_slot_size(class);
+            large->class = class;
+            large->size = 0;
+            large->huge_count = 0;
+            lc->slot_count++;
+        }
+    } else {
+        WARN("Out of large slots of %lu KB", class_slot_size(class) / SIZE_1KB);
+    }
+
+    if (large != NULL) {
+        large->next = NULL;
+        lc->allocs++;
+        lc->in_use++;
+    }
+
+    release_lock(&lc->lock);
+
+    return large;
+}
+
+static void class_put_slot(large_t* large) {
+    large_class_t* lc = &g_large_classes[large->class];
+
+    acquire_lock(&lc->lock);
+    large->next = lc->free_slots;
+    lc->free_slots = large;
+    lc->frees++;
+    lc->in_use--;
+    release_lock(&lc->lock);
+}
+
+void* large_alloc(size_t size, bool zero) {
+    return large_alloc_node(numa_current_node(), size, zero);
+}
+
+void* large_alloc_node(int node, size_t size, bool zero) {
+    if (size > LARGE_MAX_SIZE) {
+        WARN("Tried to allocate %lu bytes, too big", size);
+        return NULL;
+    }
+
+    large_t* large = class_get_slot(size_to_class(size));
+    if (large == NULL) {
+        return NULL;
+    }
+    large->node = node;
+
+    // pages the slot kept from its last allocation
+    if (zero && large->size != 0) {
+        memset((void*)large->base, 0, MIN(large->size, ALIGN_UP(size, PAGE_SIZE)));
+    }
+
+    if (!large_populate(large, ALIGN_UP(size, PAGE_SIZE), zero)) {
+        large_release(large, 0);
+        class_put_slot(large);
+        return NULL;
+    }
+
+    large_set_owner(large);
+    return (void*)large->base;
+}
+
+/**
+ * Move the pages of the allocation to the slot of another record,
+ * the record of the allocation is then the new one
+ */
+static bool large_move_pages(large_t* from, large_t* to) {
+    if (IS_ERROR(vmm_move(from->base, to->base, SIZE_TO_PAGES(from->size)))) {
+        return false;
+    }
+
+    // slots are aligned to their size so huge pages stay aligned
+    to->size = from->size;
+    to->huge_count = from->huge_count;
+    to->node = from->node;
+    from->size = 0;
+    from->huge_count = 0;
+    large_set_owner(to);
+    return true;
+}
+
+void* large_realloc(void* ptr, size_t size) {
+    large_t* large = large_of(ptr);
+    size_t old_size = large->size;
+    size = ALIGN_UP(MAX(size, PAGE_SIZE), PAGE_SIZE);
+
+    if (size > LARGE_MAX_SIZE) {
+        WARN("Tried to allocate %lu bytes, too big", size);
+        return NULL;
+    }
+
+    // shrinking is always done in place
+    if (size <= old_size) {
+        large_release(large, size);
+        __atomic_fetch_add(&g_large_resizes, 1, __ATOMIC_RELAXED);
+        return ptr;
+    }
+
+    // fits in the slot, just map the rest
+    if (size <= class_slot_size(large->class)) {
+        if (!large_populate(large, size, false)) {
+            large_release(large, old_size);
+            return NULL;
+        }
+
+        __atomic_fetch_add(&g_large_resizes, 1, __ATOMIC_RELAXED);
+        return ptr;
+    }
+
+    // the old slot stays in the tlb of cpus that don't get shootdowns
+    // yet, so until then the allocation is copied instead
+    if (!vmm_shootdowns_ready()) {
+        void* new_ptr = large_alloc_node(large->node, size, false);
+        if (new_ptr == NULL) {
+            return NULL;
+        }
+        memcpy(new_ptr, ptr, old_size);
+        large_free(ptr);
+        return new_ptr;
+    }
+
+    // move the pages we have to a slot that fits instead of
+    // copying them, and map the rest there
+    large_t* new_large = class_get_slot(size_to_class(size));
+    if (new_large == NULL) {
+        return NULL;
+    }
+
+    if (!large_move_pages(large, new_large)) {
+        class_put_slot(new_large);
+        return NULL;
+    }
+
+    if (!large_populate(new_large, size, false)) {
+        // move it back, the page tables of the old slot are
+        // still there so this can't fail
+        large_release(new_large, old_size);
+        ASSERT(large_move_pages(new_large, large));
+        class_put_slot(new_large);
+        return NULL;
+    }
+
+    class_put_slot(large);
+    __atomic_fetch_add(&g_large_moves, 1, __ATOMIC_RELAXED);
+    return (void*)new_large->base;
+}
+
+void large_free(void* ptr) {
+    large_t* large = large_of(ptr);
+    large_release(large, 0);
+    class_put_slot(large);
+}
+
+size_t large_usable_size(void* ptr) {
+    return large_of(ptr)->size;
+}
+
+void large_dump_stats() {
+    TRACE("Large allocation stats: %lu huge pages, %lu resizes in place, %lu moved without copying",
+          g_large_huge_pages, g_large_resizes, g_large_moves);
+    for (size_t i = 0; i < LARGE_CLASS_COUNT; i++) {
+        large_class_t* lc = &g_large_classes[i];
+        if (lc->allocs == 0) {
+            continue;
+        }
+
+        TRACE("\t%lu KB slots: %lu in use, %lu slots, %lu allocs, %lu frees",
+              class_slot_size(i) / SIZE_1KB, lc->in_use, lc->slot_count, lc->allocs, lc->frees);
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef TOMATOS_LARGE_H
+#define TOMATOS_LARGE_H
+
+#include <util/except.h>
+#include <util/defs.h>
+#include "mm.h"
+
+/**
+ * Allocations of this size and up get their own pages instead of
+ * being carved out of the tlsf heap
+ */
+#define LARGE_MIN_SIZE SIZE_128KB
+
+/**
+ * Create the cache for the large allocation records
+ *
+ * @remark
+ * Must be called after init_slab and init_vmm
+ */
+err_t init_large();
+
+/**
+ * Allocate a new large allocation, the size is rounded up to whole pages
+ *
+ * @param size  [IN] The size, at least LARGE_MIN_SIZE
+ * @param zero  [IN] Should the memory be zeroed
+ */
+void* large_alloc(size_t size, bool zero);
+
+/**
+ * Like large_alloc, but the pages are taken from the given numa node, and
+ * stay on it when the allocation grows
+ */
+void* large_alloc_node(int node, size_t size, bool zero);
+
+/**
+ * Resize a large allocation, new memory is not zeroed. The allocation grows in
+ * place while it fits in its slot, otherwise its pages are remapped to a bigger
+ * slot so the memory is never copied.
+ *
+ * @returns The new address, NULL if out of memory (the allocation is kept as it was)
+ */
+void* large_realloc(void* ptr, size_t size);
+
+/**
+ * Unmap the allocation and give its pages back to the pmm
+ */
+void large_free(void* ptr);
+
+/**
+ * Get the usable size of a large allocation
+ */
+size_t large_usable_size(void* ptr);
+
+/**
+ * Large allocations have their own range, so the address is
+ * enough to tell who owns an allocation
+ */
+static inline bool is_large_object(void* ptr) {
+    return (uintptr_t)ptr >= KERNEL_LARGE_START && (uintptr_t)ptr < KERNEL_LARGE_END;
+}
+
+/**
+ * Trace the usage of every slot size
+ */
+void large_dump_stats();
+
+#endif //TOMATOS_LARGE_H
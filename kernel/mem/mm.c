@@ -1,43 +1,587 @@
 #include <util/except.h>
 #include <util/string.h>
+#include <arch/cpu.h>
+#include <cont/list.h>
+#include "alloc_trace.h"
+#include "heap_prof.h"
+#include "large.h"
 #include "mm.h"
+#include "numa.h"
 #include "pmm.h"
+#include "slab.h"
 #include "tlsf.h"
+#include "vmm.h"
 
 /**
- * The memory manager lock
+ * The heap is split into arenas, each with its own tlsf, its own lock and its
+ * own part of the heap range. Cpus allocate from the arena they are assigned
+ * to, and frees go back to the arena that owns the address, so cpus only contend
+ * with each other when freeing memory allocated on another arena.
+ *
+ * The arenas are split between the numa nodes, arena i takes its pages from
+ * node i modulo the node count, and cpus use the arenas of their own node.
+ *
+ * The count can be overridden (MM_ARENA_COUNT=1 gives the old single heap)
  */
-static lock_t g_mm_lock = INIT_LOCK(TPL_HIGH_LEVEL);
+#ifndef MM_ARENA_COUNT
+#define MM_ARENA_COUNT 8
+#endif
+#define MM_ARENA_SIZE ((KERNEL_HEAP_END - KERNEL_HEAP_START) / MM_ARENA_COUNT)
 
 /**
- * The TLSF instance for the vmm
+ * An arena is only trimmed once this much memory was freed to it since the
+ * last trim, or once the memory past the end of the arena is this big, so
+ * short bursts of allocations don't keep faulting pages in and out
  */
-static tlsf g_tlsf = TLSF_INIT;
+#define MM_TRIM_THRESHOLD SIZE_1MB
+
+/**
+ * Only free blocks at least this big have their pages released
+ */
+#define MM_TRIM_MIN_BLOCK (SIZE_4KB * 16)
+
+/**
+ * When an arena grows the new range is mapped right away instead of taking
+ * a fault for every page, growths bigger than this only populate the start
+ * and leave the rest to be faulted in on demand
+ */
+#define MM_POPULATE_MAX (SIZE_1MB * 16)
+
+/**
+ * How many pages are allocated and mapped at once when populating
+ */
+#define MM_POPULATE_BATCH 64
+
+typedef struct mm_arena {
+    /**
+     * The TLSF instance of the arena
+     */
+    tlsf tlsf;
+
+    /**
+     * Protects the tlsf and the stats
+     */
+    lock_t lock;
+
+    /**
+     * How many times the lock was taken, and how many of
+     * those had to wait for another cpu
+     */
+    size_t acquisitions;
+    size_t contended;
+
+    /**
+     * Frees of memory that was not allocated by a cpu of this arena
+     */
+    size_t remote_frees;
+
+    /**
+     * Bytes freed since the last trim, and the amount of
+     * pages given back to the pmm by all the trims
+     */
+    size_t freed_since_trim;
+    size_t trims;
+    size_t released_pages;
+
+    /**
+     * Everything from the start of the arena up to here was populated (or
+     * left to be faulted in), and everything after it is not mapped
+     */
+    size_t populated;
+    size_t populated_pages;
+} __attribute__((aligned(64))) mm_arena_t;
+
+static mm_arena_t g_arenas[MM_ARENA_COUNT] = {
+    [0 ... MM_ARENA_COUNT - 1] = {
+        .tlsf = TLSF_INIT,
+        .lock = INIT_LOCK(TPL_HIGH_LEVEL),
+    }
+};
+
+static uintptr_t arena_base(mm_arena_t* arena) {
+    return KERNEL_HEAP_START + (arena - g_arenas) * MM_ARENA_SIZE;
+}
+
+static mm_arena_t* arena_of(void* ptr) {
+    return &g_arenas[((uintptr_t)ptr - KERNEL_HEAP_START) / MM_ARENA_SIZE];
+}
+
+static int arena_node(mm_arena_t* arena) {
+    return (arena - g_arenas) % numa_node_count();
+}
+
+/**
+ * Pick one of the arenas of the node
+ */
+static mm_arena_t* node_arena(int node, size_t index) {
+    size_t node_count = numa_node_count();
+
+    // not enough arenas for every node to have its own
+    if (node >= MM_ARENA_COUNT) {
+        return &g_arenas[index % MM_ARENA_COUNT];
+    }
+
+    size_t arena_count = (MM_ARENA_COUNT - node + node_count - 1) / node_count;
+    return &g_arenas[node + (index % arena_count) * node_count];
+}
+
+static mm_arena_t* current_arena() {
+    return node_arena(numa_current_node(), g_cpu_id);
+}
+
+static void arena_lock(mm_arena_t* arena) {
+    if (!acquire_lock_or_fail(&arena->lock)) {
+        acquire_lock(&arena->lock);
+        arena->contended++;
+    }
+    arena->acquisitions++;
+}
+
+static void arena_unlock(mm_arena_t* arena) {
+    release_lock(&arena->lock);
+}
+
+/**
+ * Map zeroed pages to the given range of the arena, stops quietly if we
+ * run out of memory since the rest can still be faulted in
+ */
+static void arena_populate(mm_arena_t* arena, size_t start, size_t end) {
+    directptr_t pages[MM_POPULATE_BATCH];
+
+    while (start < end) {
+        size_t want = MIN(SIZE_TO_PAGES(end - start), MM_POPULATE_BATCH);
+        size_t got = palloc_bulk_movable_node(arena_node(arena), want, pages);
+        for (size_t i = 0; i < got; i++) {
+            memset(pages[i], 0, PAGE_SIZE);
+        }
+
+        if (got == 0 || IS_ERROR(vmm_map_pages(arena_base(arena) + start, pages, got, MAP_WRITE))) {
+            pfree_bulk(got, pages);
+            break;
+        }
+
+        arena->populated_pages += got;
+        start += PAGES_TO_SIZE(got);
+    }
+}
 
 void* tlsf_resize(tlsf* t, size_t size) {
-    ASSERT(size < (KERNEL_HEAP_END - KERNEL_HEAP_START), "out of heap space");
-    return (void*)KERNEL_HEAP_START;
+    mm_arena_t* arena = CR(t, mm_arena_t, tlsf);
+    if (size > MM_ARENA_SIZE) {
+        WARN("Heap arena #%lu is out of space", arena - g_arenas);
+        return NULL;
+    }
+
+    // map the new range in bulk
+    size_t end = ALIGN_UP(size, PAGE_SIZE);
+    if (end > arena->populated) {
+        arena_populate(arena, arena->populated, MIN(end, arena->populated + MM_POPULATE_MAX));
+        arena->populated = end;
+    }
+
+    return (void*)arena_base(arena);
+}
+
+void tlsf_release(tlsf* t, void* addr, size_t size) {
+    mm_arena_t* arena = CR(t, mm_arena_t, tlsf);
+    arena->released_pages += vmm_release((uintptr_t)addr, SIZE_TO_PAGES(size));
+}
+
+/**
+ * Allocate from the tlsf of the arena, the memory is only
+ * cleared if it is not known to be zero already
+ */
+static void* arena_alloc(mm_arena_t* arena, size_t size, bool zero) {
+    bool is_zero;
+    arena_lock(arena);
+    void* ptr = tlsf_malloc_zero(&arena->tlsf, size, &is_zero);
+    arena_unlock(arena);
+
+    if (ptr != NULL && zero && !is_zero) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+/**
+ * Small allocations come from the slab size classes and never touch the heap
+ * locks, large allocations get their own pages, and everything in between
+ * comes from the tlsf arenas
+ *
+ * @param zero  [IN] Should the memory be zeroed
+ */
+static void* heap_alloc(size_t size, bool zero) {
+    if (size <= SLAB_MAX_SIZE) {
+        void* ptr = slab_alloc(size);
+        if (ptr != NULL && zero) {
+            memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+
+    if (size >= LARGE_MIN_SIZE) {
+        return large_alloc(size, zero);
+    }
+
+    return arena_alloc(current_arena(), size, zero);
+}
+
+/**
+ * Allocate zeroed memory with the given alignment, small sizes still come
+ * from the slab since the objects are aligned up to a cache line
+ */
+static void* heap_alloc_aligned(size_t align, size_t size) {
+    // everything is at least 8 byte aligned
+    if (align <= 8) {
+        return heap_alloc(size, true);
+    }
+
+    size_t aligned_size = ALIGN_UP(MAX(size, 1), align);
+    if (align <= CACHE_LINE_SIZE && aligned_size <= SLAB_MAX_SIZE) {
+        return heap_alloc(aligned_size, true);
+    }
+
+    // the slots are aligned to their size
+    if (size >= LARGE_MIN_SIZE) {
+        return large_alloc(MAX(size, align), true);
+    }
+
+    mm_arena_t* arena = current_arena();
+    arena_lock(arena);
+    void* ptr = tlsf_aalloc(&arena->tlsf, align, aligned_size);
+    arena_unlock(arena);
+
+    if (ptr != NULL) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+/**
+ * Allocate zeroed memory from the node, the slab caches are per-cpu
+ * and not per-node so small sizes come from the arenas as well
+ */
+static void* heap_alloc_node(int node, size_t size) {
+    if (size >= LARGE_MIN_SIZE) {
+        return large_alloc_node(node, size, true);
+    }
+
+    mm_arena_t* arena = node == numa_current_node() ? current_arena() : node_arena(node, g_cpu_id);
+    return arena_alloc(arena, size, true);
+}
+
+/**
+ * The usable size of an allocation of any of the allocators
+ */
+static size_t heap_usable_size(void* ptr) {
+    if (is_slab_object(ptr)) {
+        return slab_object_size(ptr);
+    } else if (is_large_object(ptr)) {
+        return large_usable_size(ptr);
+    } else {
+        return tlsf_usable_size(ptr);
+    }
+}
+
+static void heap_free(void* ptr);
+
+static void* heap_realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return heap_alloc(size, false);
+    }
+
+    if (is_large_object(ptr)) {
+        // stays large, the pages are remapped instead of copied
+        if (size >= LARGE_MIN_SIZE) {
+            return large_realloc(ptr, size);
+        }
+    } else if (!is_slab_object(ptr)) {
+        // stays in the arena it came from, unless it became large
+        if (size < LARGE_MIN_SIZE) {
+            mm_arena_t* arena = arena_of(ptr);
+            arena_lock(arena);
+            ptr = tlsf_realloc(&arena->tlsf, ptr, size);
+            arena_unlock(arena);
+            return ptr;
+        }
+    } else if (size <= slab_object_size(ptr)) {
+        // still fits in the object
+        return ptr;
+    }
+
+    void* new_ptr = heap_alloc(size, false);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, MIN(heap_usable_size(ptr), size));
+    heap_free(ptr);
+    return new_ptr;
+}
+
+static void heap_free(void* ptr) {
+    if (is_slab_object(ptr)) {
+        slab_free(ptr);
+        return;
+    }
+
+    if (is_large_object(ptr)) {
+        large_free(ptr);
+        return;
+    }
+
+    mm_arena_t* arena = arena_of(ptr);
+    arena_lock(arena);
+    if (arena != current_arena()) {
+        arena->remote_frees++;
+    }
+    arena->freed_since_trim += tlsf_usable_size(ptr);
+    tlsf_free(&arena->tlsf, ptr);
+    arena_unlock(arena);
+}
+
+static bool check_alignment(size_t align) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        WARN("Tried to allocate with invalid alignment %lu", align);
+        return false;
+    }
+    return true;
+}
+
+static bool check_node(int node) {
+    if (node < 0 || node >= numa_node_count()) {
+        WARN("Tried to allocate from invalid numa node %d", node);
+        return false;
+    }
+    return true;
+}
+
+#ifdef __TOMATOS_HEAP_PROFILER__
+
+/**
+ * With the profiler every allocation has a header before it, the call
+ * site is taken here so it is the caller of the kalloc function
+ */
+static void* prof_alloc(size_t size, bool zero, void* site) {
+    void* base = heap_alloc(size + HEAP_PROF_HEADER_SIZE, zero);
+    if (base == NULL) {
+        return NULL;
+    }
+    return heap_prof_track(base, HEAP_PROF_HEADER_SIZE, size, site);
 }
 
 void* kalloc(size_t size) {
-    acquire_lock(&g_mm_lock);
-    void* ptr = tlsf_malloc(&g_tlsf, size);
-    release_lock(&g_mm_lock);
-    memset(ptr, 0, size);
+    void* ptr = prof_alloc(size, true, __builtin_return_address(0));
+    ALLOC_TRACE(ALLOC_TRACE_KALLOC, ptr, NULL, size);
+    return ptr;
+}
+
+void* kalloc_uninit(size_t size) {
+    void* ptr = prof_alloc(size, false, __builtin_return_address(0));
+    ALLOC_TRACE(ALLOC_TRACE_KALLOC, ptr, NULL, size);
     return ptr;
 }
 
 void* krealloc(void* ptr, size_t size) {
-    acquire_lock(&g_mm_lock);
-    ptr = tlsf_realloc(&g_tlsf, ptr, size);
-    release_lock(&g_mm_lock);
+    if (ptr == NULL) {
+        void* new_ptr = prof_alloc(size, false, __builtin_return_address(0));
+        ALLOC_TRACE(ALLOC_TRACE_KREALLOC, new_ptr, NULL, size);
+        return new_ptr;
+    }
+
+    // the memory might move, so we can't keep it in the live list
+    size_t old_size;
+    void* base = heap_prof_untrack(ptr, &old_size, NULL);
+    size_t offset = (uint8_t*)ptr - (uint8_t*)base;
+
+    void* new_base;
+    if (offset == HEAP_PROF_HEADER_SIZE) {
+        new_base = heap_realloc(base, size + HEAP_PROF_HEADER_SIZE);
+    } else {
+        // the header of an aligned allocation is padded, so move
+        // the memory to a normal allocation ourselves
+        new_base = heap_alloc(size + HEAP_PROF_HEADER_SIZE, false);
+        if (new_base != NULL) {
+            memcpy((uint8_t*)new_base + HEAP_PROF_HEADER_SIZE, ptr, MIN(old_size, size));
+            heap_free(base);
+        }
+    }
+
+    // the old allocation is still there, put it back as it was
+    if (new_base == NULL) {
+        heap_prof_restore(ptr);
+        return NULL;
+    }
+
+    void* new_ptr = heap_prof_track(new_base, HEAP_PROF_HEADER_SIZE, size, __builtin_return_address(0));
+    ALLOC_TRACE(ALLOC_TRACE_KREALLOC, new_ptr, ptr, size);
+    return new_ptr;
+}
+
+void* kalloc_aligned(size_t align, size_t size) {
+    if (!check_alignment(align)) {
+        return NULL;
+    }
+
+    // pad the header so the memory after it is aligned as well
+    align = MAX(align, 8);
+    size_t offset = ALIGN_UP(HEAP_PROF_HEADER_SIZE, align);
+    void* base = heap_alloc_aligned(align, size + offset);
+    if (base == NULL) {
+        return NULL;
+    }
+
+    void* ptr = heap_prof_track(base, offset, size, __builtin_return_address(0));
+    ALLOC_TRACE(ALLOC_TRACE_KALLOC, ptr, NULL, size);
+    return ptr;
+}
+
+void* kalloc_node(int node, size_t size) {
+    if (!check_node(node)) {
+        return NULL;
+    }
+
+    void* base = heap_alloc_node(node, size + HEAP_PROF_HEADER_SIZE);
+    if (base == NULL) {
+        return NULL;
+    }
+
+    void* ptr = heap_prof_track(base, HEAP_PROF_HEADER_SIZE, size, __builtin_return_address(0));
+    ALLOC_TRACE(ALLOC_TRACE_KALLOC, ptr, NULL, size);
     return ptr;
 }
 
 void kfree(void* ptr) {
-    acquire_lock(&g_mm_lock);
-    tlsf_free(&g_tlsf, ptr);
-    release_lock(&g_mm_lock);
+    if (ptr == NULL) {
+        return;
+    }
+    ALLOC_TRACE(ALLOC_TRACE_KFREE, ptr, NULL, 0);
+    heap_free(heap_prof_untrack(ptr, NULL, NULL));
+}
+
+#else
+
+void* kalloc(size_t size) {
+    void* ptr = heap_alloc(size, true);
+    ALLOC_TRACE(ALLOC_TRACE_KALLOC, ptr, NULL, size);
+    return ptr;
+}
+
+void* kalloc_uninit(size_t size) {
+    void* ptr = heap_alloc(size, false);
+    ALLOC_TRACE(ALLOC_TRACE_KALLOC, ptr, NULL, size);
+    return ptr;
+}
+
+void* krealloc(void* ptr, size_t size) {
+    void* new_ptr = heap_realloc(ptr, size);
+    ALLOC_TRACE(ALLOC_TRACE_KREALLOC, new_ptr, ptr, size);
+    return new_ptr;
+}
+
+void* kalloc_aligned(size_t align, size_t size) {
+    if (!check_alignment(align)) {
+        return NULL;
+    }
+
+    void* ptr = heap_alloc_aligned(align, size);
+    ALLOC_TRACE(ALLOC_TRACE_KALLOC, ptr, NULL, size);
+    return ptr;
+}
+
+void* kalloc_node(int node, size_t size) {
+    if (!check_node(node)) {
+        return NULL;
+    }
+
+    void* ptr = heap_alloc_node(node, size);
+    ALLOC_TRACE(ALLOC_TRACE_KALLOC, ptr, NULL, size);
+    return ptr;
+}
+
+void kfree(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    ALLOC_TRACE(ALLOC_TRACE_KFREE, ptr, NULL, 0);
+    heap_free(ptr);
+}
+
+#endif
+
+/**
+ * Release the memory past the end of the arena, the arena already shrunk
+ * so nothing in there is used
+ */
+static void arena_trim_tail(mm_arena_t* arena) {
+    tlsf* t = &arena->tlsf;
+    uintptr_t base = arena_base(arena);
+    size_t start = ALIGN_UP(t->size, PAGE_SIZE);
+    if (t->high_water <= start) {
+        return;
+    }
+
+    // clear the rest of the last page so everything past the end
+    // is zero again, and the arena can grow into known zero memory
+    memset((void*)(base + t->size), 0, start - t->size);
+    tlsf_release(t, (void*)(base + start), t->high_water - start);
+    t->high_water = t->size;
+    arena->populated = MIN(arena->populated, start);
+}
+
+bool kheap_trim() {
+    bool did_work = false;
+
+    // the released pages could still be reached through the tlb of
+    // a cpu that does not get shootdowns yet
+    if (!vmm_shootdowns_ready()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < MM_ARENA_COUNT; i++) {
+        mm_arena_t* arena = &g_arenas[i];
+
+        // racy check, so idle cpus don't take the lock for nothing
+        if (arena->freed_since_trim < MM_TRIM_THRESHOLD &&
+            arena->tlsf.high_water - arena->tlsf.size < MM_TRIM_THRESHOLD) {
+            continue;
+        }
+
+        // don't wait for arenas that are in use, we will get them next time
+        if (!acquire_lock_or_fail(&arena->lock)) {
+            continue;
+        }
+
+        tlsf_trim(&arena->tlsf, MM_TRIM_MIN_BLOCK, PAGE_SIZE);
+        arena_trim_tail(arena);
+        arena->freed_since_trim = 0;
+        arena->trims++;
+
+        release_lock(&arena->lock);
+        did_work = true;
+    }
+
+    return did_work;
+}
+
+int kheap_node_of(uintptr_t addr) {
+    return arena_node(arena_of((void*)addr));
+}
+
+void mm_dump_stats() {
+    TRACE("Heap arena stats:");
+    for (size_t i = 0; i < MM_ARENA_COUNT; i++) {
+        mm_arena_t* arena = &g_arenas[i];
+        if (arena->acquisitions == 0) {
+            continue;
+        }
+
+        TRACE("\tArena #%lu: %lu KB (peak %lu KB), %lu lock acquisitions, %lu contended (%lu%%), "
+              "%lu remote frees, %lu trims released %lu KB, populated %lu KB",
+              i, arena->tlsf.size / SIZE_1KB, arena->tlsf.high_water / SIZE_1KB,
+              arena->acquisitions, arena->contended, arena->contended * 100 / arena->acquisitions,
+              arena->remote_frees, arena->trims, arena->released_pages * PAGE_SIZE / SIZE_1KB,
+              arena->populated_pages * PAGE_SIZE / SIZE_1KB);
+    }
 }
 
 directptr_t early_alloc(size_t page_count) {
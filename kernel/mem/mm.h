@@ -11,6 +11,7 @@
  * Page size
  */
 #define PAGE_SIZE               (SIZE_4KB)
+#define PAGE_SHIFT              (12)
 #define PAGES_TO_SIZE(x)        ((x) * PAGE_SIZE)
 #define SIZE_TO_PAGES(x)        (ALIGN_UP(x, PAGE_SIZE) / PAGE_SIZE)
 
@@ -20,11 +21,14 @@
 #define KERNEL_BASE             (0xffffffff80000000ull)
 
 /**
- * The direct memory base and end (64TB)
+ * The direct memory base and end (64TB), the base can be overridden
+ * so the host benchmarks can place the "physical memory" in user space
  */
 #define MAX_PHYS_MEMORY_SIZE    (SIZE_64TB)
+#ifndef DIRECT_BASE
 #define DIRECT_BASE             (0xFFFF800000000000ull)
-#define DIRECT_END              (0xFFFF800000000000ull + MAX_PHYS_MEMORY_SIZE)
+#endif
+#define DIRECT_END              (DIRECT_BASE + MAX_PHYS_MEMORY_SIZE)
 
 /**
  * The kernel heap ranges (has 32TB)
@@ -33,6 +37,13 @@
 #define KERNEL_HEAP_START       (DIRECT_END + SIZE_1GB)
 #define KERNEL_HEAP_END         (KERNEL_HEAP_START + SIZE_32TB)
 
+/**
+ * The range of the large allocations (has 16TB), aligned to 512GB
+ * so every slot can be naturally aligned to its size
+ */
+#define KERNEL_LARGE_START      (DIRECT_END + SIZE_32TB + SIZE_512GB)
+#define KERNEL_LARGE_END        (KERNEL_LARGE_START + SIZE_16TB)
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Direct Map
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -52,20 +63,69 @@ typedef uint64_t physptr_t;
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
- * TODO: This
+ * Allocate zeroed memory from the kernel heap, small allocations are served
+ * from the per-cpu slab caches, huge ones get their own pages straight from
+ * the pmm and everything in between comes from the tlsf heap
  */
 void* kalloc(size_t size);
 
 /**
- * TODO: This
+ * Like kalloc, but the memory is not zeroed, for callers that
+ * are going to overwrite all of it anyway
+ */
+void* kalloc_uninit(size_t size);
+
+/**
+ * Allocate zeroed memory aligned to the given power of two
+ */
+void* kalloc_aligned(size_t align, size_t size);
+
+/**
+ * Allocate zeroed memory from the given numa node, if the node is out of
+ * memory the closest nodes are used instead
+ */
+void* kalloc_node(int node, size_t size);
+
+/**
+ * Allocate zeroed memory that starts on a cache line and takes whole cache
+ * lines, for memory that different cpus write to, like locks and per-cpu
+ * stats, so it never shares a cache line with anything else
+ */
+static inline void* kalloc_cacheline(size_t size) {
+    return kalloc_aligned(CACHE_LINE_SIZE, ALIGN_UP(size, CACHE_LINE_SIZE));
+}
+
+/**
+ * Resize an allocation, the new memory is not zeroed, the alignment
+ * of kalloc_aligned is not kept
  */
 void* krealloc(void* ptr, size_t size);
 
 /**
- * TODO: This
+ * Free an allocation, works for slab, tlsf and large allocations
  */
 void kfree(void* ptr);
 
+/**
+ * Give the pages behind large free blocks and behind the shrunk end of
+ * the heap arenas back to the pmm, should be called by cpus that have
+ * nothing better to do
+ *
+ * @returns true if any work was done
+ */
+bool kheap_trim();
+
+/**
+ * Get the numa node the memory of the heap at the given address
+ * should come from, that is the node of the arena it is in
+ */
+int kheap_node_of(uintptr_t addr);
+
+/**
+ * Trace the size and the lock contention of each of the heap arenas
+ */
+void mm_dump_stats();
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Early allocators
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
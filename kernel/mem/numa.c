@@ -0,0 +1,222 @@
+#include <acpi/acpi.h>
+#include <arch/cpu.h>
+#include "numa.h"
+
+/**
+ * The max amount of memory affinity ranges we keep
+ */
+#define NUMA_MAX_MEMORY_RANGES 64
+
+typedef struct numa_memory_range {
+    physptr_t base;
+    size_t length;
+    int node;
+} numa_memory_range_t;
+
+/**
+ * The memory ranges from the SRAT
+ */
+static numa_memory_range_t g_memory_ranges[NUMA_MAX_MEMORY_RANGES];
+static int g_memory_range_count = 0;
+
+/**
+ * The amount of nodes, and the proximity domain of each of them
+ */
+static int g_node_count = 1;
+static uint32_t g_node_domains[NUMA_MAX_NODES] = { 0 };
+
+/**
+ * The node of each of the lapic ids
+ */
+static uint8_t g_lapic_nodes[256] = { 0 };
+
+/**
+ * The distances between the nodes, and the nodes of each node sorted
+ * by their distance
+ */
+static uint8_t g_distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static uint8_t g_fallback_order[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+/**
+ * Get the node of the given proximity domain, allocating
+ * a new node if this is a new domain
+ */
+static int domain_to_node(uint32_t domain) {
+    for (int i = 0; i < g_node_count; i++) {
+        if (g_node_domains[i] == domain) {
+            return i;
+        }
+    }
+
+    if (g_node_count == NUMA_MAX_NODES) {
+        WARN("Too many numa nodes, putting proximity domain %d on node 0", domain);
+        return 0;
+    }
+
+    g_node_domains[g_node_count] = domain;
+    return g_node_count++;
+}
+
+static void parse_srat(acpi_srat_t* srat) {
+    // the first node we find should be node 0
+    g_node_count = 0;
+
+    size_t offset = 0;
+    size_t entries_size = srat->header.length - sizeof(acpi_srat_t);
+    while (offset < entries_size) {
+        acpi_srat_entry_t* entry = (acpi_srat_entry_t*)&srat->entries[offset];
+        if (entry->length == 0) {
+            break;
+        }
+        offset += entry->length;
+
+        switch (entry->type) {
+            case ACPI_SRAT_PROCESSOR_LAPIC_AFFINITY: {
+                acpi_srat_lapic_affinity_t* lapic = (acpi_srat_lapic_affinity_t*)entry;
+                if (!(lapic->flags & ACPI_SRAT_ENABLED)) {
+                    break;
+                }
+
+                uint32_t domain = lapic->proximity_domain_low;
+                domain |= lapic->proximity_domain_high[0] << 8;
+                domain |= lapic->proximity_domain_high[1] << 16;
+                domain |= lapic->proximity_domain_high[2] << 24;
+                g_lapic_nodes[lapic->apic_id] = domain_to_node(domain);
+            } break;
+
+            case ACPI_SRAT_PROCESSOR_X2APIC_AFFINITY: {
+                acpi_srat_x2apic_affinity_t* x2apic = (acpi_srat_x2apic_affinity_t*)entry;
+                if (!(x2apic->flags & ACPI_SRAT_ENABLED)) {
+                    break;
+                }
+
+                // we only support xapic ids for now
+                if (x2apic->x2apic_id < ARRAY_LEN(g_lapic_nodes)) {
+                    g_lapic_nodes[x2apic->x2apic_id] = domain_to_node(x2apic->proximity_domain);
+                }
+            } break;
+
+            case ACPI_SRAT_MEMORY_AFFINITY: {
+                acpi_srat_memory_affinity_t* memory = (acpi_srat_memory_affinity_t*)entry;
+                if (!(memory->flags & ACPI_SRAT_ENABLED) || memory->length == 0) {
+                    break;
+                }
+
+                if (g_memory_range_count == NUMA_MAX_MEMORY_RANGES) {
+                    WARN("Too many numa memory ranges, ignoring %p-%p", memory->base, memory->base + memory->length);
+                    break;
+                }
+
+                numa_memory_range_t* range = &g_memory_ranges[g_memory_range_count++];
+                range->base = memory->base;
+                range->length = memory->length;
+                range->node = domain_to_node(memory->proximity_domain);
+            } break;
+
+            default:
+                break;
+        }
+    }
+
+    // no usable entries, just ignore the table
+    if (g_node_count == 0) {
+        g_node_count = 1;
+    }
+}
+
+static void parse_slit(acpi_slit_t* slit) {
+    for (int from = 0; from < g_node_count; from++) {
+        for (int to = 0; to < g_node_count; to++) {
+            uint32_t from_domain = g_node_domains[from];
+            uint32_t to_domain = g_node_domains[to];
+            if (from_domain < slit->locality_count && to_domain < slit->locality_count) {
+                g_distances[from][to] = slit->entries[from_domain * slit->locality_count + to_domain];
+            }
+        }
+    }
+}
+
+err_t init_numa() {
+    err_t err = NO_ERROR;
+
+    // defaults for when there is no SLIT
+    for (int from = 0; from < NUMA_MAX_NODES; from++) {
+        for (int to = 0; to < NUMA_MAX_NODES; to++) {
+            g_distances[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    acpi_srat_t* srat = acpi_get_table(ACPI_SRAT_SIGNATURE);
+    if (srat != NULL) {
+        parse_srat(srat);
+
+        acpi_slit_t* slit = acpi_get_table(ACPI_SLIT_SIGNATURE);
+        if (slit != NULL) {
+            parse_slit(slit);
+        }
+    }
+
+    // sort the nodes of each node by the distance to it, we
+    // don't have a lot of nodes so insertion sort is fine
+    for (int node = 0; node < g_node_count; node++) {
+        uint8_t* order = g_fallback_order[node];
+        for (int i = 0; i < g_node_count; i++) {
+            int j = i;
+            while (j > 0 && g_distances[node][order[j - 1]] > g_distances[node][i]) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
+        }
+    }
+
+    TRACE("NUMA: %d nodes", g_node_count);
+    for (int i = 0; i < g_memory_range_count; i++) {
+        numa_memory_range_t* range = &g_memory_ranges[i];
+        TRACE("\t%016p-%016p: node #%d", range->base, range->base + range->length, range->node);
+    }
+
+cleanup:
+    return err;
+}
+
+int numa_node_count() {
+    return g_node_count;
+}
+
+int numa_current_node() {
+    if (g_lapic_id >= ARRAY_LEN(g_lapic_nodes)) {
+        return 0;
+    }
+    return g_lapic_nodes[g_lapic_id];
+}
+
+int numa_distance(int from, int to) {
+    return g_distances[from][to];
+}
+
+const uint8_t* numa_fallback_order(int node) {
+    return g_fallback_order[node];
+}
+
+int numa_node_of_range(physptr_t base, size_t* size) {
+    int node = 0;
+    physptr_t end = base + *size;
+
+    for (int i = 0; i < g_memory_range_count; i++) {
+        numa_memory_range_t* range = &g_memory_ranges[i];
+        physptr_t range_end = range->base + range->length;
+
+        if (range->base <= base && base < range_end) {
+            // the base is inside this range, trim to the end of it
+            node = range->node;
+            end = MIN(end, range_end);
+        } else if (base < range->base) {
+            // the base is not inside of a range, trim until the next range
+            end = MIN(end, range->base);
+        }
+    }
+
+    *size = end - base;
+    return node;
+}
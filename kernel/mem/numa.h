@@ -0,0 +1,62 @@
+#ifndef TOMATOS_NUMA_H
+#define TOMATOS_NUMA_H
+
+#include <util/except.h>
+#include <util/defs.h>
+#include "mm.h"
+
+/**
+ * The max amount of numa nodes we support
+ */
+#define NUMA_MAX_NODES 16
+
+/**
+ * The distance reported between a node and itself, and between
+ * two nodes when there is no SLIT
+ */
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+/**
+ * Parse the SRAT and SLIT, if they are not available then everything
+ * is going to be on node 0.
+ *
+ * @remark
+ * Must be called after init_acpi and before init_pmm, everything we need
+ * is copied out of the tables.
+ */
+err_t init_numa();
+
+/**
+ * The amount of numa nodes in the system, always at least 1
+ */
+int numa_node_count();
+
+/**
+ * Get the numa node of the current cpu
+ */
+int numa_current_node();
+
+/**
+ * Get the distance between two nodes, as reported by the SLIT
+ */
+int numa_distance(int from, int to);
+
+/**
+ * Get the nodes sorted by their distance from the given node, the
+ * first entry is always the node itself.
+ *
+ * @param node  [IN] The node to get the fallback order of
+ */
+const uint8_t* numa_fallback_order(int node);
+
+/**
+ * Get the node that owns the given address, and trim the size so the
+ * range only covers memory of that node.
+ *
+ * @param base  [IN]        The base of the range
+ * @param size  [IN/OUT]    The size of the range, trimmed to the end of the node range
+ */
+int numa_node_of_range(physptr_t base, size_t* size);
+
+#endif //TOMATOS_NUMA_H
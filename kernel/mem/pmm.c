@@ -1,6 +1,10 @@
 #include <util/except.h>
+#include <arch/intrin.h>
+#include <arch/tsc.h>
 #include <cont/list.h>
 #include <util/string.h>
+#include "alloc_trace.h"
+#include "numa.h"
 #include "pmm.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -8,206 +12,1434 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
- * The min order needs to fit a single pointer
- * for our linked list, meaning the min is 3
+ * The max order supported by the buddies, in pages
  */
-#define MIN_ORDER 3
+#define MAX_ORDER 32
 
-#define NEXT(ptr) *((directptr_t*)(ptr))
+/**
+ * The order of a pageblock (2MB), allocations are grouped by their mobility at
+ * the pageblock level so short lived and long lived allocations don't end up
+ * fragmenting each other
+ */
+#define PAGEBLOCK_ORDER 9
+#define PAGEBLOCK_PAGES (1ull << PAGEBLOCK_ORDER)
+
+/**
+ * The huge page orders
+ */
+#define HUGE_2MB_ORDER 9
+#define HUGE_1GB_ORDER 18
+
+/**
+ * Set when the page is the first page of a free block, the order
+ * of the block is in the order field
+ */
+#define PAGE_FLAG_FREE BIT0
+
+typedef struct buddy buddy_t;
+
+/**
+ * The metadata of a single physical page, we have one of these for every page
+ * in the system so we can find the buddy of a block without touching the memory
+ * of the block itself
+ */
+typedef struct page {
+    union {
+        /**
+         * Link in the free list of the buddy, only valid while the page is
+         * the first page of a free block
+         */
+        list_entry_t link;
+
+        /**
+         * The owner of an allocated page, set by whoever allocated
+         * the page (see pmm_set_owner)
+         */
+        void* owner;
+    };
+
+    /**
+     * The buddy this page belongs to, NULL if the page is not managed
+     * by the pmm at all
+     */
+    buddy_t* buddy;
+
+    /**
+     * The order of the free block, only valid while the page is free
+     */
+    uint8_t order;
+
+    /**
+     * The page flags
+     */
+    uint8_t flags;
+
+    /**
+     * The group of the pageblock, only valid on the first page
+     * of the pageblock
+     */
+    uint8_t group;
+} page_t;
+
+/**
+ * Represents a single buddy
+ */
+typedef struct buddy {
+    /**
+     * Doubly linked list of all the free blocks smaller than a pageblock,
+     * for each of the groups, linked through the page metadata
+     */
+    list_t free_list[PAGE_GROUP_MAX][PAGEBLOCK_ORDER];
+
+    /**
+     * Free blocks of a pageblock and bigger, these are not owned by
+     * any group until they are split
+     */
+    list_t pageblock_free_list[MAX_ORDER - PAGEBLOCK_ORDER];
+
+    /**
+     * The amount of free blocks in each order
+     */
+    size_t free_count[MAX_ORDER];
+
+    /**
+     * Bitmap of the orders with any free blocks, this is read without
+     * the lock to skip empty buddies
+     */
+    _Atomic(uint32_t) free_orders;
+
+    /**
+     * The amount of pages managed by this buddy
+     */
+    size_t total_pages;
+
+    /**
+     * The amount of allocations and frees done in each order
+     */
+    size_t alloc_ops[MAX_ORDER];
+    size_t free_ops[MAX_ORDER];
+
+    /**
+     * The buddies lock
+     */
+    lock_t lock;
+} buddy_t;
+
+/**
+ * Every numa node has a buddy for low memory (<4GB) and a buddy
+ * for high memory (>4GB)
+ */
+typedef struct memory_node {
+    buddy_t low_buddy;
+    buddy_t high_buddy;
+} memory_node_t;
+
+/**
+ * The memory of each of the numa nodes
+ */
+static memory_node_t g_memory_nodes[NUMA_MAX_NODES];
+
+/**
+ * The numa node a buddy belongs to
+ */
+static int buddy_node(buddy_t* buddy) {
+    return ((uintptr_t)buddy - (uintptr_t)g_memory_nodes) / sizeof(memory_node_t);
+}
+
+/**
+ * The highest usable address in the system
+ */
+static size_t g_highest_address;
+
+/**
+ * The page metadata, indexed by the page frame number
+ */
+static page_t* g_pages;
+
+/**
+ * The amount of entries in the page metadata
+ */
+static size_t g_page_count;
+
+static page_t* page_of(directptr_t ptr) {
+    return &g_pages[DIRECT_TO_PHYS(ptr) >> PAGE_SHIFT];
+}
+
+static directptr_t page_address(page_t* page) {
+    return PHYS_TO_DIRECT((physptr_t)(page - g_pages) << PAGE_SHIFT);
+}
+
+/**
+ * Get the first page of the pageblock the page is in
+ */
+static page_t* pageblock_of(page_t* page) {
+    return &g_pages[(page - g_pages) & ~(PAGEBLOCK_PAGES - 1)];
+}
+
+/**
+ * Get the order needed to fit the given size
+ */
+static int size_to_order(size_t size) {
+    size_t pages = SIZE_TO_PAGES(size);
+    return pages <= 1 ? 0 : (int)LOG2(pages - 1) + 1;
+}
+
+/**
+ * The latencies we keep histograms of, the histograms are in cycles and each
+ * bucket is a power of two. Reading the tsc around every operation is not free,
+ * so the histograms are only compiled in with PMM_LATENCY=1
+ */
+typedef enum latency {
+    LATENCY_ALLOC,
+    LATENCY_FREE,
+    LATENCY_LOCK_WAIT,
+    LATENCY_MAX,
+} latency_t;
+
+#define LATENCY_BUCKETS 40
+
+typedef struct pmm_cpu_stats {
+#ifdef __TOMATOS_PMM_LATENCY__
+    /**
+     * The latency histograms
+     */
+    size_t latency[LATENCY_MAX][LATENCY_BUCKETS];
+#endif
+
+    /**
+     * Allocations that could not be satisfied
+     */
+    size_t failed_allocs;
+} pmm_cpu_stats_t;
+
+/**
+ * The stats of each cpu, these are not cpu locals so they can be read
+ * from any cpu, aligned so cpus don't share cache lines
+ */
+static pmm_cpu_stats_t __attribute__((aligned(64))) g_pmm_cpu_stats[ARRAY_LEN(g_cpu_locals)];
+
+#ifdef __TOMATOS_PMM_LATENCY__
+
+static uint64_t latency_start() {
+    return __rdtsc();
+}
+
+static void latency_record(latency_t latency, uint64_t start) {
+    uint64_t cycles = __rdtsc() - start;
+    int bucket = cycles == 0 ? 0 : MIN((int)LOG2(cycles), LATENCY_BUCKETS - 1);
+    g_pmm_cpu_stats[g_cpu_id].latency[latency][bucket]++;
+}
+
+#else
+
+static uint64_t latency_start() {
+    return 0;
+}
+
+static void latency_record(latency_t latency, uint64_t start) {
+}
+
+#endif
+
+/**
+ * Take the buddy lock, keeping track of how long we waited for it
+ */
+static void buddy_lock(buddy_t* buddy) {
+    uint64_t start = latency_start();
+    acquire_lock(&buddy->lock);
+    latency_record(LATENCY_LOCK_WAIT, start);
+}
+
+static void buddy_unlock(buddy_t* buddy) {
+    release_lock(&buddy->lock);
+}
+
+/**
+ * Insert a block to the free list without trying to merge it, blocks smaller
+ * than a pageblock go to the list of the group of their pageblock
+ */
+static void buddy_insert_free_item(buddy_t* buddy, page_t* page, int order) {
+    page->flags |= PAGE_FLAG_FREE;
+    page->order = order;
+
+    if (order < PAGEBLOCK_ORDER) {
+        list_push(&buddy->free_list[pageblock_of(page)->group][order], &page->link);
+    } else {
+        list_push(&buddy->pageblock_free_list[order - PAGEBLOCK_ORDER], &page->link);
+    }
+
+    if (buddy->free_count[order]++ == 0) {
+        buddy->free_orders |= 1u << order;
+    }
+}
+
+/**
+ * Remove a free block from the free list
+ */
+static void buddy_remove_free_item(buddy_t* buddy, page_t* page) {
+    list_remove(&page->link);
+    page->flags &= ~PAGE_FLAG_FREE;
+
+    if (--buddy->free_count[page->order] == 0) {
+        buddy->free_orders &= ~(1u << page->order);
+    }
+}
+
+/**
+ * Free a block, merging it with its buddies as long as they are free,
+ * the buddy lock must be held by the caller
+ */
+static void buddy_add_free_item(buddy_t* buddy, page_t* page, int order) {
+    size_t pfn = page - g_pages;
+
+    while (order < MAX_ORDER - 1) {
+        // the buddy of a naturally aligned block only differs in a single bit
+        size_t buddy_pfn = pfn ^ (1ull << order);
+        if (buddy_pfn >= g_page_count) {
+            break;
+        }
+
+        // the buddy must be a free block of the same order in the same buddy
+        page_t* other = &g_pages[buddy_pfn];
+        if (!(other->flags & PAGE_FLAG_FREE) || other->order != order || other->buddy != buddy) {
+            break;
+        }
+
+        // take it out and continue with the merged block
+        buddy_remove_free_item(buddy, other);
+        pfn &= ~(1ull << order);
+        order++;
+    }
+
+    buddy_insert_free_item(buddy, &g_pages[pfn], order);
+}
+
+static void buddy_add_free_item_locked(buddy_t* buddy, page_t* page, int order) {
+    buddy_lock(buddy);
+    buddy->free_ops[order]++;
+    buddy_add_free_item(buddy, page, order);
+    buddy_unlock(buddy);
+}
+
+static void buddy_add_range(buddy_t* buddy, size_t pfn, size_t count) {
+    // mark all the pages as owned by this buddy
+    for (size_t i = 0; i < count; i++) {
+        g_pages[pfn + i].buddy = buddy;
+    }
+
+    // add the range as the biggest naturally aligned blocks we can,
+    // ranges may be added after the buddy is already in use
+    buddy_lock(buddy);
+    buddy->total_pages += count;
+    while (count != 0) {
+        int order = pfn == 0 ? MAX_ORDER - 1 : __builtin_ctzll(pfn);
+        order = MIN(order, (int)LOG2(count));
+        order = MIN(order, MAX_ORDER - 1);
+        buddy_add_free_item(buddy, &g_pages[pfn], order);
+        pfn += 1ull << order;
+        count -= 1ull << order;
+    }
+    buddy_unlock(buddy);
+}
+
+/**
+ * Get the most recently freed block in the free list without removing it
+ */
+static page_t* free_list_peek(list_t* list) {
+    return list->prev == list ? NULL : CR(list->prev, page_t, link);
+}
+
+/**
+ * Find a free block for the given group, in order of preference:
+ *  - the smallest block in the lists of the group
+ *  - the smallest whole free pageblock, which is then claimed by the group
+ *  - the biggest block from another group, if it is big enough the whole
+ *    pageblock is claimed by the group so future frees will go to our group,
+ *    only done if steal is set
+ */
+static page_t* buddy_find_free_item(buddy_t* buddy, int order, page_group_t group, bool steal) {
+    page_t* page;
+
+    // search in the group itself
+    for (int i = order; i < PAGEBLOCK_ORDER; i++) {
+        if ((page = free_list_peek(&buddy->free_list[group][i])) != NULL) {
+            return page;
+        }
+    }
+
+    // take a whole pageblock
+    for (int i = MAX(order, PAGEBLOCK_ORDER); i < MAX_ORDER; i++) {
+        if ((page = free_list_peek(&buddy->pageblock_free_list[i - PAGEBLOCK_ORDER])) != NULL) {
+            if (order < PAGEBLOCK_ORDER) {
+                pageblock_of(page)->group = group;
+            }
+            return page;
+        }
+    }
+
+    if (!steal) {
+        return NULL;
+    }
+
+    // steal from the other groups
+    for (int other = 0; other < PAGE_GROUP_MAX; other++) {
+        if (other == group) {
+            continue;
+        }
+
+        for (int i = PAGEBLOCK_ORDER - 1; i >= order; i--) {
+            if ((page = free_list_peek(&buddy->free_list[other][i])) != NULL) {
+                // half a pageblock or more, claim the whole thing
+                if (i >= PAGEBLOCK_ORDER - 1) {
+                    pageblock_of(page)->group = group;
+                }
+                return page;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Pop a single item of the given order, splitting bigger items if needed,
+ * the buddy lock must be held by the caller
+ */
+static directptr_t buddy_alloc_item(buddy_t* buddy, int order, page_group_t group) {
+    page_t* page = buddy_find_free_item(buddy, order, group, true);
+    if (page == NULL) {
+        return NULL;
+    }
+    int found_order = page->order;
+    buddy_remove_free_item(buddy, page);
+    buddy->alloc_ops[order]++;
+
+    // free the upper halves of the left overs
+    while (found_order > order) {
+        found_order--;
+        buddy_insert_free_item(buddy, page + (1ull << found_order), found_order);
+    }
+
+    return page_address(page);
+}
+
+/**
+ * Allocate multiple items of the same order while only taking the lock once,
+ * returns the amount of items that were actually allocated
+ */
+static size_t buddy_alloc_batch(buddy_t* buddy, int order, page_group_t group, directptr_t* items, size_t count) {
+    size_t allocated = 0;
+
+    // don't bother taking the lock if there is nothing big enough
+    if ((buddy->free_orders >> order) == 0) {
+        return 0;
+    }
+
+    buddy_lock(buddy);
+    while (allocated < count) {
+        directptr_t address = buddy_alloc_item(buddy, order, group);
+        if (address == NULL) {
+            break;
+        }
+        items[allocated++] = address;
+    }
+    buddy_unlock(buddy);
+
+    return allocated;
+}
+
+/**
+ * Allocate single pages, whole blocks are split directly into the output
+ * instead of going through the free lists, returns the amount of pages that
+ * were actually allocated
+ */
+static size_t buddy_alloc_bulk(buddy_t* buddy, page_group_t group, directptr_t* pages, size_t count) {
+    size_t allocated = 0;
+
+    // don't bother taking the lock if the buddy is empty
+    if (buddy->free_orders == 0) {
+        return 0;
+    }
+
+    buddy_lock(buddy);
+    while (allocated < count) {
+        // prefer a block that we can use whole, and only steal from the other
+        // groups once none of the orders has anything of our own left
+        int max_order = MIN((int)LOG2(count - allocated), MAX_ORDER - 1);
+        page_t* page = NULL;
+        for (int order = max_order; order >= 0 && page == NULL; order--) {
+            page = buddy_find_free_item(buddy, order, group, false);
+        }
+        for (int order = max_order; order >= 0 && page == NULL; order--) {
+            page = buddy_find_free_item(buddy, order, group, true);
+        }
+        if (page == NULL) {
+            break;
+        }
+
+        int order = page->order;
+        size_t block_pages = 1ull << order;
+        buddy_remove_free_item(buddy, page);
+
+        // whole pageblocks are now owned by the group
+        if (order >= PAGEBLOCK_ORDER) {
+            for (size_t i = 0; i < block_pages; i += PAGEBLOCK_PAGES) {
+                page[i].group = group;
+            }
+        }
+
+        // take as much as we need
+        size_t take = MIN(block_pages, count - allocated);
+        buddy->alloc_ops[0] += take;
+        for (size_t i = 0; i < take; i++) {
+            pages[allocated++] = page_address(page + i);
+        }
+
+        // and give back the tail as naturally aligned blocks
+        size_t offset = take;
+        while (offset < block_pages) {
+            int tail_order = MIN(__builtin_ctzll(offset), (int)LOG2(block_pages - offset));
+            buddy_insert_free_item(buddy, page + offset, tail_order);
+            offset += 1ull << tail_order;
+        }
+    }
+    buddy_unlock(buddy);
+
+    return allocated;
+}
+
+/**
+ * Free multiple items of the same order, items are grouped by their
+ * buddy so each lock is only taken once.
+ */
+static void buddy_free_batch(int order, directptr_t* items, size_t count) {
+    buddy_t* done[NUMA_MAX_NODES * 2];
+    size_t done_count = 0;
+
+    for (size_t first = 0; first < count; first++) {
+        buddy_t* buddy = page_of(items[first])->buddy;
+
+        // all the items of this buddy were already freed
+        bool seen = false;
+        for (size_t i = 0; i < done_count && !seen; i++) {
+            seen = done[i] == buddy;
+        }
+        if (seen) {
+            continue;
+        }
+
+        // free everything that belongs to this buddy, everything
+        // before the first item belongs to buddies we are done with
+        buddy_lock(buddy);
+        for (size_t i = first; i < count; i++) {
+            page_t* page = page_of(items[i]);
+            if (page->buddy == buddy) {
+                buddy->free_ops[order]++;
+                buddy_add_free_item(buddy, page, order);
+            }
+        }
+        buddy_unlock(buddy);
+
+        done[done_count++] = buddy;
+    }
+}
+
+/**
+ * Allocate items going over the nodes by their distance from the given node,
+ * in each node high memory is preferred over low memory. Returns the amount of
+ * items that were actually allocated.
+ */
+static size_t nodes_alloc_batch(int node, int order, page_group_t group, directptr_t* items, size_t count, bool low_only) {
+    const uint8_t* fallback = numa_fallback_order(node);
+    size_t allocated = 0;
+
+    for (int i = 0; i < numa_node_count() && allocated < count; i++) {
+        memory_node_t* memory_node = &g_memory_nodes[fallback[i]];
+
+        if (!low_only) {
+            allocated += buddy_alloc_batch(&memory_node->high_buddy, order, group, items + allocated, count - allocated);
+        }
+
+        if (allocated < count) {
+            allocated += buddy_alloc_batch(&memory_node->low_buddy, order, group, items + allocated, count - allocated);
+        }
+    }
+
+    return allocated;
+}
+
+/**
+ * Allocate single pages from the nodes, see nodes_alloc_batch
+ */
+static size_t nodes_alloc_bulk(int node, page_group_t group, directptr_t* pages, size_t count) {
+    const uint8_t* fallback = numa_fallback_order(node);
+    size_t allocated = 0;
+
+    for (int i = 0; i < numa_node_count() && allocated < count; i++) {
+        memory_node_t* memory_node = &g_memory_nodes[fallback[i]];
+
+        allocated += buddy_alloc_bulk(&memory_node->high_buddy, group, pages + allocated, count - allocated);
+        if (allocated < count) {
+            allocated += buddy_alloc_bulk(&memory_node->low_buddy, group, pages + allocated, count - allocated);
+        }
+    }
+
+    return allocated;
+}
+
+/**
+ * Allocate a single item from the nodes, see nodes_alloc_batch
+ */
+static directptr_t nodes_alloc(int node, size_t size, page_group_t group, bool low_only) {
+    int order = size_to_order(size);
+
+    // make sure the buddy can actually do that
+    if (order >= MAX_ORDER) {
+        WARN("Tried to allocate too much from buddy (order %d, max order %d)", order, MAX_ORDER);
+        return NULL;
+    }
+
+    directptr_t ptr = NULL;
+    nodes_alloc_batch(node, order, group, &ptr, 1, low_only);
+    return ptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Per-cpu page magazines
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The magazines cache items of the smallest orders (4KB-32KB) per cpu, that way
+ * most single page allocations never touch the buddy lock, and never disable
+ * interrupts.
+ *
+ * The magazines are only ever accessed by their own cpu, tasks are never preempted
+ * and interrupt handlers never allocate pages while inside of the pmm (the page fault
+ * handler only allocates on heap faults, and we never touch the heap in here), so
+ * no locking is needed.
+ *
+ * Each group has its own magazines, so cached pages keep the grouping of the
+ * pageblock they came from.
+ */
+#define MAGAZINE_ORDERS 4
+
+/**
+ * The max amount of items a magazine of the given order can hold, we hold
+ * less items for bigger orders so each magazine holds at most 256KB
+ */
+#define MAGAZINE_MAX_SIZE 64
+#define MAGAZINE_SIZE(order) (MAGAZINE_MAX_SIZE >> (order))
+
+/**
+ * How many items are moved between the magazine and the buddy at once
+ */
+#define MAGAZINE_BATCH(order) (MAGAZINE_SIZE(order) / 2)
+
+typedef struct magazine {
+    /**
+     * The amount of items in the magazine
+     */
+    size_t count;
+
+    /**
+     * The cached items
+     */
+    directptr_t items[MAGAZINE_MAX_SIZE];
+} magazine_t;
+
+typedef struct magazine_stats {
+    /**
+     * Allocations served from the magazine, and ones that needed a refill
+     */
+    size_t alloc_hits;
+    size_t alloc_misses;
+
+    /**
+     * Frees that went to the magazine, and ones that needed a drain
+     */
+    size_t free_hits;
+    size_t free_misses;
+
+    /**
+     * The amount of refills/drains and the amount of items they moved
+     */
+    size_t refills;
+    size_t refilled_items;
+    size_t drains;
+    size_t drained_items;
+
+    /**
+     * The amount of items in the magazines of the cpu right now
+     */
+    size_t cached;
+} magazine_stats_t;
+
+/**
+ * The magazines of the current cpu, one for each group and order
+ */
+static magazine_t CPU_LOCAL g_magazines[PAGE_GROUP_MAX][MAGAZINE_ORDERS];
+
+/**
+ * The magazine stats of each of the cpus, these are not cpu locals so
+ * they can be read from any cpu, aligned so cpus don't share cache lines
+ */
+static struct {
+    magazine_stats_t orders[MAGAZINE_ORDERS];
+} __attribute__((aligned(64))) g_magazine_stats[ARRAY_LEN(g_cpu_locals)];
+
+/**
+ * Refill the magazine of the current cpu from the buddies, prefers the
+ * node of the current cpu and high memory just like palloc
+ */
+static void magazine_refill(page_group_t group, int order) {
+    magazine_stats_t* stats = &g_magazine_stats[g_cpu_id].orders[order];
+    magazine_t* magazine = &g_magazines[group][order];
+    size_t want = MAGAZINE_BATCH(order);
+    directptr_t items[MAGAZINE_MAX_SIZE];
+
+    size_t got = nodes_alloc_batch(numa_current_node(), order, group, items, want, false);
+
+    for (size_t i = 0; i < got; i++) {
+        magazine->items[magazine->count++] = items[i];
+    }
+
+    stats->refills++;
+    stats->refilled_items += got;
+    stats->cached += got;
+}
+
+/**
+ * Drain half of the magazine of the current cpu back into the buddies
+ */
+static void magazine_drain(page_group_t group, int order) {
+    magazine_stats_t* stats = &g_magazine_stats[g_cpu_id].orders[order];
+    magazine_t* magazine = &g_magazines[group][order];
+    size_t count = MAGAZINE_BATCH(order);
+    directptr_t items[MAGAZINE_MAX_SIZE];
+
+    for (size_t i = 0; i < count; i++) {
+        items[i] = magazine->items[--magazine->count];
+    }
+    buddy_free_batch(order, items, count);
+
+    stats->drains++;
+    stats->drained_items += count;
+    stats->cached -= count;
+}
+
+static directptr_t magazine_alloc(page_group_t group, int order) {
+    magazine_stats_t* stats = &g_magazine_stats[g_cpu_id].orders[order];
+    magazine_t* magazine = &g_magazines[group][order];
+
+    if (magazine->count == 0) {
+        stats->alloc_misses++;
+        magazine_refill(group, order);
+
+        // the buddies are out of memory
+        if (magazine->count == 0) {
+            return NULL;
+        }
+    } else {
+        stats->alloc_hits++;
+    }
+
+    stats->cached--;
+    return magazine->items[--magazine->count];
+}
+
+static void magazine_free(page_group_t group, int order, directptr_t ptr) {
+    magazine_stats_t* stats = &g_magazine_stats[g_cpu_id].orders[order];
+    magazine_t* magazine = &g_magazines[group][order];
+
+    if (magazine->count == MAGAZINE_SIZE(order)) {
+        stats->free_misses++;
+        magazine_drain(group, order);
+    } else {
+        stats->free_hits++;
+    }
+
+    stats->cached++;
+    magazine->items[magazine->count++] = ptr;
+}
+
+/**
+ * The pages cached in the magazines of all the cpus, the counts of
+ * the other cpus are read without any locking so this is a snapshot
+ */
+static size_t magazine_cached_pages() {
+    size_t pages = 0;
+    for (size_t cpu = 0; cpu < g_cpu_count; cpu++) {
+        for (int order = 0; order < MAGAZINE_ORDERS; order++) {
+            pages += __atomic_load_n(&g_magazine_stats[cpu].orders[order].cached, __ATOMIC_RELAXED) << order;
+        }
+    }
+    return pages;
+}
+
+void pmm_dump_magazine_stats() {
+    TRACE("PMM magazine stats:");
+    for (size_t cpu = 0; cpu < g_cpu_count; cpu++) {
+        for (int order = 0; order < MAGAZINE_ORDERS; order++) {
+            magazine_stats_t* stats = &g_magazine_stats[cpu].orders[order];
+            size_t allocs = stats->alloc_hits + stats->alloc_misses;
+            size_t frees = stats->free_hits + stats->free_misses;
+            if (allocs == 0 && frees == 0) {
+                continue;
+            }
+
+            TRACE("\tCPU #%lu order %d: alloc hit %lu%% (%lu/%lu), free hit %lu%% (%lu/%lu), "
+                  "%lu refills (%lu items), %lu drains (%lu items)",
+                  cpu, order,
+                  allocs ? stats->alloc_hits * 100 / allocs : 0ul, stats->alloc_hits, allocs,
+                  frees ? stats->free_hits * 100 / frees : 0ul, stats->free_hits, frees,
+                  stats->refills, stats->refilled_items, stats->drains, stats->drained_items);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// PMM statistics
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * How often the stats are dumped
+ */
+#define PMM_STATS_PERIOD_SECONDS 10
+
+/**
+ * When was the last periodic dump, starts at the
+ * time the pmm was initialized
+ */
+static uint64_t g_last_stats_dump = 0;
+
+/**
+ * The pages cached in the zero pool and the color lists, the pools
+ * are defined further down
+ */
+static size_t zero_pool_pages();
+static size_t color_cached_pages();
+
+/**
+ * Count how many blocks of the given order could be allocated from the buddy
+ * right now without having to wait for anything to be freed
+ */
+static size_t buddy_count_free_blocks(buddy_t* buddy, int order) {
+    size_t count = 0;
+    for (int i = order; i < MAX_ORDER; i++) {
+        count += buddy->free_count[i] << (i - order);
+    }
+    return count;
+}
 
 /**
- * Represents a single buddy
+ * The unusable free space index of the buddy, how much of the free memory
+ * (in percents) is in blocks that are too small for the given order
  */
-typedef struct {
-    /**
-     * The max ordered supported by this structure
-     */
-    int max_order;
+static size_t buddy_unusable_index(buddy_t* buddy, int order) {
+    size_t free_pages = buddy_count_free_blocks(buddy, 0);
+    if (free_pages == 0) {
+        return 0;
+    }
+
+    size_t usable_pages = buddy_count_free_blocks(buddy, order) << order;
+    return (free_pages - usable_pages) * 100 / free_pages;
+}
+
+size_t pmm_free_pages() {
+    size_t free_pages = 0;
+    for (int node = 0; node < numa_node_count(); node++) {
+        free_pages += buddy_count_free_blocks(&g_memory_nodes[node].low_buddy, 0);
+        free_pages += buddy_count_free_blocks(&g_memory_nodes[node].high_buddy, 0);
+    }
+    return free_pages;
+}
+
+size_t pmm_count_free_huge(size_t size) {
+    int order;
+    if (size == SIZE_2MB) {
+        order = HUGE_2MB_ORDER;
+    } else if (size == SIZE_1GB) {
+        order = HUGE_1GB_ORDER;
+    } else {
+        return 0;
+    }
+
+    // this is only a snapshot, so don't bother with the locks
+    size_t count = 0;
+    for (int node = 0; node < numa_node_count(); node++) {
+        count += buddy_count_free_blocks(&g_memory_nodes[node].low_buddy, order);
+        count += buddy_count_free_blocks(&g_memory_nodes[node].high_buddy, order);
+    }
+    return count;
+}
+
+void pmm_dump_huge_stats() {
+    size_t free_pages = pmm_free_pages();
+    size_t free_2mb = pmm_count_free_huge(SIZE_2MB);
+    size_t free_1gb = pmm_count_free_huge(SIZE_1GB);
+    TRACE("PMM huge pages: %lu free 2MB pages (%lu%% of free memory), %lu free 1GB pages",
+          free_2mb, free_pages ? (free_2mb << HUGE_2MB_ORDER) * 100 / free_pages : 0ul, free_1gb);
+}
+
+static void buddy_dump_stats(int node, const char* name, buddy_t* buddy) {
+    if (buddy->total_pages == 0) {
+        return;
+    }
+
+    size_t free_pages = buddy_count_free_blocks(buddy, 0);
+    TRACE("\tNode #%d %s memory: %lu/%lu MB free, unusable index: 32KB %lu%%, 2MB %lu%%, 1GB %lu%%",
+          node, name, (free_pages << PAGE_SHIFT) / SIZE_1MB, (buddy->total_pages << PAGE_SHIFT) / SIZE_1MB,
+          buddy_unusable_index(buddy, 3), buddy_unusable_index(buddy, HUGE_2MB_ORDER),
+          buddy_unusable_index(buddy, HUGE_1GB_ORDER));
+
+    for (int order = 0; order < MAX_ORDER; order++) {
+        if (buddy->free_count[order] == 0 && buddy->alloc_ops[order] == 0 && buddy->free_ops[order] == 0) {
+            continue;
+        }
+        TRACE("\t\torder %2d: %lu free blocks, %lu allocs, %lu frees",
+              order, buddy->free_count[order], buddy->alloc_ops[order], buddy->free_ops[order]);
+    }
+}
+
+#ifdef __TOMATOS_PMM_LATENCY__
+
+static void latency_dump(latency_t latency, const char* name) {
+    size_t buckets[LATENCY_BUCKETS] = { 0 };
+    size_t total = 0;
+
+    // sum up all the cpus
+    for (size_t cpu = 0; cpu < g_cpu_count; cpu++) {
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            buckets[i] += g_pmm_cpu_stats[cpu].latency[latency][i];
+            total += g_pmm_cpu_stats[cpu].latency[latency][i];
+        }
+    }
+
+    if (total == 0) {
+        return;
+    }
+
+    TRACE("\t%s latency (cycles):", name);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (buckets[i] == 0) {
+            continue;
+        }
+        TRACE("\t\t%10lu-%-10lu: %lu (%lu%%)", i == 0 ? 0ul : 1ul << i, (2ul << i) - 1, buckets[i], buckets[i] * 100 / total);
+    }
+}
+
+#endif
+
+void pmm_dump_stats() {
+    size_t failed_allocs = 0;
+    for (size_t cpu = 0; cpu < g_cpu_count; cpu++) {
+        failed_allocs += g_pmm_cpu_stats[cpu].failed_allocs;
+    }
+
+    // the caches are allocated as far as the buddies are concerned, but
+    // they are free memory that can be handed out right away
+    size_t buddy_pages = pmm_free_pages();
+    size_t magazine_pages = magazine_cached_pages();
+    size_t zero_pages = zero_pool_pages();
+    size_t color_pages = color_cached_pages();
+    size_t free_pages = buddy_pages + magazine_pages + zero_pages + color_pages;
+
+    TRACE("PMM stats: %lu MB free, %lu failed allocations", (free_pages << PAGE_SHIFT) / SIZE_1MB, failed_allocs);
+    TRACE("\t%lu MB in the buddies, %lu KB in the magazines, %lu KB in the zero pool, %lu KB in the color lists",
+          (buddy_pages << PAGE_SHIFT) / SIZE_1MB, (magazine_pages << PAGE_SHIFT) / SIZE_1KB,
+          (zero_pages << PAGE_SHIFT) / SIZE_1KB, (color_pages << PAGE_SHIFT) / SIZE_1KB);
+    for (int node = 0; node < numa_node_count(); node++) {
+        buddy_dump_stats(node, "low", &g_memory_nodes[node].low_buddy);
+        buddy_dump_stats(node, "high", &g_memory_nodes[node].high_buddy);
+    }
+
+#ifdef __TOMATOS_PMM_LATENCY__
+    latency_dump(LATENCY_ALLOC, "Alloc");
+    latency_dump(LATENCY_FREE, "Free");
+    latency_dump(LATENCY_LOCK_WAIT, "Lock wait");
+#endif
+
+    pmm_dump_huge_stats();
+    pmm_dump_magazine_stats();
+}
+
+void pmm_stats_tick() {
+    // only a single cpu does the periodic dump
+    if (g_cpu_id != 0) {
+        return;
+    }
 
+    uint64_t now = __rdtsc();
+    if (now - g_last_stats_dump < PMM_STATS_PERIOD_SECONDS * g_tsc_frequency) {
+        return;
+    }
+    g_last_stats_dump = now;
+
+    pmm_dump_stats();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Pre-zeroed page pool
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Cpus that have nothing else to do fill a pool of already zeroed pages, so
+ * page table allocations and heap faults don't have to zero a page while
+ * someone is waiting on them.
+ *
+ * The pages in the pool are allocated as far as the buddies are concerned,
+ * so we can link them through the page metadata.
+ */
+#define ZERO_POOL_SIZE 512
+
+/**
+ * How many pages are zeroed in a single idle iteration, kept small so
+ * an idle cpu notices new tasks quickly
+ */
+#define ZERO_POOL_BATCH 8
+
+typedef struct zero_pool {
     /**
-     * The base of the buddy
+     * The zeroed pages
      */
-    directptr_t base;
+    list_t pages;
 
     /**
-     * Singly linked list of all free pages in each of the orders
+     * The amount of pages in the pool
      */
-    directptr_t* free_list;
+    size_t count;
 
     /**
-     * The buddies lock
+     * Protects the pool
      */
     lock_t lock;
-} buddy_t;
+} zero_pool_t;
+
+/**
+ * The pools, one for each node and group so pages keep both the numa
+ * placement and the grouping of the pageblock they came from
+ */
+static zero_pool_t g_zero_pools[NUMA_MAX_NODES][PAGE_GROUP_MAX];
+
+static directptr_t zero_pool_pop(int node, page_group_t group) {
+    zero_pool_t* pool = &g_zero_pools[node][group];
+
+    // unlocked peek, don't bother taking the lock for an empty pool
+    if (pool->count == 0) {
+        return NULL;
+    }
+
+    acquire_lock(&pool->lock);
+    list_entry_t* link = list_pop(&pool->pages);
+    if (link != NULL) {
+        pool->count--;
+    }
+    release_lock(&pool->lock);
+
+    return link == NULL ? NULL : page_address(CR(link, page_t, link));
+}
+
+static size_t zero_pool_pages() {
+    size_t pages = 0;
+    for (int node = 0; node < NUMA_MAX_NODES; node++) {
+        for (int group = 0; group < PAGE_GROUP_MAX; group++) {
+            pages += __atomic_load_n(&g_zero_pools[node][group].count, __ATOMIC_RELAXED);
+        }
+    }
+    return pages;
+}
+
+static void zero_pool_push(int node, page_group_t group, directptr_t ptr) {
+    zero_pool_t* pool = &g_zero_pools[node][group];
+
+    acquire_lock(&pool->lock);
+    list_push(&pool->pages, &page_of(ptr)->link);
+    pool->count++;
+    release_lock(&pool->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Page coloring
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
- * The low memory buddy (<4GB)
+ * Pages that are a multiple of the LLC way size apart map to the same cache sets,
+ * the color of a page is the set of cache sets it maps to. When page coloring is
+ * enabled (PAGE_COLORING=1) we keep single pages sorted by their color so latency
+ * critical data can be placed in specific colors or spread over all of them.
+ *
+ * A naturally aligned block with a page for each color contains exactly one page
+ * of every color, so the color lists are refilled by splitting such blocks.
  */
-static buddy_t g_low_buddy = {
-    .max_order = 32,
-    .base = PHYS_TO_DIRECT(0),
-    .free_list = (directptr_t[32 - MIN_ORDER]){},
-    .lock = INIT_LOCK(TPL_HIGH_LEVEL)
-};
+#define MAX_COLORS 256
 
 /**
- * The high memory buddy allocator (>4GB)
+ * Max amount of pages we keep for each color, extra pages go back to the buddy
  */
-static buddy_t g_high_buddy = {
-    .max_order = 64,
-    .base = 0, // will be set from the first entry
-    .free_list = (directptr_t[64 - MIN_ORDER]){},
-    .lock = INIT_LOCK(TPL_HIGH_LEVEL)
-};
+#define COLOR_CACHE_SIZE 8
 
 /**
- * The amount of pages in the system
+ * The amount of colors, 1 when page coloring is disabled
  */
-static size_t g_highest_address;
+static size_t g_color_count = 1;
 
-static bool check_buddies(buddy_t* buddy, directptr_t a, directptr_t b, size_t size) {
-    uintptr_t lower = MIN(a, b) - buddy->base;
-    uintptr_t upper = MAX(a, b) - buddy->base;
-    return (lower ^ size) == upper;
-}
-
-static void buddy_add_free_item(buddy_t* buddy, directptr_t address, size_t order, bool new) {
-    directptr_t head = buddy->free_list[order - MIN_ORDER];
-    NEXT(address) = 0;
-    size_t size = 1ull << order;
-
-    if (!new && head != 0) {
-        directptr_t prev = 0;
-        while (true) {
-            if (check_buddies(buddy, head, address, size)) {
-                if (prev != 0) {
-                    NEXT(prev) = NEXT(head);
-                } else {
-                    buddy->free_list[order - MIN_ORDER] = NEXT(head);
-                }
+/**
+ * The next color to hand out when spreading allocations
+ */
+static size_t g_next_color = 0;
 
-                buddy_add_free_item(buddy, MIN(head, address), order + 1, false);
-                break;
-            }
+/**
+ * The free pages of each color, linked through the page metadata
+ */
+static list_t g_color_lists[MAX_COLORS];
+static size_t g_color_counts[MAX_COLORS];
+static lock_t g_color_lock = INIT_LOCK(TPL_HIGH_LEVEL);
 
-            if (NEXT(head) == 0) {
-                NEXT(head) = address;
-                break;
-            }
+static size_t page_color(page_t* page) {
+    return (page - g_pages) & (g_color_count - 1);
+}
+
+/**
+ * Figure the amount of colors from the cpuid cache parameters of the last
+ * level cache, rounded down to a power of two so a color is just the low
+ * bits of the page frame number
+ */
+static void init_page_coloring() {
+    uint32_t max_leaf = 0;
+    cpuid(CPUID_SIGNATURE, &max_leaf, NULL, NULL, NULL);
+    if (max_leaf < 4) {
+        WARN("Can't get the cache parameters, page coloring is disabled");
+        return;
+    }
+
+    // find the way size of the highest level cache
+    size_t way_size = 0;
+    int highest_level = 0;
+    for (int i = 0; ; i++) {
+        uint32_t eax, ebx, ecx;
+        cpuidex(4, i, &eax, &ebx, &ecx, NULL);
 
-            prev = head;
-            head = NEXT(head);
+        // no more caches
+        if ((eax & 0x1f) == 0) {
+            break;
+        }
+
+        int level = (eax >> 5) & 0x7;
+        if (level > highest_level) {
+            size_t partitions = ((ebx >> 12) & 0x3ff) + 1;
+            size_t line_size = (ebx & 0xfff) + 1;
+            size_t sets = ecx + 1;
+            way_size = partitions * line_size * sets;
+            highest_level = level;
         }
-    } else {
-        // just put in the head
-        NEXT(address) = head;
-        buddy->free_list[order - MIN_ORDER] = address;
     }
-}
 
-static void buddy_add_free_item_locked(buddy_t* buddy, directptr_t address, size_t order, bool new) {
-    acquire_lock(&buddy->lock);
-    buddy_add_free_item(buddy, address, order, new);
-    release_lock(&buddy->lock);
+    if (way_size <= PAGE_SIZE) {
+        WARN("The LLC way is not bigger than a page, page coloring is disabled");
+        return;
+    }
+
+    g_color_count = MIN(1ull << LOG2(way_size / PAGE_SIZE), MAX_COLORS);
+    for (int i = 0; i < g_color_count; i++) {
+        list_init(&g_color_lists[i]);
+    }
+
+    TRACE("Page coloring: L%d way size %lu KB, %lu colors", highest_level, way_size / SIZE_1KB, g_color_count);
 }
 
-static void buddy_add_range(buddy_t* buddy, directptr_t address, size_t size) {
-    // as long as the chunk is big enough to fit
-    while (size > (1ull << MIN_ORDER)) {
-        // find the largest order and use that
-        for (int order = buddy->max_order - 1; order >= MIN_ORDER; order--) {
-            if (size >= (1ull << order)) {
-                buddy_add_free_item(buddy, address, order, true);
-                address += 1ull << order;
-                size -= 1ull << order;
-                break;
-            }
+/**
+ * Split a block that has a page of every color into the color lists, the
+ * color lock must be held
+ */
+static bool color_refill() {
+    directptr_t block = nodes_alloc(numa_current_node(), g_color_count * PAGE_SIZE, PAGE_GROUP_UNMOVABLE, false);
+    if (block == NULL) {
+        return false;
+    }
+
+    directptr_t extra[MAX_COLORS];
+    size_t extra_count = 0;
+
+    page_t* first = page_of(block);
+    for (size_t i = 0; i < g_color_count; i++) {
+        size_t color = page_color(first + i);
+        if (g_color_counts[color] < COLOR_CACHE_SIZE) {
+            list_push(&g_color_lists[color], &first[i].link);
+            g_color_counts[color]++;
+        } else {
+            extra[extra_count++] = page_address(first + i);
         }
     }
+
+    // give back whatever the cache can't hold
+    buddy_free_batch(0, extra, extra_count);
+
+    return true;
 }
 
-static directptr_t buddy_alloc(buddy_t* buddy, size_t size) {
-    int original_order = MAX(LOG2(size), MIN_ORDER);
-    size_t want_size = 1ull << original_order;
+static directptr_t color_alloc(size_t color) {
+    directptr_t ptr = NULL;
 
-    // make sure the buddy can actually do that
-    if (original_order >= buddy->max_order) {
-        WARN("Tried to allocate too much from buddy (requested %zx bytes, order %d, max order %d)", size, original_order, buddy->max_order);
-        return NULL;
+    acquire_lock(&g_color_lock);
+    if (g_color_counts[color] != 0 || color_refill()) {
+        list_entry_t* link = list_pop(&g_color_lists[color]);
+        g_color_counts[color]--;
+        ptr = page_address(CR(link, page_t, link));
     }
+    release_lock(&g_color_lock);
 
-    acquire_lock(&buddy->lock);
+    return ptr;
+}
 
-    // find the smallest order with space
-    for (int order = original_order; order < buddy->max_order; order++) {
-        if (buddy->free_list[order - MIN_ORDER] != 0) {
-            // pop the head
-            directptr_t address = buddy->free_list[order - MIN_ORDER];
-            buddy->free_list[order - MIN_ORDER] = NEXT(address);
-
-            // try to free the left overs
-            size_t found_size = 1ull << order;
-            while (found_size > want_size) {
-                found_size >>= 1ull;
-                buddy_add_free_item(buddy, address + found_size, LOG2(found_size), true);
-            }
+static size_t color_cached_pages() {
+    size_t pages = 0;
+    for (size_t color = 0; color < g_color_count; color++) {
+        pages += __atomic_load_n(&g_color_counts[color], __ATOMIC_RELAXED);
+    }
+    return pages;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The physical allocation api
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Account for an allocation that started at the given time
+ */
+static directptr_t alloc_done(directptr_t ptr, size_t size, uint64_t start) {
+    latency_record(LATENCY_ALLOC, start);
+    if (ptr == NULL) {
+        g_pmm_cpu_stats[g_cpu_id].failed_allocs++;
+    }
+    ALLOC_TRACE(ALLOC_TRACE_PALLOC, ptr, NULL, size);
+    return ptr;
+}
 
-            // return the allocated address
-            release_lock(&buddy->lock);
-            return address;
+static directptr_t palloc_group(page_group_t group, size_t size) {
+    uint64_t start = latency_start();
+    int order = size_to_order(size);
+
+    // small allocations are served from the magazines
+    if (order < MAGAZINE_ORDERS) {
+        directptr_t ptr = magazine_alloc(group, order);
+
+        // we are out of memory, the zeroed pages are still usable
+        if (ptr == NULL && order == 0) {
+            ptr = zero_pool_pop(numa_current_node(), group);
         }
+
+        return alloc_done(ptr, size, start);
     }
 
-    release_lock(&buddy->lock);
-    return NULL;
+    return alloc_done(nodes_alloc(numa_current_node(), size, group, false), size, start);
+}
+
+/**
+ * Allocate zeroed memory, single pages are taken from the zero pool
+ * if there is anything in it
+ */
+static directptr_t pallocz_group(page_group_t group, size_t size) {
+    if (size_to_order(size) == 0) {
+        directptr_t ptr = zero_pool_pop(numa_current_node(), group);
+        if (ptr != NULL) {
+            ALLOC_TRACE(ALLOC_TRACE_PALLOC, ptr, NULL, size);
+            return ptr;
+        }
+    }
+
+    directptr_t ptr = palloc_group(group, size);
+    if (ptr != NULL) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
 }
 
 directptr_t palloc(size_t size) {
-    directptr_t ptr = NULL;
+    return palloc_group(PAGE_GROUP_UNMOVABLE, size);
+}
 
-    // check if has high memory
-    if (g_high_buddy.base == 0) {
-        ptr = buddy_alloc(&g_high_buddy, size);
+directptr_t palloc_movable(size_t size) {
+    return palloc_group(PAGE_GROUP_MOVABLE, size);
+}
+
+directptr_t palloc_huge(size_t size) {
+    if (size != SIZE_2MB && size != SIZE_1GB) {
+        WARN("Tried to allocate a huge page of invalid size %p", size);
+        return NULL;
     }
 
-    // if still null try to allocate low memory
-    if (ptr == NULL) {
-        ptr = buddy_alloc(&g_low_buddy, size);
+    // the block is at least a whole pageblock, so it only
+    // ever comes from the shared pageblock lists
+    uint64_t start = latency_start();
+    return alloc_done(nodes_alloc(numa_current_node(), size, PAGE_GROUP_UNMOVABLE, false), size, start);
+}
+
+directptr_t palloc_node(int node, size_t size) {
+    if (node < 0 || node >= numa_node_count()) {
+        WARN("Tried to allocate from invalid numa node %d", node);
+        return NULL;
     }
 
-    return ptr;
+    uint64_t start = latency_start();
+    return alloc_done(nodes_alloc(node, size, PAGE_GROUP_UNMOVABLE, false), size, start);
 }
 
 directptr_t palloc_low(size_t size) {
-    return buddy_alloc(&g_low_buddy, size);
+    uint64_t start = latency_start();
+    return alloc_done(nodes_alloc(numa_current_node(), size, PAGE_GROUP_UNMOVABLE, true), size, start);
 }
 
 void pfree(directptr_t ptr, size_t size) {
-    // figure which of the buddies to use
-    buddy_t* buddy;
-    if (DIRECT_TO_PHYS(ptr) < BASE_4GB) {
-        buddy = &g_low_buddy;
+    uint64_t start = latency_start();
+    int order = size_to_order(size);
+    page_t* page = page_of(ptr);
+
+    ALLOC_TRACE(ALLOC_TRACE_PFREE, ptr, NULL, size);
+
+    if (order < MAGAZINE_ORDERS && buddy_node(page->buddy) == numa_current_node()) {
+        // small frees go to the magazines of the group the page came from
+        magazine_free(pageblock_of(page)->group, order, ptr);
     } else {
-        buddy = &g_high_buddy;
+        // add it to the buddy that owns it, pages of other nodes skip the
+        // magazines so a palloc on this cpu never gets remote memory
+        buddy_add_free_item_locked(page->buddy, page, order);
+    }
+
+    latency_record(LATENCY_FREE, start);
+}
+
+/**
+ * Record every page of a bulk operation, compiled out
+ * without the allocation trace
+ */
+static void trace_bulk(alloc_trace_type_t type, size_t count, directptr_t* pages) {
+    for (size_t i = 0; i < count; i++) {
+        ALLOC_TRACE(type, pages[i], NULL, PAGE_SIZE);
     }
+}
+
+size_t palloc_bulk(size_t count, directptr_t* pages) {
+    size_t allocated = nodes_alloc_bulk(numa_current_node(), PAGE_GROUP_UNMOVABLE, pages, count);
+    trace_bulk(ALLOC_TRACE_PALLOC, allocated, pages);
+    return allocated;
+}
+
+size_t palloc_bulk_movable(size_t count, directptr_t* pages) {
+    return palloc_bulk_movable_node(numa_current_node(), count, pages);
+}
+
+size_t palloc_bulk_movable_node(int node, size_t count, directptr_t* pages) {
+    size_t allocated = nodes_alloc_bulk(node, PAGE_GROUP_MOVABLE, pages, count);
+    trace_bulk(ALLOC_TRACE_PALLOC, allocated, pages);
+    return allocated;
+}
 
-    // get the order and add it
-    int order = MAX(LOG2(size), MIN_ORDER);
-    buddy_add_free_item_locked(buddy, ptr, order, false);
+void pfree_bulk(size_t count, directptr_t* pages) {
+    trace_bulk(ALLOC_TRACE_PFREE, count, pages);
+    buddy_free_batch(0, pages, count);
 }
 
 directptr_t pallocz(size_t size) {
-    void* ptr = palloc(size);
-    memset(ptr, 0, size);
+    return pallocz_group(PAGE_GROUP_UNMOVABLE, size);
+}
+
+directptr_t pallocz_movable(size_t size) {
+    return pallocz_group(PAGE_GROUP_MOVABLE, size);
+}
+
+directptr_t pallocz_movable_node(int node, size_t size) {
+    if (node < 0 || node >= numa_node_count()) {
+        WARN("Tried to allocate from invalid numa node %d", node);
+        return NULL;
+    }
+
+    // the magazines only hold pages of our own node
+    if (node == numa_current_node()) {
+        return pallocz_group(PAGE_GROUP_MOVABLE, size);
+    }
+
+    if (size_to_order(size) == 0) {
+        directptr_t ptr = zero_pool_pop(node, PAGE_GROUP_MOVABLE);
+        if (ptr != NULL) {
+            ALLOC_TRACE(ALLOC_TRACE_PALLOC, ptr, NULL, size);
+            return ptr;
+        }
+    }
+
+    uint64_t start = latency_start();
+    directptr_t ptr = alloc_done(nodes_alloc(node, size, PAGE_GROUP_MOVABLE, false), size, start);
+    if (ptr != NULL) {
+        memset(ptr, 0, size);
+    }
     return ptr;
 }
 
 directptr_t pallocz_low(size_t size) {
     void* ptr = palloc_low(size);
-    memset(ptr, 0, size);
+    if (ptr != NULL) {
+        memset(ptr, 0, size);
+    }
     return ptr;
 }
 
+size_t pmm_color_count() {
+    return g_color_count;
+}
+
+size_t pmm_page_color(directptr_t ptr) {
+    return page_color(page_of(ptr));
+}
+
+directptr_t palloc_color(size_t color) {
+    if (g_color_count == 1) {
+        return palloc(PAGE_SIZE);
+    }
+
+    uint64_t start = latency_start();
+    return alloc_done(color_alloc(color % g_color_count), PAGE_SIZE, start);
+}
+
+size_t palloc_spread(size_t count, directptr_t* pages) {
+    if (g_color_count == 1) {
+        return palloc_bulk(count, pages);
+    }
+
+    // take a range of colors so concurrent spreads don't start at the same color
+    size_t color = __atomic_fetch_add(&g_next_color, count, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < count; i++) {
+        pages[i] = palloc_color(color + i);
+        if (pages[i] == NULL) {
+            return i;
+        }
+    }
+    return count;
+}
+
+bool pmm_fill_zero_pool() {
+    bool did_work = false;
+
+    // the magazines hold pages of our node, so fill our node's pools
+    int node = numa_current_node();
+    for (int group = 0; group < PAGE_GROUP_MAX; group++) {
+        zero_pool_t* pool = &g_zero_pools[node][group];
+
+        for (int i = 0; i < ZERO_POOL_BATCH && pool->count < ZERO_POOL_SIZE; i++) {
+            // not palloc_group, it would just take pages out of the pool when
+            // we are low on memory
+            directptr_t ptr = magazine_alloc(group, 0);
+            if (ptr == NULL) {
+                return did_work;
+            }
+
+            memset(ptr, 0, PAGE_SIZE);
+            zero_pool_push(node, group, ptr);
+            did_work = true;
+        }
+    }
+
+    return did_work;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Code related to initializing the pmm
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -225,15 +1457,36 @@ static const char* stivale2_type_to_str(int type) {
     }
 }
 
+/**
+ * Memory that we can use once the bootloader structures and the ACPI tables
+ * are no longer needed, see pmm_reclaim_boot_memory
+ */
+static bool stivale2_type_is_reclaimable(int type) {
+    return type == STIVALE2_MMAP_BOOTLOADER_RECLAIMABLE || type == STIVALE2_MMAP_ACPI_RECLAIMABLE;
+}
+
 static void pmm_add_range(physptr_t base, size_t size) {
-    if (base < BASE_4GB) {
-        buddy_add_range(&g_low_buddy, PHYS_TO_DIRECT(base), size);
-    } else {
-        // allocate the high buddy if needed
-        if (g_high_buddy.base == NULL) {
-            g_high_buddy.base = PHYS_TO_DIRECT(base);
+    // we only manage whole pages
+    size_t start = ALIGN_UP(base, PAGE_SIZE) >> PAGE_SHIFT;
+    size_t end = ALIGN_DOWN(base + size, PAGE_SIZE) >> PAGE_SHIFT;
+
+    while (start < end) {
+        // get the node of the range, trimming it to the end of the node
+        size_t node_size = (end - start) << PAGE_SHIFT;
+        memory_node_t* memory_node = &g_memory_nodes[numa_node_of_range(start << PAGE_SHIFT, &node_size)];
+        size_t node_end = start + (ALIGN_UP(node_size, PAGE_SIZE) >> PAGE_SHIFT);
+
+        // split the range at 4GB if needed
+        size_t low_end = BASE_4GB >> PAGE_SHIFT;
+        if (start < low_end) {
+            buddy_add_range(&memory_node->low_buddy, start, MIN(node_end, low_end) - start);
+            start = MIN(node_end, low_end);
+        }
+
+        if (start < node_end) {
+            buddy_add_range(&memory_node->high_buddy, start, node_end - start);
+            start = node_end;
         }
-        buddy_add_range(&g_high_buddy, PHYS_TO_DIRECT(base), size);
     }
 }
 
@@ -242,14 +1495,18 @@ err_t init_pmm() {
 
     UNLOCKED_TRACE("Initializing pmm");
 
+    // the first periodic dump is a period from now
+    g_last_stats_dump = __rdtsc();
+
     stivale2_struct_tag_memmap_t* memap = get_stivale2_tag(STIVALE2_STRUCT_TAG_MEMMAP_ID);
     CHECK(memap != NULL);
 
-    // calculate the max allocation size
+    // calculate the max allocation size, the reclaimable memory is
+    // included so the metadata will cover it once it is reclaimed
     g_highest_address = 0;
     for (int i = 0; i < memap->entries; i++) {
         stivale2_mmap_entry_t* entry = &memap->memmap[i];
-        if (entry->type == STIVALE2_MMAP_USABLE) {
+        if (entry->type == STIVALE2_MMAP_USABLE || stivale2_type_is_reclaimable(entry->type)) {
             uintptr_t top_addr = entry->base + entry->length;
             if (top_addr > g_highest_address) {
                 g_highest_address = top_addr;
@@ -257,6 +1514,39 @@ err_t init_pmm() {
         }
     }
 
+    // initialize the buddies
+    for (int node = 0; node < NUMA_MAX_NODES; node++) {
+        memory_node_t* memory_node = &g_memory_nodes[node];
+        memory_node->low_buddy.lock = INIT_LOCK(TPL_HIGH_LEVEL);
+        memory_node->high_buddy.lock = INIT_LOCK(TPL_HIGH_LEVEL);
+        for (int group = 0; group < PAGE_GROUP_MAX; group++) {
+            for (int order = 0; order < PAGEBLOCK_ORDER; order++) {
+                list_init(&memory_node->low_buddy.free_list[group][order]);
+                list_init(&memory_node->high_buddy.free_list[group][order]);
+            }
+        }
+        for (int order = 0; order < MAX_ORDER - PAGEBLOCK_ORDER; order++) {
+            list_init(&memory_node->low_buddy.pageblock_free_list[order]);
+            list_init(&memory_node->high_buddy.pageblock_free_list[order]);
+        }
+    }
+
+    // initialize the zero pools
+    for (int node = 0; node < NUMA_MAX_NODES; node++) {
+        for (int group = 0; group < PAGE_GROUP_MAX; group++) {
+            list_init(&g_zero_pools[node][group].pages);
+            g_zero_pools[node][group].lock = INIT_LOCK(TPL_HIGH_LEVEL);
+        }
+    }
+
+    // allocate the page metadata, this must be done before adding
+    // the ranges so the early allocation is not given out as well
+    g_page_count = ALIGN_UP(g_highest_address, PAGE_SIZE) >> PAGE_SHIFT;
+    g_pages = early_alloc(SIZE_TO_PAGES(g_page_count * sizeof(page_t)));
+    CHECK_ERROR(g_pages != NULL, ERROR_OUT_OF_RESOURCES);
+    memset(g_pages, 0, g_page_count * sizeof(page_t));
+    TRACE("Page metadata takes %lu KB", (g_page_count * sizeof(page_t)) / SIZE_1KB);
+
     // go over all the entries and put them correctly in the bitmap
     for (int i = 0; i < memap->entries; i++) {
         stivale2_mmap_entry_t* entry = &memap->memmap[i];
@@ -275,10 +1565,50 @@ err_t init_pmm() {
         }
     }
 
+#ifdef __TOMATOS_PAGE_COLORING__
+    init_page_coloring();
+#endif
+
+    pmm_dump_huge_stats();
+
+cleanup:
+    return err;
+}
+
+err_t pmm_reclaim_boot_memory() {
+    err_t err = NO_ERROR;
+
+    stivale2_struct_tag_memmap_t* memap = get_stivale2_tag(STIVALE2_STRUCT_TAG_MEMMAP_ID);
+    CHECK(memap != NULL);
+
+    size_t reclaimed = 0;
+    for (int i = 0; i < memap->entries; i++) {
+        stivale2_mmap_entry_t* entry = &memap->memmap[i];
+        if (stivale2_type_is_reclaimable(entry->type)) {
+            pmm_add_range(entry->base, entry->length);
+            reclaimed += entry->length;
+
+            // so no one will try to use it as bootloader memory
+            entry->type = STIVALE2_MMAP_USABLE;
+        }
+    }
+
+    TRACE("Reclaimed %lu KB of boot memory", reclaimed / SIZE_1KB);
+
 cleanup:
     return err;
 }
 
+void pmm_set_owner(directptr_t ptr, size_t size, void* owner) {
+    page_t* page = page_of(ptr);
+    for (size_t i = 0; i < SIZE_TO_PAGES(size); i++) {
+        page[i].owner = owner;
+    }
+}
+
+void* pmm_get_owner(directptr_t ptr) {
+    return page_of(ptr)->owner;
+}
 
 directptr_t page_alloc() {
     return palloc(PAGE_SIZE);
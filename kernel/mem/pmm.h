@@ -5,11 +5,38 @@
 #include <util/defs.h>
 #include "mm.h"
 
+/**
+ * The groups physical pages are grouped by, pages of each group are kept
+ * in their own pageblocks (2MB) so long lived allocations don't end up
+ * scattered all over memory and prevent huge pages from forming
+ */
+typedef enum page_group {
+    /**
+     * Pages that are accessed through the direct map, these can never move
+     */
+    PAGE_GROUP_UNMOVABLE,
+
+    /**
+     * Pages that are only accessed through a virtual mapping (like the heap),
+     * these can in theory be replaced without the users noticing
+     */
+    PAGE_GROUP_MOVABLE,
+
+    PAGE_GROUP_MAX,
+} page_group_t;
+
 /**
  * Initialize the pmm with
  */
 err_t init_pmm();
 
+/**
+ * Give the bootloader reclaimable and ACPI reclaimable memory to the pmm, this
+ * must be called once the stivale2 tags were preserved, the ACPI tables were
+ * released and all the cpus switched to the kernel address space
+ */
+err_t pmm_reclaim_boot_memory();
+
 /**
  * Allocate a single page
  */
@@ -21,22 +48,103 @@ directptr_t page_alloc();
 void page_free(directptr_t ptr);
 
 /**
- * Allocate physical memory, this will try to first allocate from high
- * memory and only if that is out it will allocate from low memory
+ * Allocate physical memory, this will try to first allocate from the node
+ * of the current cpu and then from the closest nodes, in each node we try
+ * to first allocate from high memory and only if that is out we will allocate
+ * from low memory
  */
 directptr_t palloc(size_t size);
 
+/**
+ * Allocate physical memory, preferring memory from the given numa node, if
+ * the node is out of memory the closest nodes will be used instead
+ */
+directptr_t palloc_node(int node, size_t size);
+
+/**
+ * Like palloc, but the memory is only going to be accessed through a
+ * virtual mapping, so it is allocated from the movable pageblocks
+ */
+directptr_t palloc_movable(size_t size);
+
+/**
+ * Allocate a naturally aligned huge page, size must be either 2MB or 1GB
+ */
+directptr_t palloc_huge(size_t size);
+
 /**
  * Allocate physical memory from low memory (<4GB) this is needed for
  * some drivers but should be avoided if not needed
  */
 directptr_t palloc_low(size_t size);
 
+/**
+ * Allocate many single pages at once, the buddy lock is only taken once
+ * and bigger blocks are split directly into the output.
+ *
+ * @param count [IN]    The amount of pages to allocate
+ * @param pages [OUT]   The allocated pages
+ *
+ * @returns The amount of pages allocated, less than count if we ran out of memory
+ */
+size_t palloc_bulk(size_t count, directptr_t* pages);
+
+/**
+ * Like palloc_bulk, but allocates from the movable pageblocks
+ */
+size_t palloc_bulk_movable(size_t count, directptr_t* pages);
+
+/**
+ * Like palloc_bulk_movable, but prefers memory from the given numa node
+ */
+size_t palloc_bulk_movable_node(int node, size_t count, directptr_t* pages);
+
+/**
+ * Free many single pages at once, the pages can come from any of the
+ * palloc functions as long as they were allocated as single pages
+ */
+void pfree_bulk(size_t count, directptr_t* pages);
+
+/**
+ * Get the amount of page colors, this is 1 unless page
+ * coloring is enabled (PAGE_COLORING=1)
+ */
+size_t pmm_color_count();
+
+/**
+ * Get the color of a page, pages of the same color compete on
+ * the same sets of the last level cache
+ */
+size_t pmm_page_color(directptr_t ptr);
+
+/**
+ * Allocate a single page of the given color (modulo the color count)
+ */
+directptr_t palloc_color(size_t color);
+
+/**
+ * Allocate single pages with consecutive colors, so the pages don't
+ * compete with each other on the last level cache
+ *
+ * @returns The amount of pages allocated, less than count if we ran out of memory
+ */
+size_t palloc_spread(size_t count, directptr_t* pages);
+
 /**
  * Like palloc but will first zero the memory
  */
 directptr_t pallocz(size_t size);
 
+/**
+ * Like palloc_movable but will first zero the memory
+ */
+directptr_t pallocz_movable(size_t size);
+
+/**
+ * Like pallocz_movable, but prefers memory from the given numa node
+ */
+directptr_t pallocz_movable_node(int node, size_t size);
+
 /**
  * like palloc_low, but will first zero the memory
  */
@@ -47,4 +155,59 @@ directptr_t pallocz_low(size_t size);
  */
 void pfree(directptr_t ptr, size_t size);
 
+/**
+ * Set the owner of every page in an allocated block, the owner is
+ * overwritten once the block is freed
+ */
+void pmm_set_owner(directptr_t ptr, size_t size, void* owner);
+
+/**
+ * Get the owner of an allocated page, the pointer can point
+ * anywhere inside of the page
+ */
+void* pmm_get_owner(directptr_t ptr);
+
+/**
+ * Zero a few pages into the zero pool of the current node, should be
+ * called by cpus that have nothing better to do.
+ *
+ * @returns true if any work was done, false if the pool is full
+ */
+bool pmm_fill_zero_pool();
+
+/**
+ * Trace the hit rate and the refill/drain frequency of
+ * the per-cpu page magazines
+ */
+void pmm_dump_magazine_stats();
+
+/**
+ * Get the amount of free pages in the buddies, this does not include
+ * pages cached in the magazines, the zero pool and the color lists
+ */
+size_t pmm_free_pages();
+
+/**
+ * Trace the free memory and fragmentation of each of the buddies, and
+ * the alloc/free/lock wait latency histograms
+ */
+void pmm_dump_stats();
+
+/**
+ * Dump the stats if enough time passed since the last dump, called
+ * periodically by the idle cpus
+ */
+void pmm_stats_tick();
+
+/**
+ * Get how many huge pages of the given size (2MB or 1GB) can
+ * currently be allocated
+ */
+size_t pmm_count_free_huge(size_t size);
+
+/**
+ * Trace the amount of free huge pages
+ */
+void pmm_dump_huge_stats();
+
 #endif //TOMATOS_PMM_H
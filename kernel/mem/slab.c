@@ -0,0 +1,616 @@
+#include <util/except.h>
+#include <util/string.h>
+#include <arch/cpu.h>
+#include <cont/list.h>
+#include <sync/lock.h>
+#include "pmm.h"
+#include "slab.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Code related to the slab allocator
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Objects are aligned to this, and this is also the smallest object
+ */
+#define SLAB_ALIGN 16
+
+/**
+ * Try to have at least this amount of objects in each slab, the slab
+ * size is doubled until it fits or until we reach the max order
+ */
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_MAX_PAGES 8
+
+/**
+ * How many empty slabs each cache keeps before giving them back to the pmm
+ */
+#define SLAB_EMPTY_KEEP 1
+
+/**
+ * How many full magazines the depot keeps when reaped
+ */
+#define SLAB_DEPOT_KEEP 4
+
+/**
+ * The amount of objects in a magazine
+ */
+#define SLAB_MAGAZINE_SIZE 32
+
+/**
+ * The header of a slab, placed at the start of the slab memory, every
+ * page of the slab has the slab as its owner so any object can find it
+ */
+typedef struct slab {
+    /**
+     * Link in the partial/full/empty list of the cache
+     */
+    list_entry_t link;
+
+    /**
+     * The cache this slab belongs to
+     */
+    kmem_cache_t* cache;
+
+    /**
+     * The free objects, linked through their first word
+     */
+    void* free_objects;
+
+    /**
+     * The amount of allocated objects
+     */
+    size_t in_use;
+} slab_t;
+
+/**
+ * The objects start on the cache line after the header, so every object is
+ * aligned to the biggest power of two that divides the object size, up to a
+ * whole cache line
+ */
+#define SLAB_HEADER_SIZE ALIGN_UP(sizeof(slab_t), CACHE_LINE_SIZE)
+
+/**
+ * A magazine is a stack of objects, the cpus allocate and free from their own
+ * magazines, and full and empty magazines are exchanged with the depot of the
+ * cache as whole units, so the cache lock is only taken once per magazine.
+ *
+ * Objects freed by a cpu that did not allocate them simply go to the magazines
+ * of the freeing cpu, and once full end up in the depot where any other cpu can
+ * pick them up.
+ */
+typedef struct slab_magazine {
+    /**
+     * Link in the depot or the magazine pool
+     */
+    struct slab_magazine* next;
+
+    /**
+     * The amount of objects in the magazine
+     */
+    size_t rounds;
+
+    /**
+     * The objects
+     */
+    void* objects[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+/**
+ * The magazines of a single cpu, aligned so cpus don't share cache lines
+ *
+ * The magazines are only ever accessed by their own cpu, tasks are never preempted
+ * and interrupt handlers don't allocate from the heap, so no locking is needed.
+ */
+typedef struct slab_cpu {
+    /**
+     * We keep two magazines, so a cpu that allocates and frees
+     * right at the edge of a magazine doesn't go to the depot
+     * on every operation
+     */
+    slab_magazine_t* loaded;
+    slab_magazine_t* previous;
+
+    /**
+     * Operations served by the magazines, and ones that needed the depot
+     */
+    size_t alloc_hits;
+    size_t alloc_misses;
+    size_t free_hits;
+    size_t free_misses;
+} __attribute__((aligned(64))) slab_cpu_t;
+
+struct kmem_cache {
+    /**
+     * The name of the cache
+     */
+    char name[32];
+
+    /**
+     * The object size, aligned to SLAB_ALIGN
+     */
+    size_t object_size;
+
+    /**
+     * The size of each slab and the amount of objects in it
+     */
+    size_t slab_size;
+    size_t slab_objects;
+
+    /**
+     * Protects the slab lists and the depot
+     */
+    lock_t lock;
+
+    /**
+     * The slabs, by how many free objects they have
+     */
+    list_t partial_slabs;
+    list_t full_slabs;
+    list_t empty_slabs;
+    size_t empty_count;
+    size_t slab_count;
+
+    /**
+     * The depot, full magazines and empty magazines
+     */
+    slab_magazine_t* depot_full;
+    slab_magazine_t* depot_empty;
+    size_t depot_full_count;
+    size_t depot_empty_count;
+
+    /**
+     * How many times the cpus went to the depot, and how
+     * many objects moved directly to/from the slabs
+     */
+    size_t depot_exchanges;
+    size_t slab_allocs;
+    size_t slab_frees;
+
+    /**
+     * Link in the list of all caches
+     */
+    list_entry_t link;
+
+    /**
+     * The magazines of each cpu, g_cpu_count entries
+     */
+    slab_cpu_t cpus[];
+};
+
+/**
+ * All the caches
+ */
+static list_t g_caches;
+static lock_t g_caches_lock = INIT_LOCK(TPL_HIGH_LEVEL);
+
+/**
+ * The size classes used by kalloc, spaced so no more than a third of an
+ * object is wasted. A size that is a multiple of 16, 32 or 64 bytes always
+ * gets a class that is a multiple of it too, so kalloc_aligned can use them.
+ */
+static size_t g_size_class_sizes[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+};
+static kmem_cache_t* g_size_classes[ARRAY_LEN(g_size_class_sizes)];
+
+/**
+ * Maps (size + 15) / 16 to the index of the size class
+ */
+static uint8_t g_size_class_index[SLAB_MAX_SIZE / SLAB_ALIGN + 1];
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Magazine pool
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Empty magazines that are not used by any cache, the magazines are carved
+ * out of whole pages so allocating them never recurses into the slabs
+ */
+static slab_magazine_t* g_magazine_pool = NULL;
+static lock_t g_magazine_pool_lock = INIT_LOCK(TPL_HIGH_LEVEL);
+
+static slab_magazine_t* magazine_get() {
+    acquire_lock(&g_magazine_pool_lock);
+
+    if (g_magazine_pool == NULL) {
+        slab_magazine_t* magazines = palloc(PAGE_SIZE);
+        if (magazines != NULL) {
+            for (size_t i = 0; i < PAGE_SIZE / sizeof(slab_magazine_t); i++) {
+                magazines[i].next = g_magazine_pool;
+                g_magazine_pool = &magazines[i];
+            }
+        }
+    }
+
+    slab_magazine_t* magazine = g_magazine_pool;
+    if (magazine != NULL) {
+        g_magazine_pool = magazine->next;
+        magazine->next = NULL;
+        magazine->rounds = 0;
+    }
+
+    release_lock(&g_magazine_pool_lock);
+    return magazine;
+}
+
+static void magazine_put(slab_magazine_t* magazine) {
+    acquire_lock(&g_magazine_pool_lock);
+    magazine->next = g_magazine_pool;
+    g_magazine_pool = magazine;
+    release_lock(&g_magazine_pool_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The slab layer, everything in here is called with the cache lock held
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void slab_move(slab_t* slab, list_t* list) {
+    list_remove(&slab->link);
+    list_push(list, &slab->link);
+}
+
+static slab_t* slab_create(kmem_cache_t* cache) {
+    slab_t* slab = palloc(cache->slab_size);
+    if (slab == NULL) {
+        return NULL;
+    }
+    pmm_set_owner(slab, cache->slab_size, slab);
+
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_objects = NULL;
+
+    // link the objects backwards, so they are handed out in address order
+    uint8_t* objects = (uint8_t*)slab + SLAB_HEADER_SIZE;
+    for (size_t i = cache->slab_objects; i > 0; i--) {
+        void** object = (void**)(objects + (i - 1) * cache->object_size);
+        *object = slab->free_objects;
+        slab->free_objects = object;
+    }
+
+    list_push(&cache->empty_slabs, &slab->link);
+    cache->empty_count++;
+    cache->slab_count++;
+    return slab;
+}
+
+static void* slab_alloc_object(kmem_cache_t* cache) {
+    slab_t* slab;
+    if (cache->partial_slabs.next != &cache->partial_slabs) {
+        slab = CR(cache->partial_slabs.next, slab_t, link);
+    } else {
+        if (cache->empty_count == 0 && slab_create(cache) == NULL) {
+            return NULL;
+        }
+        slab = CR(cache->empty_slabs.next, slab_t, link);
+        cache->empty_count--;
+        slab_move(slab, &cache->partial_slabs);
+    }
+
+    void** object = slab->free_objects;
+    slab->free_objects = *object;
+    slab->in_use++;
+
+    if (slab->in_use == cache->slab_objects) {
+        slab_move(slab, &cache->full_slabs);
+    }
+
+    cache->slab_allocs++;
+    return object;
+}
+
+static void slab_free_object(kmem_cache_t* cache, void* ptr) {
+    slab_t* slab = pmm_get_owner(ptr);
+    ASSERT(slab->cache == cache, "Freed object %p to the wrong cache (%s)", ptr, cache->name);
+
+    void** object = ptr;
+    *object = slab->free_objects;
+    slab->free_objects = object;
+    slab->in_use--;
+
+    if (slab->in_use == 0) {
+        slab_move(slab, &cache->empty_slabs);
+        cache->empty_count++;
+
+        // give the memory back if we have enough empty slabs around
+        if (cache->empty_count > SLAB_EMPTY_KEEP) {
+            list_remove(&slab->link);
+            cache->empty_count--;
+            cache->slab_count--;
+            pfree(slab, cache->slab_size);
+        }
+    } else if (slab->in_use == cache->slab_objects - 1) {
+        slab_move(slab, &cache->partial_slabs);
+    }
+
+    cache->slab_frees++;
+}
+
+/**
+ * Move objects from the slabs into the magazine
+ */
+static void slab_fill_magazine(kmem_cache_t* cache, slab_magazine_t* magazine, size_t count) {
+    while (magazine->rounds < count) {
+        void* object = slab_alloc_object(cache);
+        if (object == NULL) {
+            break;
+        }
+        magazine->objects[magazine->rounds++] = object;
+    }
+}
+
+/**
+ * Move objects from the magazine back to the slabs
+ */
+static void slab_drain_magazine(kmem_cache_t* cache, slab_magazine_t* magazine, size_t count) {
+    while (magazine->rounds > 0 && count > 0) {
+        slab_free_object(cache, magazine->objects[--magazine->rounds]);
+        count--;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The object cache api
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void depot_push(slab_magazine_t** depot, size_t* count, slab_magazine_t* magazine) {
+    magazine->next = *depot;
+    *depot = magazine;
+    (*count)++;
+}
+
+static slab_magazine_t* depot_pop(slab_magazine_t** depot, size_t* count) {
+    slab_magazine_t* magazine = *depot;
+    if (magazine != NULL) {
+        *depot = magazine->next;
+        (*count)--;
+    }
+    return magazine;
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size) {
+    size = ALIGN_UP(MAX(size, SLAB_ALIGN), SLAB_ALIGN);
+
+    // find the smallest slab that fits enough objects
+    size_t header_size = SLAB_HEADER_SIZE;
+    size_t slab_size = PAGE_SIZE;
+    while ((slab_size - header_size) / size < SLAB_MIN_OBJECTS && slab_size < PAGES_TO_SIZE(SLAB_MAX_PAGES)) {
+        slab_size *= 2;
+    }
+    if (slab_size - header_size < size) {
+        WARN("Object of cache %s is too big (%lu bytes)", name, size);
+        return NULL;
+    }
+
+    size_t cache_size = sizeof(kmem_cache_t) + g_cpu_count * sizeof(slab_cpu_t);
+    kmem_cache_t* cache = pallocz(cache_size);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    strncpy(cache->name, name, sizeof(cache->name) - 1);
+    cache->object_size = size;
+    cache->slab_size = slab_size;
+    cache->slab_objects = (slab_size - header_size) / size;
+    cache->lock = INIT_LOCK(TPL_HIGH_LEVEL);
+    list_init(&cache->partial_slabs);
+    list_init(&cache->full_slabs);
+    list_init(&cache->empty_slabs);
+
+    for (size_t i = 0; i < g_cpu_count; i++) {
+        cache->cpus[i].loaded = magazine_get();
+        cache->cpus[i].previous = magazine_get();
+        if (cache->cpus[i].loaded == NULL || cache->cpus[i].previous == NULL) {
+            goto failed;
+        }
+    }
+
+    acquire_lock(&g_caches_lock);
+    list_push(&g_caches, &cache->link);
+    release_lock(&g_caches_lock);
+
+    return cache;
+
+failed:
+    for (size_t i = 0; i < g_cpu_count; i++) {
+        if (cache->cpus[i].loaded != NULL) {
+            magazine_put(cache->cpus[i].loaded);
+        }
+        if (cache->cpus[i].previous != NULL) {
+            magazine_put(cache->cpus[i].previous);
+        }
+    }
+    pfree(cache, cache_size);
+    return NULL;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    slab_cpu_t* cpu = &cache->cpus[g_cpu_id];
+
+    if (cpu->loaded->rounds > 0) {
+        cpu->alloc_hits++;
+        return cpu->loaded->objects[--cpu->loaded->rounds];
+    }
+    cpu->alloc_misses++;
+
+    if (cpu->previous->rounds > 0) {
+        slab_magazine_t* magazine = cpu->loaded;
+        cpu->loaded = cpu->previous;
+        cpu->previous = magazine;
+        return cpu->loaded->objects[--cpu->loaded->rounds];
+    }
+
+    // both are empty, exchange one for a full magazine from
+    // the depot, or refill directly from the slabs
+    acquire_lock(&cache->lock);
+    slab_magazine_t* full = depot_pop(&cache->depot_full, &cache->depot_full_count);
+    if (full != NULL) {
+        depot_push(&cache->depot_empty, &cache->depot_empty_count, cpu->previous);
+        cpu->previous = cpu->loaded;
+        cpu->loaded = full;
+        cache->depot_exchanges++;
+    } else {
+        slab_fill_magazine(cache, cpu->loaded, SLAB_MAGAZINE_SIZE / 2);
+    }
+    release_lock(&cache->lock);
+
+    // out of memory
+    if (cpu->loaded->rounds == 0) {
+        return NULL;
+    }
+
+    return cpu->loaded->objects[--cpu->loaded->rounds];
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* ptr) {
+    slab_cpu_t* cpu = &cache->cpus[g_cpu_id];
+
+    if (cpu->loaded->rounds < SLAB_MAGAZINE_SIZE) {
+        cpu->free_hits++;
+        cpu->loaded->objects[cpu->loaded->rounds++] = ptr;
+        return;
+    }
+    cpu->free_misses++;
+
+    if (cpu->previous->rounds == 0) {
+        slab_magazine_t* magazine = cpu->loaded;
+        cpu->loaded = cpu->previous;
+        cpu->previous = magazine;
+        cpu->loaded->objects[cpu->loaded->rounds++] = ptr;
+        return;
+    }
+
+    // both are full, exchange one for an empty magazine, if we can't
+    // get an empty magazine then drain directly to the slabs
+    acquire_lock(&cache->lock);
+    slab_magazine_t* empty = depot_pop(&cache->depot_empty, &cache->depot_empty_count);
+    if (empty == NULL) {
+        empty = magazine_get();
+    }
+    if (empty != NULL) {
+        depot_push(&cache->depot_full, &cache->depot_full_count, cpu->previous);
+        cpu->previous = cpu->loaded;
+        cpu->loaded = empty;
+        cache->depot_exchanges++;
+    } else {
+        slab_drain_magazine(cache, cpu->loaded, SLAB_MAGAZINE_SIZE / 2);
+    }
+    release_lock(&cache->lock);
+
+    cpu->loaded->objects[cpu->loaded->rounds++] = ptr;
+}
+
+bool kmem_cache_reap(kmem_cache_t* cache) {
+    // racy check, so idle cpus don't take the lock for nothing
+    if (cache->depot_full_count <= SLAB_DEPOT_KEEP && cache->depot_empty_count <= SLAB_DEPOT_KEEP) {
+        return false;
+    }
+
+    slab_magazine_t* released = NULL;
+
+    acquire_lock(&cache->lock);
+    while (cache->depot_full_count > SLAB_DEPOT_KEEP) {
+        slab_magazine_t* magazine = depot_pop(&cache->depot_full, &cache->depot_full_count);
+        slab_drain_magazine(cache, magazine, SLAB_MAGAZINE_SIZE);
+        depot_push(&cache->depot_empty, &cache->depot_empty_count, magazine);
+    }
+    while (cache->depot_empty_count > SLAB_DEPOT_KEEP) {
+        slab_magazine_t* magazine = depot_pop(&cache->depot_empty, &cache->depot_empty_count);
+        magazine->next = released;
+        released = magazine;
+    }
+    release_lock(&cache->lock);
+
+    while (released != NULL) {
+        slab_magazine_t* next = released->next;
+        magazine_put(released);
+        released = next;
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Size classes
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+err_t init_slab() {
+    err_t err = NO_ERROR;
+
+    list_init(&g_caches);
+
+    size_t index = 0;
+    for (size_t i = 0; i < ARRAY_LEN(g_size_class_index); i++) {
+        while (i * SLAB_ALIGN > g_size_class_sizes[index]) {
+            index++;
+        }
+        g_size_class_index[i] = index;
+    }
+
+    for (size_t i = 0; i < ARRAY_LEN(g_size_class_sizes); i++) {
+        g_size_classes[i] = kmem_cache_create("kalloc", g_size_class_sizes[i]);
+        CHECK_ERROR(g_size_classes[i] != NULL, ERROR_OUT_OF_RESOURCES);
+    }
+
+    TRACE("Slab: %lu size classes up to %d bytes", ARRAY_LEN(g_size_class_sizes), SLAB_MAX_SIZE);
+
+cleanup:
+    return err;
+}
+
+void* slab_alloc(size_t size) {
+    ASSERT(size <= SLAB_MAX_SIZE);
+    return kmem_cache_alloc(g_size_classes[g_size_class_index[(size + SLAB_ALIGN - 1) / SLAB_ALIGN]]);
+}
+
+void slab_free(void* ptr) {
+    slab_t* slab = pmm_get_owner(ptr);
+    kmem_cache_free(slab->cache, ptr);
+}
+
+size_t slab_object_size(void* ptr) {
+    slab_t* slab = pmm_get_owner(ptr);
+    return slab->cache->object_size;
+}
+
+bool slab_reap() {
+    bool did_work = false;
+
+    acquire_lock(&g_caches_lock);
+    for (list_entry_t* it = g_caches.next; it != &g_caches; it = it->next) {
+        if (kmem_cache_reap(CR(it, kmem_cache_t, link))) {
+            did_work = true;
+        }
+    }
+    release_lock(&g_caches_lock);
+
+    return did_work;
+}
+
+void slab_dump_stats() {
+    TRACE("Slab stats:");
+
+    acquire_lock(&g_caches_lock);
+    for (list_entry_t* it = g_caches.next; it != &g_caches; it = it->next) {
+        kmem_cache_t* cache = CR(it, kmem_cache_t, link);
+
+        size_t hits = 0;
+        size_t ops = 0;
+        for (size_t cpu = 0; cpu < g_cpu_count; cpu++) {
+            hits += cache->cpus[cpu].alloc_hits + cache->cpus[cpu].free_hits;
+            ops += cache->cpus[cpu].alloc_hits + cache->cpus[cpu].alloc_misses +
+                   cache->cpus[cpu].free_hits + cache->cpus[cpu].free_misses;
+        }
+        if (ops == 0) {
+            continue;
+        }
+
+        TRACE("\t%s-%lu: %lu slabs of %lu KB (%lu objects), magazine hit %lu%%, "
+              "%lu depot exchanges, %lu/%lu slab allocs/frees, depot %lu full %lu empty",
+              cache->name, cache->object_size, cache->slab_count, cache->slab_size / SIZE_1KB,
+              cache->slab_objects, hits * 100 / ops, cache->depot_exchanges,
+              cache->slab_allocs, cache->slab_frees, cache->depot_full_count, cache->depot_empty_count);
+    }
+    release_lock(&g_caches_lock);
+}
@@ -0,0 +1,94 @@
+#ifndef TOMATOS_SLAB_H
+#define TOMATOS_SLAB_H
+
+#include <util/except.h>
+#include <util/defs.h>
+#include "mm.h"
+
+/**
+ * The biggest size served by the kalloc size classes, bigger
+ * allocations go to the tlsf heap
+ */
+#define SLAB_MAX_SIZE 1024
+
+/**
+ * An object cache, all the objects in a cache have the same size
+ */
+typedef struct kmem_cache kmem_cache_t;
+
+/**
+ * Create the kalloc size classes
+ *
+ * @remark
+ * Must be called after init_pmm and before the first kalloc
+ */
+err_t init_slab();
+
+/**
+ * Create a new object cache, caches are never destroyed. Objects are aligned
+ * to the biggest power of two that divides their size, up to a cache line
+ *
+ * @param name  [IN] The name of the cache, for the stats
+ * @param size  [IN] The size of each object
+ *
+ * @returns The cache, NULL if out of memory or the object is too big
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size);
+
+/**
+ * Allocate an object from the cache, the object is not zeroed
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+/**
+ * Free an object back to the cache it came from, this can be
+ * done from any cpu
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* ptr);
+
+/**
+ * Give full magazines in the depot and empty slabs of the cache
+ * back to the pmm, only keeping a small working set
+ *
+ * @returns true if anything was released
+ */
+bool kmem_cache_reap(kmem_cache_t* cache);
+
+/**
+ * Allocate from the smallest size class that fits the size, the
+ * size must be at most SLAB_MAX_SIZE
+ */
+void* slab_alloc(size_t size);
+
+/**
+ * Free an object of any cache
+ */
+void slab_free(void* ptr);
+
+/**
+ * Get the usable size of an object of any cache
+ */
+size_t slab_object_size(void* ptr);
+
+/**
+ * Slabs live in the direct map while the tlsf heap has its own range, so
+ * the address is enough to tell who owns an allocation
+ */
+static inline bool is_slab_object(void* ptr) {
+    return (uintptr_t)ptr >= DIRECT_BASE && (uintptr_t)ptr < DIRECT_END;
+}
+
+/**
+ * Reap all of the caches, should be called by cpus that have
+ * nothing better to do
+ *
+ * @returns true if anything was released
+ */
+bool slab_reap();
+
+/**
+ * Trace the usage and magazine hit rate of every cache
+ */
+void slab_dump_stats();
+
+#endif //TOMATOS_SLAB_H
@@ -17,9 +17,12 @@
 #define FL_COUNT (FL_MAX - FL_SHIFT + 1)
 
 // Block status bits are stored in the least significant bits of the size field.
+// A free block marked as zero has nothing but zeroes in its payload, other than
+// the free list links at the start and the prev field of the next block at the end.
 #define BLOCK_BIT_FREE      ((size_t)1)
 #define BLOCK_BIT_PREV_FREE ((size_t)2)
-#define BLOCK_BITS          (BLOCK_BIT_FREE | BLOCK_BIT_PREV_FREE)
+#define BLOCK_BIT_ZERO      ((size_t)4)
+#define BLOCK_BITS          (BLOCK_BIT_FREE | BLOCK_BIT_PREV_FREE | BLOCK_BIT_ZERO)
 
 // A free block must be large enough to store its header minus the size of the prev field.
 #define BLOCK_OVERHEAD   (sizeof(size_t))
@@ -90,6 +93,10 @@ TLSF_INL bool block_is_free(const tlsf_block* block) {
     return !!(block->header & BLOCK_BIT_FREE);
 }
 
+TLSF_INL bool block_is_zero(const tlsf_block* block) {
+    return !!(block->header & BLOCK_BIT_ZERO);
+}
+
 TLSF_INL bool block_is_prev_free(const tlsf_block* block) {
     return !!(block->header & BLOCK_BIT_PREV_FREE);
 }
@@ -266,7 +273,8 @@ TLSF_INL tlsf_block* block_split(tlsf_block* block, size_t size) {
     size_t rest_size = block_size(block) - (size + BLOCK_OVERHEAD);
     TLSF_ASSERT(block_size(block) == rest_size + size + BLOCK_OVERHEAD, "rest block size is wrong");
     TLSF_ASSERT(rest_size >= BLOCK_SIZE_MIN, "block split with invalid size");
-    rest->header = rest_size;
+    // The header of the rest was part of the payload, so a zero block stays zero
+    rest->header = rest_size | (block->header & BLOCK_BIT_ZERO);
     TLSF_ASSERT(!(rest_size % ALIGN_SIZE), "invalid block size");
     block_set_free(rest, true);
     block_set_size(block, size);
@@ -276,8 +284,15 @@ TLSF_INL tlsf_block* block_split(tlsf_block* block, size_t size) {
 // Absorb a free block's storage into an adjacent previous free block.
 TLSF_INL tlsf_block* block_absorb(tlsf_block* prev, tlsf_block* block) {
     TLSF_ASSERT(block_size(prev), "previous block can't be last");
-    // Note: Leaves flags untouched.
+    // Note: Leaves flags untouched, other than the zero bit which is only
+    // kept if both blocks are zero, in which case the header and the links
+    // of the absorbed block are now in the middle of the payload.
+    bool zero = block_is_zero(prev) && block_is_zero(block);
     prev->header += block_size(block) + BLOCK_OVERHEAD;
+    if (zero)
+        memset(block, 0, sizeof(tlsf_block));
+    else
+        prev->header &= ~BLOCK_BIT_ZERO;
     block_link_next(prev);
     return prev;
 }
@@ -341,6 +356,7 @@ TLSF_INL tlsf_block* block_ltrim_free(tlsf* t, tlsf_block* block, size_t size) {
 TLSF_INL void* block_use(tlsf* t, tlsf_block* block, size_t size) {
     block_rtrim_free(t, block, size);
     block_set_free(block, false);
+    block->header &= ~BLOCK_BIT_ZERO;
     return block_payload(block);
 }
 
@@ -361,12 +377,16 @@ static bool arena_grow(tlsf* t, size_t size) {
     if (!t->size)
         block->header = 0;
     check_sentinel(block);
-    block->header |= size | BLOCK_BIT_FREE;
+    // Memory that was never part of the arena is zero
+    bool zero = t->size >= t->high_water;
+    block->header |= size | BLOCK_BIT_FREE | (zero ? BLOCK_BIT_ZERO : 0);
     block = block_merge_prev(t, block);
     block_insert(t, block);
     tlsf_block* sentinel = block_link_next(block);
     sentinel->header = BLOCK_BIT_PREV_FREE;
     t->size = req_size;
+    if (t->size > t->high_water)
+        t->high_water = t->size;
     check_sentinel(sentinel);
     return true;
 }
@@ -411,6 +431,26 @@ TLSF_API void* tlsf_malloc(tlsf* t, size_t size) {
     return block_use(t, block, size);
 }
 
+TLSF_API void* tlsf_malloc_zero(tlsf* t, size_t size, bool* zero) {
+    *zero = false;
+    size = adjust_size(size, ALIGN_SIZE);
+    if (UNLIKELY(size > TLSF_MAX_SIZE))
+        return 0;
+    tlsf_block* block = block_find_free(t, size);
+    if (UNLIKELY(!block))
+        return 0;
+    bool was_zero = block_is_zero(block);
+    char* mem = block_use(t, block, size);
+    if (was_zero) {
+        // Clear the links and the prev field of the next block, which
+        // is now the last word of the payload.
+        memset(mem, 0, 2 * sizeof(tlsf_block*));
+        memset(mem + block_size(block) - BLOCK_OVERHEAD, 0, BLOCK_OVERHEAD);
+        *zero = true;
+    }
+    return mem;
+}
+
 TLSF_API void* tlsf_aalloc(tlsf* t, size_t align, size_t size) {
     size_t adjust = adjust_size(size, ALIGN_SIZE);
 
@@ -448,6 +488,48 @@ TLSF_API void tlsf_free(tlsf* t, void* mem) {
         block_insert(t, block);
 }
 
+TLSF_API size_t tlsf_usable_size(void* mem) {
+    return block_size(block_from_payload(mem));
+}
+
+// Release the whole pages inside of a free block through tlsf_release, the
+// rest of the payload is cleared so the block can be marked as zero.
+TLSF_INL size_t block_trim(tlsf* t, tlsf_block* block, size_t page_size) {
+    char* payload = block_payload(block);
+    char* head = payload + 2 * sizeof(tlsf_block*);
+    char* tail = payload + block_size(block) - BLOCK_OVERHEAD;
+    char* start = align_ptr(head, page_size);
+    char* end = (char*)((size_t)tail & ~(page_size - 1));
+    if (end <= start)
+        return 0;
+    memset(head, 0, (size_t)(start - head));
+    memset(end, 0, (size_t)(tail - end));
+    tlsf_release(t, start, (size_t)(end - start));
+    block->header |= BLOCK_BIT_ZERO;
+    return (size_t)(end - start);
+}
+
+// Release the pages behind all the free blocks of at least min_size, blocks
+// that are already zero are skipped since their pages were either released
+// already or never used. Returns the amount of bytes released.
+TLSF_API size_t tlsf_trim(tlsf* t, size_t min_size, size_t page_size) {
+    uint32_t min_fl, min_sl;
+    mapping(adjust_size(min_size, ALIGN_SIZE), &min_fl, &min_sl);
+
+    size_t released = 0;
+    for (uint32_t fl = min_fl; fl < FL_COUNT; fl++) {
+        if (!(t->fl & (1U << fl)))
+            continue;
+        for (uint32_t sl = fl == min_fl ? min_sl : 0; sl < SL_COUNT; sl++) {
+            for (tlsf_block* block = t->block[fl][sl]; block; block = block->next_free) {
+                if (block_size(block) >= min_size && !block_is_zero(block))
+                    released += block_trim(t, block, page_size);
+            }
+        }
+    }
+    return released;
+}
+
 TLSF_API void* tlsf_realloc(tlsf* t, void* mem, size_t size) {
     // Zero-size requests are treated as free.
     if (UNLIKELY(mem && !size)) {
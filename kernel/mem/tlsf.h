@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -17,13 +18,22 @@ typedef struct {
     uint32_t fl, sl[_TLSF_FL_COUNT];
     struct tlsf_block_* block[_TLSF_FL_COUNT][_TLSF_SL_COUNT];
     size_t size;
+
+    // The biggest the arena ever was, memory past this point was never handed out
+    // so it is known to be zero (tlsf_resize must give zeroed memory when growing).
+    // The user may lower it once the memory past it was released.
+    size_t high_water;
 } tlsf;
 
 TLSF_API void* tlsf_resize(tlsf*, size_t);
+TLSF_API void tlsf_release(tlsf*, void*, size_t);
 TLSF_API void* tlsf_aalloc(tlsf*, size_t, size_t);
 TLSF_API void* tlsf_malloc(tlsf*, size_t);
+TLSF_API void* tlsf_malloc_zero(tlsf*, size_t, bool*);
 TLSF_API void* tlsf_realloc(tlsf*, void*, size_t);
 TLSF_API void tlsf_free(tlsf*, void*);
+TLSF_API size_t tlsf_usable_size(void*);
+TLSF_API size_t tlsf_trim(tlsf*, size_t, size_t);
 
 #ifdef TLSF_ENABLE_CHECK
 TLSF_API void tlsf_check(tlsf*);
@@ -2,6 +2,7 @@
 #include <util/except.h>
 #include <util/trace.h>
 #include <mem/pmm.h>
+#include <mem/mm.h>
 
 #include "arch/intrin.h"
 #include "mem/vmm.h"
@@ -32,20 +33,49 @@ extern symbol_t __kernel_end_data;
 static physptr_t m_zero_page = 0;
 
 /**
- * The vmm editing lock
+ * The editing locks, one for every top level entry. Page tables are installed
+ * with a cmpxchg so the heap faults can map pages without any of these, the
+ * locks only keep the other primitives from changing the same range at once.
  */
-static lock_t m_vmm_lock;
+#define SLOT_COUNT 512
+static lock_t m_slot_locks[SLOT_COUNT] = {
+    [0 ... SLOT_COUNT - 1] = INIT_LOCK(TPL_HIGH_LEVEL)
+};
 
 /**
  * The top level table
  */
 static directptr_t m_pml4;
 
+/**
+ * The amount of on-demand faults on the heap, reads map the
+ * zero page and writes allocate a new page
+ */
+static size_t m_heap_read_faults = 0;
+static size_t m_heap_write_faults = 0;
+
+/**
+ * Can we map 1GB pages
+ */
+static bool m_gbpages = false;
+
+/**
+ * The amount of 4KB, 2MB and 1GB pages mapped by vmm_map, and the
+ * amount of huge pages we had to split into smaller pages
+ */
+static size_t m_mapped_pages[3] = { 0 };
+static size_t m_huge_splits = 0;
+
+/**
+ * Can we flush the global pages with invpcid
+ */
+static bool m_invpcid = false;
+
 static void init_vmm_features() {
-    IA32_CR4 cr4 = __readcr4();
+    uint32_t max_leaf;
     uint32_t num;
 
-    // TODO: global pages
+    cpuid(CPUID_SIGNATURE, &max_leaf, NULL, NULL, NULL);
 
     ////////////////////////////////////
     // Feature Information
@@ -58,15 +88,70 @@ static void init_vmm_features() {
     ASSERT(num & BIT16, "PAT must be supported");
     TRACE("\t* PAT");
 
+    //----------------------------------
+    // Global pages - Must be supported
+    //----------------------------------
+    ASSERT(num & BIT13, "Global pages must be supported");
+    TRACE("\t* Global pages");
+
+    ////////////////////////////////////
+    // Structured Extended Feature Flags
+    ////////////////////////////////////
+    if (max_leaf >= 0x7) {
+        cpuidex(0x7, 0, NULL, &num, NULL, NULL);
+
+        //----------------------------------
+        // INVPCID - optional
+        //----------------------------------
+        if (num & BIT10) {
+            m_invpcid = true;
+            TRACE("\t* INVPCID");
+        }
+    }
+
+    ////////////////////////////////////
+    // Extended Feature Information
+    ////////////////////////////////////
+    cpuid(0x80000001, NULL, NULL, NULL, &num);
+
+    //----------------------------------
+    // 1GB pages - optional
+    //----------------------------------
+    if (num & BIT26) {
+        m_gbpages = true;
+        TRACE("\t* 1GB pages");
+    }
+}
+
+/**
+ * Enable the paging features on the current cpu, the control
+ * registers and the pat are per cpu
+ */
+static void enable_vmm_features() {
     uint64_t pat = __rdmsr(MSR_IA32_PAT);
     pat &= 0xFFFFFFFF;
     pat |= (PAT_WC << 32);
     __wrmsr(MSR_IA32_PAT, pat);
 
-    ////////////////////////////////////
-    // apply it
-    ////////////////////////////////////
+    IA32_CR4 cr4 = __readcr4();
+    cr4.PGE = 1;
+    __writecr4(cr4);
+}
 
+/**
+ * Flush the whole tlb of the current cpu, including the global pages
+ */
+static void flush_all() {
+    if (m_invpcid) {
+        __invpcid(INVPCID_ALL_GLOBAL, 0, 0);
+        return;
+    }
+
+    // changing the global pages bit flushes everything
+    IA32_CR4 cr4 = __readcr4();
+    cr4.PGE = 0;
+    __writecr4(cr4);
+    cr4.PGE = 1;
     __writecr4(cr4);
 }
 
@@ -81,19 +166,20 @@ err_t init_vmm() {
     stivale2_struct_tag_memmap_t* memap = get_stivale2_tag(STIVALE2_STRUCT_TAG_MEMMAP_ID);
     CHECK(memap != NULL);
 
-    // enable cpu features
+    // check the cpu features, they are enabled
+    // once we switch to our address space
     init_vmm_features();
 
     // allocate the zero page
-    directptr_t zero_page = page_alloc();
-    memset(zero_page, 0, PAGE_SIZE);
+    directptr_t zero_page = pallocz(PAGE_SIZE);
+    CHECK_ERROR(zero_page != NULL, ERROR_OUT_OF_RESOURCES);
     m_zero_page = DIRECT_TO_PHYS(zero_page);
 
     TRACE("Creating mappings");
 
     // initialize the kernel address space
-    m_vmm_lock = INIT_LOCK(TPL_HIGH_LEVEL);
-    m_pml4 = page_alloc();
+    m_pml4 = pallocz(PAGE_SIZE);
+    CHECK_ERROR(m_pml4 != NULL, ERROR_OUT_OF_RESOURCES);
 
     // create the kernel mappings
     TRACE("\t* mapping physical memory");
@@ -102,7 +188,8 @@ err_t init_vmm() {
         if (
             entry->type == STIVALE2_MMAP_RESERVED ||
             entry->type == STIVALE2_MMAP_USABLE ||
-            entry->type == STIVALE2_MMAP_BOOTLOADER_RECLAIMABLE
+            entry->type == STIVALE2_MMAP_BOOTLOADER_RECLAIMABLE ||
+            entry->type == STIVALE2_MMAP_ACPI_RECLAIMABLE
         ) {
             uintptr_t base = ALIGN_DOWN(entry->base, PAGE_SIZE);
             size_t page_count = (ALIGN_UP(entry->base + entry->length + entry->unused, PAGE_SIZE) - base) / PAGE_SIZE;
@@ -111,6 +198,9 @@ err_t init_vmm() {
     }
 
     // create kernel mappings
+    TRACE("\t\t* %lu 1GB pages, %lu 2MB pages, %lu 4KB pages",
+          m_mapped_pages[2], m_mapped_pages[1], m_mapped_pages[0]);
+
     TRACE("\t* mapping kernel");
     size_t rx_pages = (__kernel_end_text - __kernel_start_text) / PAGE_SIZE;
     size_t ro_pages = (__kernel_end_rodata - __kernel_end_text) / PAGE_SIZE;
@@ -128,64 +218,571 @@ cleanup:
 
 void set_address_space() {
     __writecr3(DIRECT_TO_PHYS(m_pml4));
+    enable_vmm_features();
+
+    // the bootloader might have left global pages behind
+    flush_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// TLB shootdown
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Flushing more pages than this one by one is slower than flushing
+ * the whole tlb and taking the misses
+ */
+#define FLUSH_FULL_THRESHOLD 32
+
+/**
+ * The amount of separate ranges a batch keeps, past that it
+ * turns into a full flush
+ */
+#define TLB_BATCH_RANGES 8
+
+/**
+ * How many pages we free at once
+ */
+#define RELEASE_BATCH 64
+
+/**
+ * The mappings we changed while holding the vmm lock, and the pages that
+ * can only be freed once no cpu can reach them through its tlb anymore
+ */
+typedef struct tlb_batch {
+    struct {
+        uintptr_t virt;
+        size_t pages;
+    } ranges[TLB_BATCH_RANGES];
+    size_t range_count;
+    size_t pages;
+    bool full;
+
+    directptr_t free_pages[RELEASE_BATCH];
+    size_t free_count;
+
+    /**
+     * A single huge page, it is freed as one allocation
+     */
+    directptr_t free_huge;
+    size_t free_huge_size;
+} tlb_batch_t;
+
+/**
+ * Add a range to the batch, a huge page only needs its first page in
+ * here since invlpg drops the whole page no matter its size
+ */
+static void tlb_batch_add(tlb_batch_t* batch, uintptr_t virt, size_t pages) {
+    if (batch->full) {
+        return;
+    }
+
+    // most of the time we unmap a contiguous range page by page
+    if (batch->range_count != 0 &&
+        batch->ranges[batch->range_count - 1].virt + PAGES_TO_SIZE(batch->ranges[batch->range_count - 1].pages) == virt) {
+        batch->ranges[batch->range_count - 1].pages += pages;
+    } else if (batch->range_count < TLB_BATCH_RANGES) {
+        batch->ranges[batch->range_count].virt = virt;
+        batch->ranges[batch->range_count].pages = pages;
+        batch->range_count++;
+    } else {
+        batch->full = true;
+    }
+
+    batch->pages += pages;
+    if (batch->pages > FLUSH_FULL_THRESHOLD) {
+        batch->full = true;
+    }
+}
+
+static bool tlb_batch_empty(tlb_batch_t* batch) {
+    return batch->range_count == 0 && !batch->full;
+}
+
+/**
+ * Flush a batch from the tlb of the current cpu
+ */
+static void flush_batch(tlb_batch_t* batch) {
+    if (batch->full) {
+        flush_all();
+        return;
+    }
+
+    for (size_t i = 0; i < batch->range_count; i++) {
+        for (size_t j = 0; j < batch->ranges[i].pages; j++) {
+            __invlpg(batch->ranges[i].virt + PAGES_TO_SIZE(j));
+        }
+    }
+}
+
+/**
+ * The cpus that run on the kernel address space and take part in
+ * shootdowns, and their lapic ids
+ */
+static uint64_t m_shootdown_cpus[ARRAY_LEN(g_cpu_locals) / 64];
+static uint32_t m_shootdown_lapic_ids[ARRAY_LEN(g_cpu_locals)];
+static size_t m_shootdown_cpu_count = 0;
+
+/**
+ * Only one shootdown is in flight at a time, the cpus it targets flush the
+ * batch, clear their pending flag and count themselves off the waiting count
+ */
+static lock_t m_shootdown_lock = INIT_LOCK(TPL_HIGH_LEVEL);
+static tlb_batch_t m_shootdown_batch;
+static bool m_shootdown_pending[ARRAY_LEN(g_cpu_locals)];
+static size_t m_shootdown_waiting = 0;
+
+/**
+ * The amount of shootdowns, the ipis we sent for them, and the pages
+ * they flushed (not counting the ones that turned into full flushes)
+ */
+static size_t m_shootdowns = 0;
+static size_t m_shootdown_ipis = 0;
+static size_t m_shootdown_pages = 0;
+static size_t m_shootdown_full = 0;
+
+void init_tlb_shootdown() {
+    m_shootdown_lapic_ids[g_cpu_id] = g_lapic_id;
+    __atomic_fetch_or(&m_shootdown_cpus[g_cpu_id / 64], 1ull << (g_cpu_id % 64), __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&m_shootdown_cpu_count, 1, __ATOMIC_RELEASE);
+
+    // whatever was unmapped before anyone knew about us
+    flush_all();
+}
+
+bool vmm_shootdowns_ready() {
+    return g_cpu_count <= 1 || __atomic_load_n(&m_shootdown_cpu_count, __ATOMIC_ACQUIRE) == g_cpu_count;
+}
+
+void vmm_handle_shootdown() {
+    // nothing in flight, this is the common case when spinning on a lock
+    if (__atomic_load_n(&m_shootdown_waiting, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+
+    if (!__atomic_exchange_n(&m_shootdown_pending[g_cpu_id], false, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    flush_batch(&m_shootdown_batch);
+    __atomic_fetch_sub(&m_shootdown_waiting, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Flush the batch from the tlb of all the cpus and then free the pages in
+ * it, must be called without the vmm lock held
+ */
+static void finish_batch(tlb_batch_t* batch) {
+    if (!tlb_batch_empty(batch)) {
+        // we spin on the lock with interrupts disabled, but acquire_lock
+        // handles shootdowns of other cpus while it spins
+        acquire_lock(&m_shootdown_lock);
+
+        // take the cpus once, one that joins after this flushes on its own
+        uint64_t cpus[ARRAY_LEN(m_shootdown_cpus)];
+        size_t targets = 0;
+        for (size_t i = 0; i < ARRAY_LEN(cpus); i++) {
+            cpus[i] = __atomic_load_n(&m_shootdown_cpus[i], __ATOMIC_SEQ_CST);
+        }
+        cpus[g_cpu_id / 64] &= ~(1ull << (g_cpu_id % 64));
+        for (size_t i = 0; i < ARRAY_LEN(cpus); i++) {
+            targets += __builtin_popcountll(cpus[i]);
+        }
+
+        if (targets != 0) {
+            // the targets count themselves off once they flushed
+            m_shootdown_batch = *batch;
+            __atomic_store_n(&m_shootdown_waiting, targets, __ATOMIC_RELEASE);
+
+            // a single ipi for every cpu, no matter how much is in the batch
+            for (size_t cpu = 0; cpu < g_cpu_count; cpu++) {
+                if (cpus[cpu / 64] & (1ull << (cpu % 64))) {
+                    __atomic_store_n(&m_shootdown_pending[cpu], true, __ATOMIC_RELEASE);
+                    lapic_send_fixed_ipi(m_shootdown_lapic_ids[cpu], IPI_TLB_SHOOTDOWN);
+                }
+            }
+        }
+
+        // flush our own tlb while the others are at it
+        flush_batch(batch);
+
+        while (__atomic_load_n(&m_shootdown_waiting, __ATOMIC_ACQUIRE) != 0) {
+            cpu_spin();
+        }
+
+        m_shootdowns++;
+        m_shootdown_ipis += targets;
+        if (batch->full) {
+            m_shootdown_full++;
+        } else {
+            m_shootdown_pages += batch->pages;
+        }
+
+        release_lock(&m_shootdown_lock);
+    }
+
+    // now nothing can reach the pages
+    pfree_bulk(batch->free_count, batch->free_pages);
+    if (batch->free_huge != NULL) {
+        pfree(batch->free_huge, batch->free_huge_size);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Map and Unmap primitives
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static err_t get_page(uintptr_t virt, uint64_t** page) {
-    err_t err = NO_ERROR;
+/**
+ * The levels of the paging structures, a level 1 entry is a 4KB page,
+ * level 2 entries can map 2MB pages and level 3 entries 1GB pages
+ */
+#define LEVEL_SHIFT(level) (12u + 9u * ((level) - 1))
+#define LEVEL_SIZE(level) (1ull << LEVEL_SHIFT(level))
+#define LEVEL_PAGES(level) (1ull << (9u * ((level) - 1)))
+#define LEVEL_INDEX(virt, level) (((virt) >> LEVEL_SHIFT(level)) & 0x1ffu)
+
+/**
+ * The amount of pages from an address to the end of the range covered by
+ * an entry of the given level, for 4KB pages this is the end of the page table
+ */
+static size_t pages_to_end(uintptr_t virt, int level) {
+    if (level == 1) {
+        level = 2;
+    }
+    return LEVEL_PAGES(level) - ((virt >> 12u) & (LEVEL_PAGES(level) - 1));
+}
+
+/**
+ * The top level slots a primitive works on, they are always locked
+ * from the lowest to the highest so two primitives can't deadlock
+ */
+typedef struct slot_set {
+    uint64_t bits[SLOT_COUNT / 64];
+} slot_set_t;
+
+static void add_slots(slot_set_t* set, uintptr_t virt, size_t pages) {
+    if (pages == 0) {
+        return;
+    }
+
+    size_t first = LEVEL_INDEX(virt, 4);
+    size_t last = LEVEL_INDEX(virt + PAGES_TO_SIZE(pages) - 1, 4);
+    for (size_t i = first; i <= last; i++) {
+        set->bits[i / 64] |= 1ull << (i % 64);
+    }
+}
+
+static void lock_slots(slot_set_t* set) {
+    for (size_t i = 0; i < SLOT_COUNT; i++) {
+        if (set->bits[i / 64] & (1ull << (i % 64))) {
+            acquire_lock(&m_slot_locks[i]);
+        }
+    }
+}
 
-    CHECK(page != NULL);
+static void unlock_slots(slot_set_t* set) {
+    // every lock restores the tpl from before it, so
+    // they are released in the reverse order
+    for (size_t i = SLOT_COUNT; i-- > 0;) {
+        if (set->bits[i / 64] & (1ull << (i % 64))) {
+            release_lock(&m_slot_locks[i]);
+        }
+    }
+}
 
+/**
+ * The most page tables we take from the pmm at once
+ */
+#define TABLE_STASH_SIZE 16
+
+/**
+ * Page tables taken from the pmm in bulk, so mapping a big range does
+ * not go to the pmm for every table it creates
+ */
+typedef struct table_stash {
+    directptr_t tables[TABLE_STASH_SIZE];
+    size_t count;
+
+    /**
+     * About how many tables we might still need
+     */
+    size_t needed;
+} table_stash_t;
+
+/**
+ * A stash for mapping the given amount of pages, a range that fits in
+ * a couple of page tables just allocates them one by one
+ */
+static void init_table_stash(table_stash_t* stash, size_t pages) {
+    stash->count = 0;
+    stash->needed = pages / LEVEL_PAGES(2) + 2;
+}
+
+static directptr_t alloc_table(table_stash_t* stash) {
+    if (stash == NULL || stash->needed <= 2) {
+        return pallocz(PAGE_SIZE);
+    }
+
+    if (stash->count == 0) {
+        stash->count = palloc_bulk(MIN(stash->needed, TABLE_STASH_SIZE), stash->tables);
+        if (stash->count == 0) {
+            return pallocz(PAGE_SIZE);
+        }
+    }
+
+    stash->needed--;
+    directptr_t table = stash->tables[--stash->count];
+    memset(table, 0, PAGE_SIZE);
+    return table;
+}
+
+/**
+ * Give back the tables we did not use, must be called
+ * without the vmm lock
+ */
+static void free_table_stash(table_stash_t* stash) {
+    pfree_bulk(stash->count, stash->tables);
+    stash->count = 0;
+}
+
+/**
+ * Find the entry that maps an address, at whatever level it is
+ *
+ * @param virt      [IN]    The address
+ * @param level     [OUT]   The level of the entry, or of the first entry that is not present
+ *
+ * @returns The entry, NULL if the address is not mapped
+ */
+static uint64_t* get_leaf(uintptr_t virt, int* level) {
     uint64_t* table = m_pml4;
-    for (int level = 4; level > 1; level--) {
-        uint64_t* entry = &table[(virt >> (12u + 9u * (level - 1))) & 0x1ffu];
+    for (*level = 4; *level > 1; (*level)--) {
+        uint64_t* entry = &table[LEVEL_INDEX(virt, *level)];
+        uint64_t value = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+        if (!(value & PM_PRESENT)) {
+            return NULL;
+        }
 
-        // check if present
-        CHECK_ERROR(*entry & PM_PRESENT, ERROR_NOT_FOUND);
+        // a huge page
+        if (value & PM_SIZE) {
+            return entry;
+        }
 
-        // get the next layer
-        table = PHYS_TO_DIRECT(PM_ADDR(*entry));
+        table = PHYS_TO_DIRECT(PM_ADDR(value));
     }
 
-    CHECK_ERROR(table[(virt >> 12u) & 0x1ffu] & PM_PRESENT, ERROR_NOT_FOUND);
-    *page = &table[(virt >> 12u) & 0x1ffu];
+    uint64_t* entry = &table[LEVEL_INDEX(virt, 1)];
+    return (__atomic_load_n(entry, __ATOMIC_RELAXED) & PM_PRESENT) ? entry : NULL;
+}
 
-cleanup:
-    return err;
+/**
+ * Get the entry of the given level for an address, present or not,
+ * NULL if a table above it is missing or is a huge page
+ */
+static uint64_t* get_entry(uintptr_t virt, int level) {
+    uint64_t* table = m_pml4;
+    for (int i = 4; i > level; i--) {
+        uint64_t entry = __atomic_load_n(&table[LEVEL_INDEX(virt, i)], __ATOMIC_ACQUIRE);
+        if (!(entry & PM_PRESENT) || (entry & PM_SIZE)) {
+            return NULL;
+        }
+        table = PHYS_TO_DIRECT(PM_ADDR(entry));
+    }
+    return &table[LEVEL_INDEX(virt, level)];
+}
+
+/**
+ * Replace a huge page with a table of smaller pages mapping the same memory
+ * with the same flags, a 1GB page turns into 2MB pages and a 2MB page into
+ * 4KB pages. The translation does not change, so only the tlb entry of the
+ * huge page has to go.
+ *
+ * @returns false if we could not allocate the table
+ */
+static bool split_huge(uint64_t* entry, int level, uintptr_t virt) {
+    uint64_t* table = palloc(PAGE_SIZE);
+    if (table == NULL) {
+        return false;
+    }
+
+    // the pat bit is in the address bits of a huge page, and bit 7
+    // of a 4KB page is the pat and not the size
+    physptr_t phys = PM_ADDR(*entry) & ~(LEVEL_SIZE(level) - 1);
+    uint64_t flags = *entry & (PM_XD | 0xfffull);
+    if (level == 2) {
+        flags &= ~PM_SIZE;
+    }
+
+    for (size_t i = 0; i < 512; i++) {
+        table[i] = flags | (phys + i * LEVEL_SIZE(level - 1));
+    }
+
+    // the permissions are on the new entries
+    __atomic_store_n(entry, DIRECT_TO_PHYS(table) | PM_PRESENT | PM_WRITE, __ATOMIC_RELEASE);
+    __invlpg(virt);
+
+    __atomic_fetch_add(&m_huge_splits, 1, __ATOMIC_RELAXED);
+    return true;
 }
 
-static uint64_t* get_or_alloc_page(uintptr_t virt, uint64_t flags_and, uint64_t flags_or) {
+/**
+ * Make sure an entry above the leaves points to a table and has the given
+ * flags. The entry is only changed with a cmpxchg, so walkers that don't
+ * hold the slot lock can race on it, the loser gives its table back.
+ *
+ * @returns false if we ran out of memory
+ */
+static bool install_table(uint64_t* entry, uint64_t flags_and, uint64_t flags_or, table_stash_t* stash) {
+    directptr_t table = NULL;
+
+    uint64_t old = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint64_t value;
+        if (old & PM_PRESENT) {
+            // only write when the flags change, most of
+            // the time they are already there
+            value = (old & flags_and) | flags_or;
+            if (value == old) {
+                break;
+            }
+        } else {
+            if (table == NULL) {
+                table = alloc_table(stash);
+                if (table == NULL) {
+                    return false;
+                }
+            }
+            value = (DIRECT_TO_PHYS(table) & flags_and) | flags_or;
+        }
+
+        if (__atomic_compare_exchange_n(entry, &old, value, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (!(old & PM_PRESENT)) {
+                table = NULL;
+            }
+            break;
+        }
+    }
+
+    // someone else installed a table first
+    if (table != NULL) {
+        pfree(table, PAGE_SIZE);
+    }
+
+    return true;
+}
+
+/**
+ * Walk down to the entry of the given level for an address, allocating the
+ * missing tables on the way (from the stash if there is one) and splitting
+ * the huge pages that are in the way
+ *
+ * @returns The entry, NULL if we ran out of memory
+ */
+static uint64_t* get_or_alloc_entry(uintptr_t virt, int level, uint64_t flags_and, uint64_t flags_or, table_stash_t* stash) {
     uint64_t* table = m_pml4;
-    for (int level = 4; level > 1; level--) {
-        uint64_t* entry = &table[(virt >> (12u + 9u * (level - 1))) & 0x1ffu];
+    for (int i = 4; i > level; i--) {
+        uint64_t* entry = &table[LEVEL_INDEX(virt, i)];
 
-        // check if need to allocate entry
-        if (!(*entry & PM_PRESENT)) {
-            directptr_t ptr = page_alloc();
-            if (ptr == NULL) {
+        // we need finer pages than what is mapped here, huge pages
+        // are only created and split with the slot lock held
+        uint64_t value = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+        if ((value & PM_PRESENT) && (value & PM_SIZE)) {
+            if (!split_huge(entry, i, virt)) {
                 return NULL;
             }
+        }
 
-            memset(ptr, 0, PAGE_SIZE);
-            *entry = DIRECT_TO_PHYS(ptr);
+        if (!install_table(entry, flags_and, flags_or, stash)) {
+            return NULL;
         }
-        *entry &= flags_and;
-        *entry |= flags_or;
 
         // get the next layer
-        table = PHYS_TO_DIRECT(PM_ADDR(*entry));
+        table = PHYS_TO_DIRECT(PM_ADDR(__atomic_load_n(entry, __ATOMIC_ACQUIRE)));
     }
 
-    return &table[(virt >> 12u) & 0x1ffu];
+    return &table[LEVEL_INDEX(virt, level)];
+}
+
+static uint64_t* get_or_alloc_page(uintptr_t virt, uint64_t flags_and, uint64_t flags_or, table_stash_t* stash) {
+    return get_or_alloc_entry(virt, 1, flags_and, flags_or, stash);
+}
+
+/**
+ * Check that a huge page can be placed in an entry, a page table that is
+ * in the way is only thrown away if nothing is mapped through it
+ */
+static bool prepare_huge_entry(uint64_t* entry, int level, tlb_batch_t* batch) {
+    if (!(*entry & PM_PRESENT) || (*entry & PM_SIZE)) {
+        return true;
+    }
+
+    // don't go looking through whole page directories
+    if (level != 2) {
+        return false;
+    }
+
+    // no room to free it later
+    if (batch->free_count == RELEASE_BATCH) {
+        return false;
+    }
+
+    uint64_t* table = PHYS_TO_DIRECT(PM_ADDR(*entry));
+    for (size_t i = 0; i < 512; i++) {
+        if (table[i] & PM_PRESENT) {
+            return false;
+        }
+    }
+
+    // the paging structure caches might still point to the
+    // table, and only a full flush gets all of them
+    __atomic_store_n(entry, 0, __ATOMIC_RELEASE);
+    batch->full = true;
+    batch->free_pages[batch->free_count++] = table;
+    return true;
+}
+
+/**
+ * The biggest page that can map the start of a range
+ */
+static int huge_level(uintptr_t virt, physptr_t phys, size_t pages) {
+    for (int level = m_gbpages ? 3 : 2; level > 1; level--) {
+        if (((virt | phys) & (LEVEL_SIZE(level) - 1)) == 0 && pages >= LEVEL_PAGES(level)) {
+            return level;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Clear the first pages of a range we failed to map, so the caller can
+ * free the pages it wanted to map, must be called with the slot locks held
+ */
+static void unmap_partial(uintptr_t virt, size_t pages, tlb_batch_t* batch) {
+    uintptr_t end = virt + PAGES_TO_SIZE(pages);
+    while (virt < end) {
+        int level;
+        uint64_t* entry = get_leaf(virt, &level);
+        if (entry == NULL) {
+            virt += PAGE_SIZE;
+            continue;
+        }
+
+        __atomic_store_n(entry, 0, __ATOMIC_RELAXED);
+        tlb_batch_add(batch, virt, 1);
+        virt = ALIGN_DOWN(virt, LEVEL_SIZE(level)) + LEVEL_SIZE(level);
+    }
 }
 
 err_t vmm_map(uintptr_t virt, physptr_t phys, size_t pages, page_perms_t perms) {
     err_t err = NO_ERROR;
+    uintptr_t start = virt;
+    tlb_batch_t batch = { 0 };
+    table_stash_t stash;
+    slot_set_t slots = { 0 };
 
-    acquire_lock(&m_vmm_lock);
+    init_table_stash(&stash, pages);
+
+    add_slots(&slots, virt, pages);
+    lock_slots(&slots);
 
     uint64_t flags_add = PM_PRESENT;
     if (perms & MAP_WRITE) {
@@ -200,51 +797,432 @@ err_t vmm_map(uintptr_t virt, physptr_t phys, size_t pages, page_perms_t perms)
         // flags_add |= PM_XD;
     }
 
-    while (pages--) {
+    while (pages > 0) {
+        // use the biggest page we can, unless there are
+        // already smaller pages mapped in there
+        int level = huge_level(virt, phys, pages);
+        uint64_t* entry;
+        for (;;) {
+            entry = get_or_alloc_entry(virt, level, ~flags_remove, flags_add, &stash);
+            CHECK_ERROR(entry != NULL, ERROR_OUT_OF_RESOURCES);
+            if (level == 1 || prepare_huge_entry(entry, level, &batch)) {
+                break;
+            }
+            level--;
+        }
+
+        if (level == 1) {
+            // fill the rest of the page table in one go, we only
+            // walk again when moving to the next one
+            size_t count = MIN(pages, pages_to_end(virt, 1));
+            for (size_t i = 0; i < count; i++) {
+                // mapping over a page, like the zero page of the heap
+                if (__atomic_load_n(&entry[i], __ATOMIC_RELAXED) & PM_PRESENT) {
+                    tlb_batch_add(&batch, virt + PAGES_TO_SIZE(i), 1);
+                }
+
+                // everything we map is kernel memory so it is all global
+                __atomic_store_n(&entry[i], flags_add | PM_GLOBAL | (phys + PAGES_TO_SIZE(i)), __ATOMIC_RELAXED);
+            }
+            __atomic_fetch_add(&m_mapped_pages[0], count, __ATOMIC_RELAXED);
+
+            virt += PAGES_TO_SIZE(count);
+            phys += PAGES_TO_SIZE(count);
+            pages -= count;
+            continue;
+        }
+
+        // mapping over a huge page
+        if (__atomic_load_n(entry, __ATOMIC_RELAXED) & PM_PRESENT) {
+            tlb_batch_add(&batch, virt, 1);
+        }
+
         // set this page as mapped
-        uint64_t* entry = get_or_alloc_page(virt, ~flags_remove, flags_add);
-        CHECK_ERROR(entry != NULL, ERROR_OUT_OF_RESOURCES);
-        *entry = flags_add | phys;
+        __atomic_store_n(entry, flags_add | PM_GLOBAL | phys | PM_SIZE, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&m_mapped_pages[level - 1], 1, __ATOMIC_RELAXED);
 
         // next page
-        virt += PAGE_SIZE;
-        phys += PAGE_SIZE;
+        virt += LEVEL_SIZE(level);
+        phys += LEVEL_SIZE(level);
+        pages -= LEVEL_PAGES(level);
     }
 
 cleanup:
-    release_lock(&m_vmm_lock);
+    if (IS_ERROR(err)) {
+        unmap_partial(start, (virt - start) / PAGE_SIZE, &batch);
+    }
+
+    unlock_slots(&slots);
+
+    finish_batch(&batch);
+    free_table_stash(&stash);
 
     return err;
 }
 
 err_t vmm_unmap(uintptr_t virt, size_t pages) {
     err_t err = NO_ERROR;
+    uintptr_t end = virt + PAGES_TO_SIZE(pages);
+    tlb_batch_t batch = { 0 };
+    slot_set_t slots = { 0 };
 
-    acquire_lock(&m_vmm_lock);
+    add_slots(&slots, virt, pages);
+    lock_slots(&slots);
 
-    while (pages--) {
-        // get and unmap the page
-        uint64_t* entry;
-        CHECK_AND_RETHROW(get_page(virt, &entry));
-        *entry = 0;
+    while (virt < end) {
+        // get the page
+        int level;
+        uint64_t* entry = get_leaf(virt, &level);
+        CHECK_ERROR(entry != NULL, ERROR_NOT_FOUND);
+
+        // only part of a huge page is unmapped, split it and try again
+        if (level > 1 && ((virt & (LEVEL_SIZE(level) - 1)) != 0 || end - virt < LEVEL_SIZE(level))) {
+            CHECK_ERROR(split_huge(entry, level, virt), ERROR_OUT_OF_RESOURCES);
+            continue;
+        }
+
+        if (level == 1) {
+            // clear the rest of the range in this page table
+            size_t count = MIN((end - virt) / PAGE_SIZE, pages_to_end(virt, 1));
+            size_t i;
+            for (i = 0; i < count && (__atomic_load_n(&entry[i], __ATOMIC_RELAXED) & PM_PRESENT); i++) {
+                __atomic_store_n(&entry[i], 0, __ATOMIC_RELAXED);
+            }
+            if (i != 0) {
+                tlb_batch_add(&batch, virt, i);
+            }
+            CHECK_ERROR(i == count, ERROR_NOT_FOUND);
 
-        // invalidate the page
-        __invlpg(virt);
+            virt += PAGES_TO_SIZE(count);
+            continue;
+        }
+
+        // unmap and invalidate the page, invlpg drops
+        // a huge page with a single address
+        __atomic_store_n(entry, 0, __ATOMIC_RELAXED);
+        tlb_batch_add(&batch, virt, 1);
 
         // next page
-        virt += PAGE_SIZE;
+        virt += LEVEL_SIZE(level);
+    }
+
+cleanup:
+    unlock_slots(&slots);
+
+    finish_batch(&batch);
+
+    return err;
+}
+
+err_t vmm_map_pages(uintptr_t virt, directptr_t* pages, size_t count, page_perms_t perms) {
+    err_t err = NO_ERROR;
+    tlb_batch_t batch = { 0 };
+    table_stash_t stash;
+    slot_set_t slots = { 0 };
+
+    init_table_stash(&stash, count);
+
+    add_slots(&slots, virt, count);
+    lock_slots(&slots);
+
+    uint64_t flags_add = PM_PRESENT;
+    if (perms & MAP_WRITE) {
+        flags_add |= PM_WRITE;
+    }
+
+    uint64_t flags_remove = 0;
+    if (perms & MAP_EXEC) {
+        flags_remove |= PM_XD;
+    }
+
+    uint64_t* table = NULL;
+    size_t i;
+    for (i = 0; i < count; i++, virt += PAGE_SIZE) {
+        size_t index = (virt >> 12u) & 0x1ffu;
+
+        // only walk when moving to a new page table
+        if (table == NULL || index == 0) {
+            uint64_t* entry = get_or_alloc_page(virt, ~flags_remove, flags_add, &stash);
+            CHECK_ERROR(entry != NULL, ERROR_OUT_OF_RESOURCES);
+            table = entry - index;
+        }
+
+        // a heap fault might be mapping the zero page in here right now
+        uint64_t old = __atomic_exchange_n(&table[index], flags_add | PM_GLOBAL | DIRECT_TO_PHYS(pages[i]), __ATOMIC_ACQ_REL);
+        DEBUG_ASSERT(!(old & PM_PRESENT) || PM_ADDR(old) == m_zero_page, "Tried to map over a real page at %p", virt);
+
+        // only the zero page mapping could be cached
+        if (old & PM_PRESENT) {
+            tlb_batch_add(&batch, virt, 1);
+        }
+    }
+
+cleanup:
+    if (IS_ERROR(err)) {
+        unmap_partial(virt - PAGES_TO_SIZE(i), i, &batch);
     }
 
+    unlock_slots(&slots);
+
+    finish_batch(&batch);
+    free_table_stash(&stash);
+
+    return err;
+}
+
+err_t vmm_virt_to_phys(uintptr_t virt, physptr_t* phys) {
+    err_t err = NO_ERROR;
+    lock_t* lock = &m_slot_locks[LEVEL_INDEX(virt, 4)];
+
+    acquire_lock(lock);
+
+    int level;
+    uint64_t* entry = get_leaf(virt, &level);
+    CHECK_ERROR(entry != NULL, ERROR_NOT_FOUND);
+    *phys = PM_ADDR(__atomic_load_n(entry, __ATOMIC_RELAXED)) + (virt & (LEVEL_SIZE(level) - 1));
+
 cleanup:
-    release_lock(&m_vmm_lock);
+    release_lock(lock);
 
     return err;
 }
 
+/**
+ * Get everything vmm_move needs ready: the tables of the destination are
+ * allocated, and the huge pages of the source that can't be moved as a
+ * whole are split. None of this changes what is mapped.
+ */
+static err_t prepare_move(uintptr_t from, uintptr_t to, size_t pages, tlb_batch_t* batch) {
+    err_t err = NO_ERROR;
+
+    size_t i = 0;
+    while (i < pages) {
+        uintptr_t src_virt = from + PAGES_TO_SIZE(i);
+        uintptr_t dst_virt = to + PAGES_TO_SIZE(i);
+
+        int level;
+        uint64_t* src = get_leaf(src_virt, &level);
+
+        if (level > 1) {
+            // holes stay holes
+            if (src == NULL) {
+                i += pages_to_end(src_virt, level);
+                continue;
+            }
+
+            // a huge page that lines up with the destination is moved as is
+            if (((src_virt | dst_virt) & (LEVEL_SIZE(level) - 1)) == 0 && pages - i >= LEVEL_PAGES(level)) {
+                uint64_t* dst = get_or_alloc_entry(dst_virt, level, ~0ull, PM_PRESENT | PM_WRITE, NULL);
+                CHECK_ERROR(dst != NULL, ERROR_OUT_OF_RESOURCES);
+                if (prepare_huge_entry(dst, level, batch)) {
+                    i += LEVEL_PAGES(level);
+                    continue;
+                }
+            }
+
+            CHECK_ERROR(split_huge(src, level, src_virt), ERROR_OUT_OF_RESOURCES);
+            continue;
+        }
+
+        // make sure the page table of the destination exists
+        CHECK_ERROR(get_or_alloc_page(dst_virt, ~0ull, PM_PRESENT | PM_WRITE, NULL) != NULL, ERROR_OUT_OF_RESOURCES);
+        i += MIN(pages_to_end(src_virt, 1), pages_to_end(dst_virt, 1));
+    }
+
+cleanup:
+    return err;
+}
+
+err_t vmm_move(uintptr_t from, uintptr_t to, size_t pages) {
+    err_t err = NO_ERROR;
+    tlb_batch_t batch = { 0 };
+    slot_set_t slots = { 0 };
+
+    // the source range is reused once we return, so every cpu must flush it
+    CHECK(vmm_shootdowns_ready());
+
+    add_slots(&slots, from, pages);
+    add_slots(&slots, to, pages);
+    lock_slots(&slots);
+
+    // once we start moving entries nothing can fail
+    CHECK_AND_RETHROW(prepare_move(from, to, pages, &batch));
+
+    // now move the entries, walking once per page table
+    size_t i = 0;
+    while (i < pages) {
+        uintptr_t src_virt = from + PAGES_TO_SIZE(i);
+        uintptr_t dst_virt = to + PAGES_TO_SIZE(i);
+
+        int level;
+        uint64_t* src = get_leaf(src_virt, &level);
+
+        if (level > 1) {
+            // huge pages were lined up by prepare_move
+            if (src != NULL) {
+                uint64_t* dst = get_entry(dst_virt, level);
+                DEBUG_ASSERT(!(*dst & PM_PRESENT), "Tried to move over a mapped page at %p", dst_virt);
+                __atomic_store_n(dst, __atomic_exchange_n(src, 0, __ATOMIC_ACQ_REL), __ATOMIC_RELEASE);
+                tlb_batch_add(&batch, src_virt, 1);
+            }
+            i += pages_to_end(src_virt, level);
+            continue;
+        }
+
+        // move everything up to the end of either page table
+        uint64_t* src_table = get_entry(src_virt, 1);
+        uint64_t* dst_table = get_entry(dst_virt, 1);
+        size_t count = MIN(MIN(pages_to_end(src_virt, 1), pages_to_end(dst_virt, 1)), pages - i);
+        for (size_t j = 0; j < count; j++) {
+            // holes stay holes
+            if (!(__atomic_load_n(&src_table[j], __ATOMIC_RELAXED) & PM_PRESENT)) {
+                continue;
+            }
+
+            DEBUG_ASSERT(!(dst_table[j] & PM_PRESENT), "Tried to move over a mapped page at %p", dst_virt + PAGES_TO_SIZE(j));
+            __atomic_store_n(&dst_table[j], __atomic_exchange_n(&src_table[j], 0, __ATOMIC_ACQ_REL), __ATOMIC_RELAXED);
+            tlb_batch_add(&batch, src_virt + PAGES_TO_SIZE(j), 1);
+        }
+        i += count;
+    }
+
+cleanup:
+    unlock_slots(&slots);
+
+    // the destination was not mapped, so only the source can be cached
+    finish_batch(&batch);
+
+    return err;
+}
+
+size_t vmm_release(uintptr_t virt, size_t pages) {
+    size_t released = 0;
+    uintptr_t end = virt + PAGES_TO_SIZE(pages);
+
+    // the pages can only be freed once all the cpus flushed them, so
+    // we go in batches and flush every batch after dropping the lock,
+    // a batch never goes past the slot it started in
+    while (virt < end) {
+        tlb_batch_t batch = { 0 };
+        size_t slot = LEVEL_INDEX(virt, 4);
+
+        acquire_lock(&m_slot_locks[slot]);
+
+        while (virt < end && LEVEL_INDEX(virt, 4) == slot && batch.free_count < RELEASE_BATCH && batch.free_huge == NULL) {
+            // walk down to the page table, skipping the whole range
+            // covered by an entry that is not present
+            uint64_t* table = m_pml4;
+            int level;
+            for (level = 4; level > 1; level--) {
+                uint64_t entry = __atomic_load_n(&table[LEVEL_INDEX(virt, level)], __ATOMIC_ACQUIRE);
+                if (!(entry & PM_PRESENT) || (entry & PM_SIZE)) {
+                    break;
+                }
+                table = PHYS_TO_DIRECT(PM_ADDR(entry));
+            }
+
+            if (level > 1) {
+                // huge pages come from a single allocation, so
+                // they can only be given back as a whole
+                uint64_t* entry = &table[LEVEL_INDEX(virt, level)];
+                if (__atomic_load_n(entry, __ATOMIC_RELAXED) & PM_PRESENT) {
+                    if ((virt & (LEVEL_SIZE(level) - 1)) == 0 && end - virt >= LEVEL_SIZE(level)) {
+                        batch.free_huge = PHYS_TO_DIRECT(PM_ADDR(__atomic_exchange_n(entry, 0, __ATOMIC_ACQ_REL)));
+                        batch.free_huge_size = LEVEL_SIZE(level);
+                        tlb_batch_add(&batch, virt, 1);
+                        released += LEVEL_PAGES(level);
+                    } else {
+                        WARN("Tried to release part of a huge page at %p", virt);
+                    }
+                }
+
+                virt = ALIGN_DOWN(virt, LEVEL_SIZE(level)) + LEVEL_SIZE(level);
+                continue;
+            }
+
+            // a heap fault might be mapping the page right now, so
+            // we free whatever we took out of the entry
+            uint64_t old = __atomic_exchange_n(&table[LEVEL_INDEX(virt, 1)], 0, __ATOMIC_ACQ_REL);
+            if (old & PM_PRESENT) {
+                physptr_t phys = PM_ADDR(old);
+                tlb_batch_add(&batch, virt, 1);
+
+                // pages that were only read point to the zero page
+                if (phys != m_zero_page) {
+                    batch.free_pages[batch.free_count++] = PHYS_TO_DIRECT(phys);
+                }
+            }
+
+            virt += PAGE_SIZE;
+        }
+
+        release_lock(&m_slot_locks[slot]);
+
+        released += batch.free_count;
+        finish_batch(&batch);
+    }
+
+    return released;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Page fault handling
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Map a single page of the heap without taking any lock, so faults on different
+ * cpus don't wait for each other. The tables are installed with a cmpxchg and
+ * the page only replaces an entry that is not present or that maps the zero page,
+ * if another cpu got a page in there first we leave it be. The heap is only ever
+ * mapped with 4KB pages, so none of the tables we walk through can be freed.
+ *
+ * @param used  [OUT] Did the page end up mapped, if not the caller can free it
+ */
+static err_t map_heap_page(uintptr_t virt, physptr_t phys, page_perms_t perms, bool* used) {
+    err_t err = NO_ERROR;
+    tlb_batch_t batch = { 0 };
+
+    *used = false;
+
+    uint64_t* table = m_pml4;
+    for (int level = 4; level > 1; level--) {
+        uint64_t* entry = &table[LEVEL_INDEX(virt, level)];
+        CHECK_ERROR(install_table(entry, ~0ull, PM_PRESENT | PM_WRITE, NULL), ERROR_OUT_OF_RESOURCES);
+
+        uint64_t value = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+        CHECK(!(value & PM_SIZE), "Found a huge page in the heap at %p", virt);
+        table = PHYS_TO_DIRECT(PM_ADDR(value));
+    }
+
+    uint64_t value = PM_PRESENT | PM_GLOBAL | phys;
+    if (perms & MAP_WRITE) {
+        value |= PM_WRITE;
+    }
+
+    uint64_t* entry = &table[LEVEL_INDEX(virt, 1)];
+    uint64_t old = __atomic_load_n(entry, __ATOMIC_RELAXED);
+    do {
+        // a real page is never replaced, and the zero page
+        // is only replaced by a real one
+        if ((old & PM_PRESENT) && (PM_ADDR(old) != m_zero_page || phys == m_zero_page)) {
+            goto cleanup;
+        }
+    } while (!__atomic_compare_exchange_n(entry, &old, value, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    *used = true;
+    __atomic_fetch_add(&m_mapped_pages[0], 1, __ATOMIC_RELAXED);
+
+    // other cpus might still read the zero page
+    if (old & PM_PRESENT) {
+        tlb_batch_add(&batch, virt, 1);
+    }
+
+cleanup:
+    finish_batch(&batch);
+
+    return err;
+}
+
 err_t vmm_handle_pagefault(uintptr_t addr, page_fault_params_t params) {
     err_t err = NO_ERROR;
 
@@ -261,18 +1239,32 @@ err_t vmm_handle_pagefault(uintptr_t addr, page_fault_params_t params) {
         // for pages which are just being read we map to the same zero page and we map them as read only,
         // for pages which are written we allocate a new page and map it as rw.
         //
+        // faults are handled without taking the vmm locks, so two cpus might fault on the same page
+        // at once, in which case the first one to map a real page wins.
+        //
+        bool used;
 
         if (params.write) {
+            __atomic_fetch_add(&m_heap_write_faults, 1, __ATOMIC_RELAXED);
+
             // this is on a write, we don't care if there was a mapping or not because we
-            // create a new page anyways
-            directptr_t dpage = page_alloc();
+            // create a new page anyways, the heap only accesses it through
+            // this mapping so it can come from the movable pageblocks, it must
+            // be zeroed just like the zero page we would have mapped on a read,
+            // and it comes from the node of the arena, not the one we run on
+            directptr_t dpage = pallocz_movable_node(kheap_node_of(addr), PAGE_SIZE);
             CHECK_ERROR(dpage != NULL, ERROR_OUT_OF_RESOURCES);
             physptr_t page = DIRECT_TO_PHYS(dpage);
-            CHECK_AND_RETHROW(vmm_map(ALIGN_DOWN(addr, PAGE_SIZE), page, 1, MAP_WRITE));
+            CHECK_AND_RETHROW(map_heap_page(ALIGN_DOWN(addr, PAGE_SIZE), page, MAP_WRITE, &used));
+            if (!used) {
+                pfree(dpage, PAGE_SIZE);
+            }
         } else {
+            __atomic_fetch_add(&m_heap_read_faults, 1, __ATOMIC_RELAXED);
+
             // this is on a read, there is no way to disable reading on a page
             // so this 100% a missing page, map the zero page onto it
-            CHECK_AND_RETHROW(vmm_map(ALIGN_DOWN(addr, PAGE_SIZE), m_zero_page, 1, MAP_READ));
+            CHECK_AND_RETHROW(map_heap_page(ALIGN_DOWN(addr, PAGE_SIZE), m_zero_page, MAP_READ, &used));
         }
 
         // make sure the address is invalidated
@@ -291,3 +1283,14 @@ err_t vmm_handle_pagefault(uintptr_t addr, page_fault_params_t params) {
 cleanup:
     return err;
 }
+
+void vmm_dump_stats() {
+    TRACE("VMM stats: %lu heap read faults, %lu heap write faults",
+          m_heap_read_faults, m_heap_write_faults);
+    TRACE("VMM stats: mapped %lu 1GB pages, %lu 2MB pages, %lu 4KB pages, split %lu huge pages",
+          m_mapped_pages[2], m_mapped_pages[1], m_mapped_pages[0], m_huge_splits);
+    TRACE("VMM stats: %lu shootdowns, %lu ipis, %lu pages flushed (%lu per shootdown), %lu full flushes",
+          m_shootdowns, m_shootdown_ipis, m_shootdown_pages,
+          m_shootdowns == m_shootdown_full ? 0 : m_shootdown_pages / (m_shootdowns - m_shootdown_full),
+          m_shootdown_full);
+}
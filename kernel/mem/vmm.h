@@ -12,7 +12,8 @@ err_t init_vmm();
 
 /**
  * Will set the address space of the current cpu to the
- * kernel address space.
+ * kernel address space, and enable the paging features
+ * of the cpu. Must be called once by every cpu.
  */
 void set_address_space();
 
@@ -26,10 +27,109 @@ typedef enum page_perms {
     MAP_EXEC   = BIT1,
 } page_perms_t;
 
+/**
+ * Map a physically contiguous range, if we fail in the middle nothing
+ * of the range is left mapped
+ */
 err_t vmm_map(uintptr_t virt, physptr_t phys, size_t pages, page_perms_t perms);
 
 err_t vmm_unmap(uintptr_t virt, size_t pages);
 
+/**
+ * Map an array of pages to a virtual range, the page tables are only walked
+ * once for every page table the range touches instead of once for every page
+ *
+ * @remark
+ * The range must not be backed by real pages already, it can have
+ * pages that map the zero page. If we fail in the middle nothing of
+ * the range is left mapped, so the caller can free the pages.
+ *
+ * @param virt  [IN] The start of the range, page aligned
+ * @param pages [IN] The pages to map, in the direct map
+ * @param count [IN] The amount of pages
+ * @param perms [IN] The permissions of the pages
+ */
+err_t vmm_map_pages(uintptr_t virt, directptr_t* pages, size_t count, page_perms_t perms);
+
+/**
+ * Move the pages of a range to another range without copying them, like
+ * mremap, the entries are moved and the old range is left unmapped. The
+ * tlb of all the cpus is flushed once for the whole range.
+ *
+ * @remark
+ * The destination must not be mapped, holes in the source
+ * are kept as holes in the destination
+ *
+ * @param from  [IN] The start of the source range, page aligned
+ * @param to    [IN] The start of the destination range, page aligned
+ * @param pages [IN] The amount of pages to move
+ *
+ * @retval ERROR_CHECK_FAILED       Not every cpu takes part in shootdowns yet,
+ *                                  nothing was moved
+ * @retval ERROR_OUT_OF_RESOURCES   Could not allocate the page tables of the
+ *                                  destination, nothing was moved
+ */
+err_t vmm_move(uintptr_t from, uintptr_t to, size_t pages);
+
+/**
+ * Get the physical address a virtual address is mapped to
+ *
+ * @param virt  [IN]    The virtual address
+ * @param phys  [OUT]   The physical address
+ *
+ * @retval ERROR_NOT_FOUND  The address is not mapped
+ */
+err_t vmm_virt_to_phys(uintptr_t virt, physptr_t* phys);
+
+/**
+ * Unmap a range of on-demand memory (the heap) and give the pages behind it
+ * back to the pmm, the next access will fault the memory in again as zeroes.
+ *
+ * @remark
+ * Unlike vmm_unmap the range can have holes, pages that were never
+ * faulted in (or only read) are simply skipped
+ *
+ * Must only be used once vmm_shootdowns_ready, before that another cpu
+ * might still write to the pages through its tlb once they are reused
+ *
+ * @param virt  [IN] The start of the range, page aligned
+ * @param pages [IN] The amount of pages in the range
+ *
+ * @returns The amount of pages given back to the pmm
+ */
+size_t vmm_release(uintptr_t virt, size_t pages);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// TLB shootdown
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Every primitive that takes away or changes a mapping flushes it from the tlb
+ * of all the cpus before it returns, and the pages it unmapped are only freed
+ * after that. The changes are batched and flushed once the vmm locks are released,
+ * with a single ipi to every other cpu (or a full flush for big batches).
+ */
+
+/**
+ * Start taking part in tlb shootdowns, must be called by every
+ * cpu once it runs on the kernel address space and its lapic
+ * is initialized
+ */
+void init_tlb_shootdown();
+
+/**
+ * Check if every cpu takes part in shootdowns, until then memory that was
+ * unmapped can't be reused since a cpu that did not join yet is not flushed
+ */
+bool vmm_shootdowns_ready();
+
+/**
+ * Flush whatever another cpu asked us to flush, this is called from the
+ * shootdown ipi and while spinning on locks, since that might be done with
+ * interrupts disabled
+ */
+void vmm_handle_shootdown();
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Buffer handling
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -53,4 +153,9 @@ err_t vmm_unmap(uintptr_t virt, size_t pages);
  */
 err_t vmm_handle_pagefault(uintptr_t addr, page_fault_params_t params);
 
+/**
+ * Trace the amount of on-demand faults the heap took
+ */
+void vmm_dump_stats();
+
 #endif //TOMATOS_VMM_H
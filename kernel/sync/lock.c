@@ -7,7 +7,7 @@ void acquire_lock(lock_t* lock) {
 
     size_t ticket = atomic_fetch_add_explicit(&lock->next_ticket, 1, memory_order_relaxed);
     while (atomic_load_explicit(&lock->now_serving, memory_order_acquire) != ticket) {
-        cpu_pause();
+        cpu_spin();
     }
 
     lock->owner_tpl = raise_tpl(lock->tpl);
@@ -16,8 +16,10 @@ void acquire_lock(lock_t* lock) {
 bool acquire_lock_or_fail(lock_t* lock) {
     DEBUG_ASSERT(lock != NULL, "Tried to acquire a NULL lock");
 
+    // the lock is free only if the next ticket is the one being served, so
+    // take that ticket only if nobody else took it in the meantime
     size_t ticket = atomic_load_explicit(&lock->now_serving, memory_order_relaxed);
-    bool result = atomic_compare_exchange_strong_explicit(&lock->now_serving, &ticket, ticket + 1, memory_order_relaxed, memory_order_acquire);
+    bool result = atomic_compare_exchange_strong_explicit(&lock->next_ticket, &ticket, ticket + 1, memory_order_acquire, memory_order_relaxed);
 
     if (result) {
         lock->owner_tpl = raise_tpl(lock->tpl);
@@ -1,5 +1,9 @@
 #include "sched.h"
 
+#include <mem/alloc_trace.h>
+#include <mem/pmm.h>
+#include <mem/slab.h>
+
 /**
  * This lock protects the scheduler list
  */
@@ -62,6 +66,16 @@ noreturn void task_dispatcher() {
         release_lock(&m_sched_lock);
 
         if (task_link == NULL) {
+            pmm_stats_tick();
+
+            // use the idle time to zero some pages, give cached
+            // objects and free heap memory back and stream out the
+            // allocation trace, and check for new tasks again before
+            // actually idling
+            if (pmm_fill_zero_pool() || slab_reap() || kheap_trim() || alloc_trace_flush()) {
+                continue;
+            }
+
             // we are going to wait for a trigger
             if (m_has_monitor) {
                 __mwait(0, 0);
@@ -17,6 +17,8 @@ typedef char symbol_t[];
 
 #define PACKED __attribute__((packed))
 
+#define CACHE_LINE_SIZE 64
+
 #define MAX(a,b) ((a) > (b) ? a : b)
 #define MIN(a,b) ((a) < (b) ? a : b)
 
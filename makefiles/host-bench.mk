@@ -0,0 +1,58 @@
+
+#
+# Host side benchmarks of the memory allocators, the allocators are compiled
+# against a small shim of the kernel apis (bench/shim) and ran as a normal
+# linux program, so allocator changes can be evaluated without booting
+#
+
+HOST_CC 			?= cc
+
+HOST_BENCH_CFLAGS	:= -O2 -g -std=gnu11 -pthread
+HOST_BENCH_CFLAGS	+= -Wall -Wno-unused-label -Wno-unused-function -Wno-unused-variable
+# the kernel printf formats are not quite the libc ones
+HOST_BENCH_CFLAGS	+= -Wno-format
+HOST_BENCH_CFLAGS	+= -include bench/shim/host.h
+HOST_BENCH_CFLAGS	+= -Ibench/shim -Ikernel
+HOST_BENCH_CFLAGS	+= -DDIRECT_BASE=0x200000000000ull
+
+ifeq ($(PAGE_COLORING), 1)
+	HOST_BENCH_CFLAGS += -D__TOMATOS_PAGE_COLORING__
+endif
+
+ifeq ($(PMM_LATENCY), 1)
+	HOST_BENCH_CFLAGS += -D__TOMATOS_PMM_LATENCY__
+endif
+
+HOST_BENCH_SRCS		:= kernel/mem/pmm.c kernel/mem/numa.c kernel/mem/tlsf.c kernel/mem/slab.c kernel/cont/list.c
+HOST_BENCH_SRCS		+= bench/host.c bench/bench.c bench/replay.c bench/vmm.c
+
+HOST_BENCH_BUILD_DIR := build/host-bench
+HOST_BENCH_OBJS		:= $(HOST_BENCH_SRCS:%=$(HOST_BENCH_BUILD_DIR)/%.o)
+-include $(HOST_BENCH_OBJS:%.o=%.d)
+
+.PHONY: host-bench host-replay
+
+$(HOST_BENCH_BUILD_DIR)/%.c.o: %.c
+	@echo HOST_CC $@
+	@mkdir -p $(@D)
+	@$(HOST_CC) $(HOST_BENCH_CFLAGS) -MMD -c $< -o $@
+
+bin/host-bench/bench: $(HOST_BENCH_OBJS)
+	@echo HOST_LD $@
+	@mkdir -p $(@D)
+	@$(HOST_CC) $(HOST_BENCH_CFLAGS) -o $@ $^
+
+#
+# Build and run the benchmarks
+#
+host-bench: bin/host-bench/bench
+	@./bin/host-bench/bench
+
+#
+# Replay an allocation trace (made with ALLOC_TRACE=1 and scripts/alloc_trace.py)
+# against one of the heaps, REPLAY_HEAP is tlsf, slab+tlsf or libc
+#
+REPLAY_HEAP ?= tlsf
+
+host-replay: bin/host-bench/bench
+	@./bin/host-bench/bench --replay $(TRACE) $(REPLAY_HEAP)
@@ -12,6 +12,15 @@ QEMU_ARGS += -cpu Nehalem
 # We require iommu
 QEMU_ARGS += -device intel-iommu,aw-bits=48
 
+# Split the memory and cpus between two numa nodes
+ifeq ($(NUMA), 1)
+	QEMU_ARGS += -object memory-backend-ram,size=2G,id=mem0
+	QEMU_ARGS += -object memory-backend-ram,size=2G,id=mem1
+	QEMU_ARGS += -numa node,nodeid=0,cpus=0-1,memdev=mem0
+	QEMU_ARGS += -numa node,nodeid=1,cpus=2-3,memdev=mem1
+	QEMU_ARGS += -numa dist,src=0,dst=1,val=20
+endif
+
 ifeq ($(DEBUGGER), 1)
 	QEMU_ARGS += -S -s
 endif
@@ -0,0 +1,48 @@
+import fileinput
+import re
+import struct
+import sys
+
+ansi_escape = re.compile(r'\x1B\[[0-?]*[ -/]*[@-~]')
+event_pattern = re.compile(r'!AT ([0-9a-fA-F]+) ([0-9a-fA-F]+) ([0-9a-fA-F]+) ([0-9a-fA-F]+) ([0-9a-fA-F]+) ([0-9a-fA-F]+)')
+
+# must match alloc_trace_type_t and alloc_trace_event_t (mem/alloc_trace.h)
+type_names = ['kalloc', 'krealloc', 'kfree', 'palloc', 'pfree', 'dropped']
+ALLOC_TRACE_DROPPED = 5
+event_struct = struct.Struct('<QQQQII')
+
+
+if len(sys.argv) < 2:
+    print("missing required argument: <output filename>")
+    sys.exit(1)
+
+
+# the events of every cpu are flushed in batches, so they
+# only come out in order per cpu
+events = []
+with fileinput.FileInput("-") as file_in:
+    for line in file_in:
+        line = ansi_escape.sub('', line)
+        event_match = event_pattern.search(line)
+        if event_match:
+            type, cpu, time, ptr, old_ptr, size = [int(field, 16) for field in event_match.groups()]
+            events.append((time, ptr, old_ptr, size, cpu, type))
+
+events.sort(key=lambda event: event[0])
+
+counts = [0] * len(type_names)
+dropped = 0
+with open(sys.argv[1], 'wb') as file_out:
+    for event in events:
+        file_out.write(event_struct.pack(*event))
+        if event[5] < len(type_names):
+            counts[event[5]] += 1
+        if event[5] == ALLOC_TRACE_DROPPED:
+            dropped += event[3]
+
+print("wrote {} events to {}".format(len(events), sys.argv[1]))
+for name, count in zip(type_names, counts):
+    if count != 0 and name != 'dropped':
+        print("  {:10} {}".format(name, count))
+if dropped != 0:
+    print("warning: {} events were dropped by the kernel, the replay will not be exact".format(dropped))